@@ -0,0 +1,145 @@
+#ifndef ASSIGNMENT_BVH_H
+#define ASSIGNMENT_BVH_H
+
+#include "lib/shaders/rt_structure.h"
+
+#include <functional>
+#include <vector>
+
+namespace cg {
+enum class BVHBuildMethod {
+    // split at the median centroid along the axis of maximum extent
+    MEDIAN,
+    // binned surface area heuristic
+    SAH,
+    // linear BVH from sorted Morton codes, much faster to build but yields a worse tree
+    LBVH,
+    // binned SAH that may also split triangle references spatially, duplicating triangles that straddle the split
+    // plane. only triangles can be split, BVHs built from bounds alone use SAH instead
+    SBVH,
+};
+
+struct BVHBuildOptions {
+    /**
+     * Computes the Morton codes of the centroids (normalized to centroidBounds) and sorts them, together with the
+     * primitive indices, in ascending order.
+     * @return false if the codes could not be sorted, the builder then falls back to sorting on the CPU
+     */
+    typedef std::function<bool(const std::vector<float3> &centroids, const Bounds3 &centroidBounds,
+                               std::vector<uint> &codes, std::vector<uint> &indices)> MortonSorter;
+
+    BVHBuildMethod method = BVHBuildMethod::SAH;
+    // number of centroid bins per axis used by the SAH builder
+    uint sahBins = 16;
+    // maximum number of primitives in a leaf, at most BVH_MAX_LEAF_SIZE
+    uint maxLeafSize = 4;
+    // relative costs of a node traversal and a primitive intersection
+    float traversalCost = 1.0f;
+    float intersectionCost = 1.0f;
+    // number of build threads, 0 for one per hardware thread
+    uint threads = 0;
+    // a refitted tree is rebuilt once its SAH cost exceeds the cost right after the build by this factor
+    float maxRefitCostRatio = 1.5f;
+    // SBVH: spatial splits stop once they have added this fraction of the triangle count as extra references
+    float spatialSplitBudget = 0.3f;
+    // SBVH: spatial splits are only tried where the children of the object split overlap by more than this fraction
+    // of the root's surface area
+    float spatialSplitOverlap = 1e-5f;
+    // leaves of the treelets restructured after the build to lower the SAH cost, at most 7. 0 disables the pass, it
+    // takes about as long as a binned SAH build
+    uint treeletSize = 0;
+    // emit the nodes again after the build, with the child of larger surface area directly behind its parent
+    bool reorderNodes = false;
+    // MEDIAN and SAH: ranges of more than maxLeafSize and at most this many primitives (up to 65535) become leaves
+    // without being split, leaving the rest of their subtree for later. 0 builds the whole tree. Only the CPU
+    // renderer can trace such a BVH, WideBVHScene builds a deferred subtree the first time a ray reaches it
+    uint deferredLeafSize = 0;
+    // sorts Morton codes for the LBVH builder, e.g. on an OpenCL device
+    MortonSorter mortonSorter;
+
+    // preset for interactive editing, where the scene is rebuilt often
+    static BVHBuildOptions fastRebuild() {
+        BVHBuildOptions options;
+        options.method = BVHBuildMethod::LBVH;
+        return options;
+    }
+
+    // preset for final renders, where the build time is negligible compared to the render time
+    static BVHBuildOptions finalRender() {
+        BVHBuildOptions options;
+        options.method = BVHBuildMethod::SAH;
+        options.sahBins = 32;
+        options.treeletSize = 7;
+        options.reorderNodes = true;
+        return options;
+    }
+};
+
+struct BVH {
+    std::vector<BVHNode> nodes;
+    // SAH cost right after the last build, refit compares against it
+    float builtCost = 0.0f;
+    // references added by spatial splits in the last build
+    uint duplicatedReferences = 0;
+
+    /**
+     * Builds the hierarchy over arbitrary primitives from their bounds alone.
+     * @return the primitive order, leaves reference ranges of this permutation
+     */
+    std::vector<uint> buildFromBounds(const std::vector<Bounds3> &bounds, const BVHBuildOptions &options = {});
+
+    /**
+     * Builds the hierarchy. Triangles are reordered so that every leaf references a contiguous range, the vertices
+     * they index stay in place. Spatial splits (see BVHBuildMethod::SBVH) duplicate triangles, every copy has
+     * Triangle::original set to the first one.
+     * @return the applied permutation, the triangle now at i was at order[i] before. it is longer than the input if
+     * triangles were duplicated
+     */
+    std::vector<uint> buildFromTriangles(std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
+                                         const BVHBuildOptions &options = {});
+
+    /**
+     * Recomputes all bounds bottom-up after primitives have moved, keeping the topology of the tree.
+     * @param bounds new bounds of the primitives, in the order produced by the last build
+     * @return false if the refitted tree has degraded enough (see BVHBuildOptions::maxRefitCostRatio) that it
+     * should be rebuilt
+     */
+    bool refit(const std::vector<Bounds3> &bounds, const BVHBuildOptions &options = {});
+
+    /**
+     * Quantizes the hierarchy into compressed nodes, see CompressedBVHNode. The BVH must not be empty.
+     * @param output compressed nodes are appended here, child references index this array
+     * @param primitiveBase added to the first primitive of every leaf
+     * @return reference to the root, a leaf reference if the root is a leaf
+     */
+    uint compress(std::vector<CompressedBVHNode> &output, uint primitiveBase = 0) const;
+
+    /**
+     * Expected cost of a random ray query, according to the surface area heuristic.
+     */
+    float sahCost(const BVHBuildOptions &options = {}) const;
+};
+
+// what the light BVH builder needs to know about a light, in world space
+struct LightBounds {
+    Bounds3 bounds;
+    // luminance of the emission times the area, lights without power are never picked
+    float power = 0.0f;
+    // unit front normal of the light, it only emits on that side
+    float3 normal{0.0f, 1.0f, 0.0f};
+};
+
+struct LightBVH {
+    std::vector<LightBVHNode> nodes;
+
+    /**
+     * Builds the hierarchy with one light per leaf, splitting where the surface area orientation heuristic of
+     * Conty Estevez and Kulla is lowest. Leaves index the lights in the given order.
+     * @param bins number of centroid bins per axis
+     * @return the leaf of every light, see RayTracingLight::node
+     */
+    std::vector<uint> build(const std::vector<LightBounds> &lights, uint bins = 12);
+};
+}
+
+#endif //ASSIGNMENT_BVH_H
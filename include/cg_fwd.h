@@ -46,6 +46,8 @@ class PlaneGeometry;
 
 class Mesh;
 
+class InstancedMesh;
+
 class Skybox;
 
 class Light;
@@ -2,6 +2,7 @@
 #define ASSIGNMENT_GEOMETRY_H
 
 #include <cg_common.h>
+#include <cg_fwd.h>
 
 #include <optional>
 #include <vector>
@@ -140,6 +141,10 @@ public:
 
     MeshGeometry() = default;
 
+    virtual const SphereGeometry *isSphereGeometry() const { return nullptr; }
+
+    virtual const PlaneGeometry *isPlaneGeometry() const { return nullptr; }
+
     template<typename F>
     void traverseVertices(F &&func) {
         auto it = attribs.find("position");
@@ -167,8 +172,14 @@ public:
 };
 
 class SphereGeometry : public MeshGeometry {
+    float _radius;
+
 public:
     explicit SphereGeometry(float radius, int widthSegments = 20, int heightSegments = 20);
+
+    const SphereGeometry *isSphereGeometry() const override { return this; }
+
+    float radius() const noexcept { return _radius; }
 };
 
 class PlaneGeometry : public MeshGeometry {
@@ -180,6 +191,18 @@ public:
      * @param side
      */
     PlaneGeometry(float sizeX, float sizeZ, Side side = Side::FrontSide);
+
+    const PlaneGeometry *isPlaneGeometry() const override { return this; }
+
+    float sizeX() const noexcept { return _sizeX; }
+
+    float sizeZ() const noexcept { return _sizeZ; }
+
+    Side side() const noexcept { return _side; }
+
+private:
+    float _sizeX, _sizeZ;
+    Side _side;
 };
 }
 
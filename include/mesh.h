@@ -7,6 +7,7 @@
 #include <memory>
 #include <utility>
 #include <optional>
+#include <vector>
 
 namespace cg {
 class Mesh : public Object3D {
@@ -18,10 +19,16 @@ public:
 
     cg::Mesh *isMesh() override { return this; }
 
+    virtual cg::InstancedMesh *isInstancedMesh() { return nullptr; }
+
     MeshGeometry *geometry() {
         return _geo.get();
     }
 
+    const std::shared_ptr<MeshGeometry> &sharedGeometry() const {
+        return _geo;
+    }
+
     Material *material() {
         return _mat.get();
     }
@@ -46,9 +53,25 @@ public:
 
 class InstancedMesh : public Mesh {
     int count;
+    std::vector<glm::mat4> _instanceMatrices;
 public:
     InstancedMesh(int count, std::shared_ptr<Material> material, std::shared_ptr<MeshGeometry> geometry)
-        : count(count), Mesh(std::move(material), std::move(geometry)) {}
+        : count(count), _instanceMatrices(count, glm::mat4(1.0f)), Mesh(std::move(material), std::move(geometry)) {}
+
+    cg::InstancedMesh *isInstancedMesh() override { return this; }
+
+    int instanceCount() const {
+        return count;
+    }
+
+    // transform of an instance relative to the mesh
+    const glm::mat4 &instanceMatrix(int index) const {
+        return _instanceMatrices[index];
+    }
+
+    void setInstanceMatrix(int index, const glm::mat4 &matrix) {
+        _instanceMatrices[index] = matrix;
+    }
 };
 }
 
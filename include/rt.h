@@ -5,6 +5,8 @@
 #include <cg_fwd.h>
 #include <texture.h>
 #include <shader.h>
+#include <bvh.h>
+#include <wide_bvh.h>
 #include "lib/shaders/rt_structure.h"
 
 #ifndef NO_CL
@@ -13,27 +15,104 @@
 
 #endif
 
+#include <map>
+#include <memory>
 #include <optional>
 #include <random>
 
 namespace cg {
-struct BVH {
-    std::vector<BVHNode> nodes;
-
-    void buildFromTriangles(std::vector<Triangle> &triangles);
-};
-
 struct RayTracingScene {
-    bool bufferNeedUpdate = true;
+    // bottom-level BVH of a geometry in object space, reused by all meshes sharing the geometry
+    struct BottomLevel {
+        // detects geometries that were freed since, their address may have been reused
+        std::weak_ptr<MeshGeometry> geometry;
+        BVHBuildMethod method;
+        uint maxLeafSize;
+        uint treeletSize;
+        uint deferredLeafSize;
+        BVH bvh;
+        // in leaf order, indexing vertices
+        std::vector<Triangle> triangles;
+        std::vector<Vertex> vertices;
+        std::vector<VertexShading> vertexShading;
+        // from the space of the vertex positions and the BVH to object space, see QUANTIZED_VERTICES
+        glm::mat4 vertexToObject;
+    };
+
+    // a mesh instance visited by setFromScene, with the transform it was collected with
+    struct SourceInstance {
+        Mesh *mesh;
+        glm::mat4 modelMatrix;
+    };
+
+    // host side data of a ray traced instance
+    struct InstanceRecord {
+        // index into sourceInstances
+        uint source;
+        // triangles of its geometry
+        uint firstTriangle, triangleCount;
+        // BottomLevel::vertexToObject of its geometry
+        glm::mat4 vertexToObject;
+    };
 
-    BVH bvh;
+    bool bufferNeedUpdate = true;
+    // only the top level (tlas, instances, lights and the light BVH) changed
+    bool topLevelNeedUpdate = false;
+
+    BVHBuildOptions bvhOptions;
+    // top-level BVH over instances
+    BVH tlas;
+    std::vector<RayTracingInstance> instances;
+    // bottom-level BVHs of all geometries, node and triangle offsets index these arrays
+    std::vector<BVHNode> bvhNodes;
+    // quantized copy of bvhNodes, traversed by the kernel when QUANTIZED_BVH is defined
+    std::vector<CompressedBVHNode> compressedNodes;
+    std::vector<Triangle> triangles;
+    // object space vertex pools of all geometries, indexed by triangles
+    std::vector<Vertex> vertices;
+    // shading attributes of the vertices at the same indices
+    std::vector<VertexShading> vertexShading;
     std::vector<RayTracingTextureRange> textures;
     std::vector<float> textureData;
-    std::vector<Triangle> triangles;
     std::vector<RayTracingMaterial> materials;
-    std::vector<uint> lights;
+    std::vector<RayTracingLight> lights;
+    // world space hierarchy over lights, which the MIS light sampling picks lights from
+    LightBVH lightTree;
+
+    std::map<const MeshGeometry *, BottomLevel> bottomLevelCache;
+    std::vector<SourceInstance> sourceInstances;
+    // in the same order as instances
+    std::vector<InstanceRecord> instanceRecords;
 
     void setFromScene(Scene &scene);
+
+    /**
+     * Bottom-level BVH nodes in the format the kernel was built for, see BottomLevelNode.
+     */
+    std::vector<BottomLevelNode> &bottomLevelNodes();
+
+    /**
+     * Follows transform changes of the mesh instances collected by setFromScene by updating the instance
+     * transforms and refitting the top-level BVH, or rebuilding it if refitting degraded it too much.
+     * @return false if meshes were added or removed, setFromScene must then be called instead
+     */
+    bool updateFromScene(Scene &scene);
+
+    /**
+     * Builds the top-level BVH over the current instances and collects the light triangles in the resulting order.
+     */
+    void buildTopLevel();
+
+    /**
+     * Collects the emissive triangles and quads of the current instances and builds the light BVH over them with the
+     * current instance transforms.
+     */
+    void collectLights();
+
+    /**
+     * Returns the cached bottom-level BVH of a geometry, building it if needed.
+     */
+    const BottomLevel &bottomLevel(const std::shared_ptr<MeshGeometry> &geometry);
 };
 
 class RayTracingRenderer {
@@ -65,21 +144,54 @@ class RayTracingRenderer {
     cl::Kernel testKernel;
     cl::Kernel rayGenerationKernel;
     cl::Kernel renderKernel;
+    cl::Kernel restirInitialKernel;
+    cl::Kernel restirSpatialKernel;
     cl::Kernel accumulateKernel;
     cl::Kernel clearKernel;
+    cl::Kernel tileErrorKernel;
+    cl::Kernel denoiseVarianceKernel;
+    cl::Kernel denoiseKernel;
+    cl::Kernel mortonKernel;
+    cl::Kernel radixCountKernel;
+    cl::Kernel radixScanKernel;
+    cl::Kernel radixScatterKernel;
+
+    bool sortMortonCodes(const std::vector<float3> &centroids, const Bounds3 &centroidBounds,
+                         std::vector<uint> &codes, std::vector<uint> &indices);
 
     cl::Buffer rayBuffer;
     cl::Buffer seedBuffer;
     cl::Buffer accumulateBuffer;
+    cl::Buffer momentBuffer;
+    // first hit AOVs of render_kernel, summed like the radiance
+    cl::Buffer albedoBuffer;
+    cl::Buffer normalDepthBuffer;
     cl::Buffer outputBuffer;
+    // colors and variances that the denoise_kernel passes alternate between
+    cl::Buffer denoiseBuffers[2];
+    cl::Buffer varianceBuffers[2];
+    // activePixels and tileErrors on the device
+    cl::Buffer pixelBuffer;
+    cl::Buffer tileErrorBuffer;
+    // a single uint, see traversalRestarts()
+    cl::Buffer restartBuffer;
+    // per pixel ReservoirSurface and Reservoir of LIGHT_SAMPLING_RESTIR, the final reservoirs are the next history
+    cl::Buffer surfaceBuffer;
+    cl::Buffer reservoirBuffer;
+    cl::Buffer finalReservoirBuffer;
 
     // scene related buffers
+    cl::Buffer tlasBuffer;
+    cl::Buffer instanceBuffer;
     cl::Buffer triangleBuffer;
+    cl::Buffer vertexBuffer;
+    cl::Buffer vertexShadingBuffer;
     cl::Buffer materialBuffer;
     cl::Buffer textureRangeBuffer;
     cl::Buffer textureDataBuffer;
     cl::Buffer bvhBuffer;
     cl::Buffer lightBuffer;
+    cl::Buffer lightTreeBuffer;
 #endif
 
     bool sceneBufferNeedUpdate = true;
@@ -88,16 +200,42 @@ class RayTracingRenderer {
 
     cg::Texture texture;
     std::vector<float> accumulateFrameBuffer;
+    std::vector<float> momentFrameBuffer;
+    std::vector<float> albedoFrameBuffer;
+    std::vector<float> normalDepthFrameBuffer;
     std::vector<float> frameBuffer;
+    std::vector<float> denoiseFrameBuffers[2];
+    std::vector<float> varianceFrameBuffers[2];
 
     // camera and resampling
     glm::vec3 up, dir, pos;
     uint samples = 0;
     uint spp = 1;
 
+    // short stack restarts of the BVH traversal during the last frame
+    uint restartCount = 0;
+
+    // adaptive sampling, see setAdaptiveSampling
+    float adaptiveThreshold = 0.0f;
+    uint adaptiveMaxSamples = 0;
+    // tile_error_kernel output of the last frame
+    std::vector<float> tileErrors;
+    // pixels that render_kernel samples in the next frame, tile by tile, and whether each tile is among them
+    std::vector<uint> activePixels;
+    std::vector<uint8_t> activeTiles;
+    bool activePixelsChanged = true;
+
     // cpu related buffers
     std::vector<float3> rayMemBuffer;
     std::vector<ulong> seedMemBuffer;
+    std::vector<ReservoirSurface> surfaceMemBuffer;
+    std::vector<Reservoir> reservoirMemBuffer;
+    std::vector<Reservoir> finalReservoirMemBuffer;
+    // wide BVHs collapsed from the scene's, traversed with SIMD by the cpu renderer
+    WideBVHScene wideBVH;
+    // side of the square tiles of pixels whose camera rays are traced as one packet, 0 traces every ray on its own
+    uint packetSize = 0;
+    PrimaryRayHits primaryRayHits;
 
     // random generator
     std::random_device r{};
@@ -105,11 +243,34 @@ class RayTracingRenderer {
 
     // raytracing config
     uint bounces = 10;
+    // LIGHT_SAMPLING_*, passed to render_kernel
+    uint lightSampling = LIGHT_SAMPLING_MIS_POWER;
+    bool lightSamplingChanged = false;
+    // filter the frame buffer with denoise_kernel, render_kernel writes the AOVs it needs only then
+    bool denoise = false;
+    bool denoiseChanged = false;
 
     size_t frameBufferSize() const {
         return frameBuffer.size() * sizeof(float);
     }
 
+    uint tilesX() const {
+        return (_width + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE;
+    }
+
+    uint tileCount() const {
+        return tilesX() * ((_height + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE);
+    }
+
+    bool adaptive() const {
+        return adaptiveThreshold > 0.0f || adaptiveMaxSamples > 0;
+    }
+
+    /**
+     * Fills activePixels with the tiles whose error is still above the threshold, or with all tiles.
+     */
+    void selectActivePixels(bool all);
+
     void initFrameBuffer(int width, int height);
 
     void drawFrameBuffer();
@@ -121,16 +282,63 @@ public:
 
     bool reloadShader();
 
+    /**
+     * Morton code sorter for the LBVH builder that runs on the OpenCL device, empty if there is none.
+     */
+    BVHBuildOptions::MortonSorter mortonSorter();
+
     bool initCPU(int width, int height);
 
     void renderCPU(RayTracingScene &scene, Camera &camera);
 
     void setBounces(uint newBounces);
 
+    /**
+     * Selects how light samples and the emission found by BSDF samples are combined, one of LIGHT_SAMPLING_*. The
+     * accumulated samples are discarded.
+     */
+    void setLightSampling(uint mode);
+
+    /**
+     * Makes the cpu renderer trace the camera rays of size x size tiles of pixels as packets, see
+     * WideBVHScene::firstIntersections. Later bounces are incoherent and always traced ray by ray.
+     * @param size 4 or 8, or 0 to trace every camera ray on its own. Rounded down to a divisor of ADAPTIVE_TILE_SIZE
+     * that is at most 8
+     */
+    void setPacketSize(uint size);
+
+    /**
+     * Makes the renderers stop sampling tiles of ADAPTIVE_TILE_SIZE pixels whose error, see tile_error_kernel, falls
+     * below a threshold, or that reached a number of samples. Once every tile has stopped the image is converged and
+     * frames no longer trace rays, until the camera or the scene changes.
+     * @param threshold 0 to keep sampling all tiles
+     * @param maxSamples samples after which a tile stops regardless of its error, 0 for no limit
+     */
+    void setAdaptiveSampling(float threshold, uint maxSamples = 0);
+
+    /**
+     * Makes the renderers filter the frame buffer with the edge-avoiding denoiser before it is displayed or read by
+     * frameBufferData, see denoise_kernel. The accumulated samples are discarded, they lack the AOVs it is guided by.
+     */
+    void setDenoise(bool enable);
+
+    /**
+     * Pixels that the next frame samples, all of them without adaptive sampling.
+     */
+    uint activePixelCount() const noexcept;
+
+    bool converged() const noexcept;
+
     const float *frameBufferData() const noexcept;
 
     int sampleCount() const noexcept;
 
+    /**
+     * Number of times the BVH traversal restarted after its short stack overflowed, during the last frame. Frequent
+     * restarts mean the trees are too deep for BVH_SHORT_STACK_SIZE.
+     */
+    uint traversalRestarts() const noexcept;
+
     int width() const noexcept;
 
     int height() const noexcept;
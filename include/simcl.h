@@ -38,7 +38,10 @@ typedef cl_float4 cl_float3;
 #endif
 
 #include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
 
+#include <atomic>
+#include <bit>
 #include <cmath>
 
 typedef cl_float2 float2;
@@ -47,6 +50,9 @@ typedef cl_float4 float4;
 typedef uint32_t uint;
 typedef uint64_t ulong;
 typedef uint16_t ushort;
+typedef uint8_t uchar;
+// only stored, read with vload_half2
+typedef uint16_t half;
 typedef float *image2d_t;
 
 #define __global
@@ -155,10 +161,10 @@ inline float4 &operator/=(float4 &lhs, const float4 &rhs) {
 }
 
 inline float4 &operator/=(float4 &lhs, float rhs) {
-    lhs.x *= rhs;
-    lhs.y *= rhs;
-    lhs.z *= rhs;
-    lhs.w *= rhs;
+    lhs.x /= rhs;
+    lhs.y /= rhs;
+    lhs.z /= rhs;
+    lhs.w /= rhs;
     return lhs;
 }
 
@@ -203,6 +209,18 @@ inline float dot(const float2 &lhs, const float2 &rhs) {
     return lhs.x * rhs.x + lhs.y * rhs.y;
 }
 
+inline float as_float(uint v) {
+    return std::bit_cast<float>(v);
+}
+
+inline float2 vload_half2(size_t offset, const half *p) {
+    return float2{glm::unpackHalf1x16(p[offset * 2]), glm::unpackHalf1x16(p[offset * 2 + 1])};
+}
+
+inline uint atomic_add(uint *p, uint val) {
+    return std::atomic_ref<uint>(*p).fetch_add(val);
+}
+
 inline float fract(float v) {
     return v - floor(v);
 }
@@ -215,6 +233,10 @@ inline float3 cross(const float3 &lhs, const float3 &rhs) {
     };
 }
 
+inline float2 vec2(float a, float b) {
+    return float2{a, b};
+}
+
 inline float3 vec3(float a) {
     return float3{a, a, a};
 }
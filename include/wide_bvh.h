@@ -0,0 +1,163 @@
+#ifndef ASSIGNMENT_WIDE_BVH_H
+#define ASSIGNMENT_WIDE_BVH_H
+
+#include "lib/shaders/rt_structure.h"
+#include <bvh.h>
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// children per node of the CPU BVH, one AVX register or one SSE register of child bounds per axis
+#ifdef __AVX__
+#define CPU_BVH_WIDTH 8
+#else
+#define CPU_BVH_WIDTH 4
+#endif
+
+// rays traced together by WideBVHScene::firstIntersections, an 8x8 tile of pixels
+#define CPU_MAX_PACKET_SIZE 64
+
+// WideBVH::Node::primitiveCount of a child whose subtree is not built yet, see WideBVHScene::expandDeferred
+#define WIDE_BVH_DEFERRED 0xffffffffu
+
+namespace cg {
+/**
+ * A BVH with up to Width children per node, collapsed from a binary BVH. Child bounds are stored as structure of
+ * arrays, so that all children of a node are tested against a ray at once with SIMD instructions. Only the CPU
+ * renderer uses it, the OpenCL kernel keeps traversing the binary BVH.
+ */
+template<uint Width>
+struct WideBVH {
+    struct alignas(32) Node {
+        // child bounds, [0] is the minimum and [1] the maximum, per axis. unused slots have empty bounds and
+        // are never hit
+        float bounds[2][3][Width];
+        // index of an interior child node, of the first primitive of a leaf child, or of a deferred leaf
+        uint child[Width];
+        // number of primitives of a leaf child, 0 for interior children or WIDE_BVH_DEFERRED
+        uint primitiveCount[Width];
+    };
+
+    std::vector<Node> nodes;
+
+    /**
+     * Collapses the subtree of a binary BVH into nodes appended to this BVH. Primitive offsets of the leaves are
+     * kept as they are.
+     * @param binary nodes of the binary BVH
+     * @param root root of the subtree to collapse
+     * @param deferredLeaves binary leaves of more than BVH_MAX_LEAF_SIZE primitives, whose subtrees the build
+     * deferred (see BVHBuildOptions::deferredLeafSize), are appended here and referenced by their index in it
+     * @return index of the node holding the children of root
+     */
+    uint collapse(const std::vector<BVHNode> &binary, uint root, std::vector<BVHNode> *deferredLeaves = nullptr);
+};
+
+/**
+ * Wide counterparts of the two-level acceleration structure of a RayTracingScene.
+ */
+struct WideBVHScene {
+    typedef WideBVH<CPU_BVH_WIDTH> BVHType;
+
+    BVHType topLevel;
+    // grown by expandDeferred during the queries
+    mutable BVHType bottomLevel;
+    // root in bottomLevel of every bottom-level BVH, by its root in the binary node array
+    std::unordered_map<uint, uint> bottomLevelRoots;
+    // root in bottomLevel of every instance, in the order of the instances
+    std::vector<uint> instanceRoots;
+
+    /**
+     * A subtree of the bottom-level BVHs that the binary build deferred. The first ray reaching it builds it.
+     */
+    struct DeferredSubtree {
+        // the binary leaf standing in for the subtree
+        BVHNode leaf;
+        std::once_flag built;
+        // node in bottomLevel holding the children of the subtree once it is built
+        uint root = 0;
+    };
+
+    // by the indices in WideBVH::Node::child of the deferred children, a deque because DeferredSubtree cannot move
+    mutable std::deque<DeferredSubtree> deferredSubtrees;
+    // copy of the scene's triangles if there are deferred subtrees. building one reorders the triangles of its range
+    // here, which no ray reads before it is built, so hits still report indices into the scene's triangles
+    mutable std::vector<Triangle> deferredTriangles;
+    // serializes appending the collapsed nodes of deferred subtrees, bottomLevel has capacity reserved for all of
+    // them so that the nodes read by other rays never move
+    mutable std::mutex deferredMutex;
+    BVHBuildOptions deferredOptions;
+
+    /**
+     * Collapses the bottom-level BVHs referenced by the instances.
+     * @param triangles the scene's triangles, copied if the bottom-level BVHs have deferred subtrees
+     * @param options builds the deferred subtrees
+     */
+    void buildBottomLevel(const std::vector<BVHNode> &bvhNodes, const std::vector<RayTracingInstance> &instances,
+                          const std::vector<Triangle> &triangles, const BVHBuildOptions &options);
+
+    /**
+     * Triangles to test the leaves of bottomLevel against, deferredTriangles if there are deferred subtrees.
+     * @param primitives the scene's triangles
+     */
+    Triangle *leafTriangles(Triangle *primitives) const {
+        return deferredSubtrees.empty() ? primitives : deferredTriangles.data();
+    }
+
+    /**
+     * Returns the root of a deferred subtree in bottomLevel, building and collapsing it if no ray has reached it
+     * before. Threads reaching the same subtree wait for the first one, different subtrees are built in parallel.
+     * @param deferred index of the subtree in deferredSubtrees
+     */
+    uint expandDeferred(uint deferred, const Vertex *vertices) const;
+
+    /**
+     * Collapses the top-level BVH, whose leaves reference the instances. Must follow buildBottomLevel, and be
+     * repeated whenever the top-level BVH or the order of the instances changes.
+     */
+    void buildTopLevel(const std::vector<BVHNode> &tlas, const std::vector<RayTracingInstance> &instances);
+
+    /**
+     * Same as the kernel's firstIntersection, but traverses the wide BVHs.
+     */
+    bool firstIntersection(Ray ray, const RayTracingInstance *instances, Triangle *primitives, Vertex *vertices,
+                           Intersection *output) const;
+
+    /**
+     * firstIntersection for a packet of coherent rays that share their origin, such as the camera rays of a tile of
+     * pixels. Nodes are culled once for the whole packet by bounding the ray directions with intervals, only the
+     * leaves are tested ray by ray. Packets whose directions differ in sign along an axis are traced ray by ray.
+     * @param count number of rays, at most CPU_MAX_PACKET_SIZE
+     * @param outputs outputs the closest hit of every ray that hit anything
+     * @param hits outputs whether the ray at the same index hit anything
+     */
+    void firstIntersections(const Ray *rays, uint count, const RayTracingInstance *instances, Triangle *primitives,
+                            Vertex *vertices, Intersection *outputs, bool *hits) const;
+
+    /**
+     * Same as the kernel's occluded, but traverses the wide BVHs.
+     */
+    bool occluded(Ray ray, float maxT, const RayTracingInstance *instances, Triangle *primitives,
+                  Vertex *vertices) const;
+};
+
+// set by the CPU renderer while it runs the kernels, firstIntersection then traverses these wide BVHs instead of
+// the binary ones passed to the kernel
+inline const WideBVHScene *activeWideBVHScene = nullptr;
+
+/**
+ * Closest hits of the camera rays, traced in packets by the CPU renderer before it runs the render kernel.
+ */
+struct PrimaryRayHits {
+    // by the index of the ray in the rays passed to the kernel
+    std::vector<Intersection> intersections;
+    // whether the ray at the same index hit anything
+    std::vector<uchar> hits;
+};
+
+// set by the CPU renderer while it runs the kernels if it traced the camera rays ahead, see cameraRayIntersection
+inline const PrimaryRayHits *activePrimaryRayHits = nullptr;
+}
+
+#endif //ASSIGNMENT_WIDE_BVH_H
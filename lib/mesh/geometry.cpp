@@ -169,7 +169,7 @@ cg::BoxGeometry::BoxGeometry(float sizeX, float sizeY, float sizeZ, Side side) {
     }
 }
 
-cg::SphereGeometry::SphereGeometry(float radius, int widthSegments, int heightSegments) {
+cg::SphereGeometry::SphereGeometry(float radius, int widthSegments, int heightSegments) : _radius(radius) {
     int vertexCount = (widthSegments + 1) * (heightSegments + 1);
     std::vector<float> position(vertexCount * 3);
     std::vector<float> normal(vertexCount * 3);
@@ -224,7 +224,7 @@ cg::SphereGeometry::SphereGeometry(float radius, int widthSegments, int heightSe
     addIndices(indices);
 }
 
-cg::PlaneGeometry::PlaneGeometry(float sizeX, float sizeZ, Side side) {
+cg::PlaneGeometry::PlaneGeometry(float sizeX, float sizeZ, Side side) : _sizeX(sizeX), _sizeZ(sizeZ), _side(side) {
     float positions[12];
     float normals[12];
     float texcoord[8];
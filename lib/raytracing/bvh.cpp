@@ -0,0 +1,1273 @@
+#include <bvh.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+template<typename ...Args>
+static uint push(std::vector<BVHNode> &nodes, Args &&...args) {
+    uint ret = static_cast<uint>(nodes.size());
+    nodes.emplace_back(std::forward<Args &&>(args)...);
+    return ret;
+};
+
+/**
+ * Appends a subtree that was built into its own node array, fixing up its child offsets.
+ * @return index of the subtree root
+ */
+static uint spliceSubtree(std::vector<BVHNode> &nodes, std::vector<BVHNode> &subtree) {
+    auto base = static_cast<uint>(nodes.size());
+    for (auto &node: subtree) {
+        if (!node.primitiveCount) {
+            node.offset += base;
+        }
+    }
+    nodes.insert(nodes.end(), subtree.begin(), subtree.end());
+    return base;
+}
+
+static uint parallelDepthFor(const cg::BVHBuildOptions &options) {
+    uint threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    // every level doubles the number of tasks, allow a few more tasks than threads for load balancing
+    uint depth = 0;
+    while ((1u << depth) < threads) {
+        ++depth;
+    }
+    return threads > 1 ? depth + 2 : depth;
+}
+
+static uint maxLeafSizeFor(const cg::BVHBuildOptions &options) {
+    return std::clamp(options.maxLeafSize, 1u, static_cast<uint>(BVH_MAX_LEAF_SIZE));
+}
+
+namespace {
+/**
+ * A compact reference to a primitive. The builder only ever moves these around, the primitives themselves are
+ * permuted once after the hierarchy is complete.
+ */
+struct BVHPrimitive {
+    Bounds3 bounds;
+    float3 centroid;
+    uint index;
+};
+
+struct SAHBin {
+    Bounds3 bounds;
+    uint count = 0;
+};
+
+struct BVHBuilder {
+    // ranges smaller than this are never split across tasks
+    static constexpr uint PARALLEL_THRESHOLD = 4096;
+
+    const cg::BVHBuildOptions &options;
+    std::vector<BVHPrimitive> &refs;
+    uint parallelDepth;
+    uint maxLeafSize;
+    uint deferredLeafSize;
+
+    BVHBuilder(const cg::BVHBuildOptions &options, std::vector<BVHPrimitive> &refs)
+        : options(options), refs(refs), parallelDepth(parallelDepthFor(options)),
+          maxLeafSize(maxLeafSizeFor(options)),
+          deferredLeafSize(std::min<uint>(options.deferredLeafSize, std::numeric_limits<ushort>::max())) {}
+
+    /**
+     * Splits at the median centroid along the axis of maximum extent.
+     * @return the first reference of the right child
+     */
+    uint splitMedian(uint begin, uint end, const Bounds3 &bounds, unsigned short &dim) {
+        dim = bounds.maxExtent();
+        uint length = end - begin;
+        auto first = refs.begin() + begin;
+        if (length == 2) {
+            if (std::next(first)->centroid.s[dim] < first->centroid.s[dim]) {
+                std::iter_swap(first, std::next(first));
+            }
+            return begin + 1;
+        }
+        uint middle = begin + length / 2;
+        std::nth_element(first, refs.begin() + middle, refs.begin() + end,
+            [dim](const BVHPrimitive &a, const BVHPrimitive &b) -> bool {
+                return a.centroid.s[dim] < b.centroid.s[dim];
+            });
+        return middle;
+    }
+
+    /**
+     * Binned SAH split, see Wald, "On fast Construction of SAH-based Bounding Volume Hierarchies" (2007).
+     * Every axis is tested; the left child always holds the primitives with the smaller centroids along `dim`.
+     * @param cost outputs the sum of area times primitive count of both children, or infinity if there is no split
+     * @return the first reference of the right child
+     */
+    uint splitSAH(uint begin, uint end, const Bounds3 &bounds, const Bounds3 &centroidBounds, unsigned short &dim,
+                  float &cost) {
+        const uint binCount = std::clamp(options.sahBins, 2u, 256u);
+        std::vector<SAHBin> bins(binCount * 3);
+        std::vector<float> rightArea(binCount);
+        std::vector<uint> rightCount(binCount);
+        float scale[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            float extent = centroidBounds.pMax.s[axis] - centroidBounds.pMin.s[axis];
+            scale[axis] = extent > 0.0f ? static_cast<float>(binCount) / extent : 0.0f;
+        }
+        const auto binIndex = [&](const BVHPrimitive &ref, int axis) -> uint {
+            auto bin = static_cast<uint>((ref.centroid.s[axis] - centroidBounds.pMin.s[axis]) * scale[axis]);
+            return std::min(bin, binCount - 1);
+        };
+        for (uint i = begin; i < end; ++i) {
+            for (int axis = 0; axis < 3; ++axis) {
+                auto &bin = bins[axis * binCount + binIndex(refs[i], axis)];
+                bin.bounds += refs[i].bounds;
+                bin.count += 1;
+            }
+        }
+
+        int bestAxis = -1;
+        uint bestSplit = 0;
+        float bestCost = std::numeric_limits<float>::max();
+        for (int axis = 0; axis < 3; ++axis) {
+            if (scale[axis] == 0.0f) {
+                continue;
+            }
+            const SAHBin *axisBins = bins.data() + axis * binCount;
+            // sweep from the right to collect the areas of all right partitions
+            Bounds3 accumulated;
+            uint accumulatedCount = 0;
+            for (uint b = binCount - 1; b > 0; --b) {
+                accumulated += axisBins[b].bounds;
+                accumulatedCount += axisBins[b].count;
+                rightArea[b] = accumulatedCount ? accumulated.surfaceArea() : 0.0f;
+                rightCount[b] = accumulatedCount;
+            }
+            // then sweep from the left, splitting between bin (b - 1) and bin b
+            accumulated = Bounds3();
+            accumulatedCount = 0;
+            for (uint b = 1; b < binCount; ++b) {
+                accumulated += axisBins[b - 1].bounds;
+                accumulatedCount += axisBins[b - 1].count;
+                if (!accumulatedCount || !rightCount[b]) {
+                    continue;
+                }
+                float splitCost = accumulated.surfaceArea() * static_cast<float>(accumulatedCount)
+                                  + rightArea[b] * static_cast<float>(rightCount[b]);
+                if (splitCost < bestCost) {
+                    bestCost = splitCost;
+                    bestAxis = axis;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        cost = bestCost;
+        if (bestAxis < 0) {
+            // all centroids coincide, any split is as good as the others
+            dim = bounds.maxExtent();
+            return begin + (end - begin) / 2;
+        }
+        dim = static_cast<unsigned short>(bestAxis);
+        auto middle = std::partition(refs.begin() + begin, refs.begin() + end, [&](const BVHPrimitive &ref) {
+            return binIndex(ref, bestAxis) < bestSplit;
+        });
+        return static_cast<uint>(middle - refs.begin());
+    }
+
+    /**
+     * Emits the subtree over refs[begin, end) in depth-first order: the left child directly follows its parent and
+     * `offset` points to the right child. Leaves point into the final primitive order, which is the order of `refs`.
+     */
+    uint recur(std::vector<BVHNode> &nodes, uint begin, uint end, uint depth) {
+        uint length = end - begin;
+        if (length == 1) {
+            return push(nodes, BVHNode{refs[begin].bounds, begin, 1}); // leaf
+        }
+        auto bounds = refs[begin].bounds;
+        auto centroidBounds = Bounds3(refs[begin].centroid);
+        for (uint i = begin + 1; i < end; ++i) {
+            bounds += refs[i].bounds;
+            centroidBounds += refs[i].centroid;
+        }
+        if (length > maxLeafSize && length <= deferredLeafSize) {
+            return push(nodes, BVHNode{bounds, begin, static_cast<ushort>(length)}); // deferred subtree
+        }
+        unsigned short dim;
+        uint middle;
+        if (options.method == cg::BVHBuildMethod::SAH || options.method == cg::BVHBuildMethod::SBVH) {
+            float splitCost;
+            middle = splitSAH(begin, end, bounds, centroidBounds, dim, splitCost);
+            if (length <= maxLeafSize) {
+                // make a leaf if testing all primitives is cheaper than traversing the children
+                float area = bounds.surfaceArea();
+                float leafCost = options.intersectionCost * static_cast<float>(length);
+                if (area <= 0.0f
+                    || leafCost <= options.traversalCost + options.intersectionCost * splitCost / area) {
+                    return push(nodes, BVHNode{bounds, begin, static_cast<ushort>(length)});
+                }
+            }
+        } else if (length <= maxLeafSize) {
+            return push(nodes, BVHNode{bounds, begin, static_cast<ushort>(length)});
+        } else {
+            middle = splitMedian(begin, end, bounds, dim);
+        }
+
+        auto ret = push(nodes, BVHNode{bounds, 0, 0, dim});
+        if (depth < parallelDepth && length >= PARALLEL_THRESHOLD) {
+            // build the right subtree on another task, then append it behind the left one
+            std::vector<BVHNode> rightNodes;
+            auto right = std::async(std::launch::async, [&, middle, end, depth]() {
+                recur(rightNodes, middle, end, depth + 1);
+            });
+            recur(nodes, begin, middle, depth + 1);
+            right.get();
+            nodes[ret].offset = spliceSubtree(nodes, rightNodes);
+        } else {
+            recur(nodes, begin, middle, depth + 1);
+            nodes[ret].offset = recur(nodes, middle, end, depth + 1);
+        }
+        return ret;
+    }
+};
+
+/**
+ * LSD radix sort of 32-bit keys together with their values.
+ */
+void radixSort(std::vector<uint> &keys, std::vector<uint> &values) {
+    constexpr uint BITS = 8, BUCKETS = 1u << BITS;
+    std::vector<uint> keysOut(keys.size()), valuesOut(values.size());
+    for (uint shift = 0; shift < 32; shift += BITS) {
+        uint offsets[BUCKETS] = {};
+        for (uint key: keys) {
+            offsets[(key >> shift) & (BUCKETS - 1)] += 1;
+        }
+        uint sum = 0;
+        for (uint &offset: offsets) {
+            uint count = offset;
+            offset = sum;
+            sum += count;
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            uint dst = offsets[(keys[i] >> shift) & (BUCKETS - 1)]++;
+            keysOut[dst] = keys[i];
+            valuesOut[dst] = values[i];
+        }
+        keys.swap(keysOut);
+        values.swap(valuesOut);
+    }
+}
+
+/**
+ * Linear BVH, see Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees" (2012).
+ * The radix tree over the sorted codes is emitted top-down, so the output has the same depth-first layout as the
+ * other builders. Ranges of identical codes are split in the middle.
+ */
+struct LBVHBuilder {
+    static constexpr uint PARALLEL_THRESHOLD = 4096;
+
+    const std::vector<Bounds3> &bounds;
+    const std::vector<uint> &codes;
+    const std::vector<uint> &order;
+    uint parallelDepth;
+    uint maxLeafSize;
+
+    LBVHBuilder(const cg::BVHBuildOptions &options, const std::vector<Bounds3> &bounds,
+                const std::vector<uint> &codes, const std::vector<uint> &order)
+        : bounds(bounds), codes(codes), order(order), parallelDepth(parallelDepthFor(options)),
+          maxLeafSize(maxLeafSizeFor(options)) {}
+
+    static int commonPrefix(uint a, uint b) {
+        return a == b ? 32 : std::countl_zero(a ^ b);
+    }
+
+    /**
+     * Finds the first index of the right child: the first code that differs from codes[begin] in the highest bit
+     * where codes[begin] and codes[end - 1] differ.
+     */
+    uint findSplit(uint begin, uint end) const {
+        uint first = codes[begin], last = codes[end - 1];
+        int prefix = commonPrefix(first, last);
+        // binary search for the last code sharing more than `prefix` bits with the first one
+        uint split = begin;
+        uint step = end - 1 - begin;
+        do {
+            step = (step + 1) / 2;
+            uint next = split + step;
+            if (next < end - 1 && commonPrefix(first, codes[next]) > prefix) {
+                split = next;
+            }
+        } while (step > 1);
+        return split + 1;
+    }
+
+    uint recur(std::vector<BVHNode> &nodes, uint begin, uint end, uint depth) {
+        uint length = end - begin;
+        if (length <= maxLeafSize) {
+            auto leafBounds = bounds[order[begin]];
+            for (uint i = begin + 1; i < end; ++i) {
+                leafBounds += bounds[order[i]];
+            }
+            return push(nodes, BVHNode{leafBounds, begin, static_cast<ushort>(length)});
+        }
+        uint middle;
+        unsigned short dim;
+        if (codes[begin] == codes[end - 1]) {
+            middle = begin + length / 2;
+            dim = 0;
+        } else {
+            middle = findSplit(begin, end);
+            // codes interleave the axes as (x, y, z) from the most significant bit of each triple
+            int bit = 31 - std::countl_zero(codes[begin] ^ codes[end - 1]);
+            dim = static_cast<unsigned short>(2 - bit % 3);
+        }
+
+        auto ret = push(nodes, BVHNode{Bounds3(), 0, 0, dim});
+        uint left = ret + 1, right;
+        if (depth < parallelDepth && length >= PARALLEL_THRESHOLD) {
+            std::vector<BVHNode> rightNodes;
+            auto task = std::async(std::launch::async, [&, middle, end, depth]() {
+                recur(rightNodes, middle, end, depth + 1);
+            });
+            recur(nodes, begin, middle, depth + 1);
+            task.get();
+            right = spliceSubtree(nodes, rightNodes);
+        } else {
+            recur(nodes, begin, middle, depth + 1);
+            right = recur(nodes, middle, end, depth + 1);
+        }
+        nodes[ret].offset = right;
+        nodes[ret].bounds = nodes[left].bounds + nodes[right].bounds;
+        return ret;
+    }
+};
+
+/**
+ * Bounds of the part of a triangle between two planes perpendicular to an axis.
+ */
+Bounds3 clipTriangle(const Triangle &triangle, const std::vector<Vertex> &vertices, int axis, float lo, float hi) {
+    const float3 points[3] = {
+        vertices[triangle.vertex[0]].point(), vertices[triangle.vertex[1]].point(), vertices[triangle.vertex[2]].point()
+    };
+    Bounds3 result;
+    for (int i = 0; i < 3; ++i) {
+        const float3 &a = points[i], &b = points[(i + 1) % 3];
+        if (a.s[axis] >= lo && a.s[axis] <= hi) {
+            result += a;
+        }
+        // points where the edge crosses the planes
+        for (float plane: {lo, hi}) {
+            if ((a.s[axis] < plane) != (b.s[axis] < plane)) {
+                float t = (plane - a.s[axis]) / (b.s[axis] - a.s[axis]);
+                float3 p = a + (b - a) * t;
+                p.s[axis] = plane;
+                result += p;
+            }
+        }
+    }
+    return result;
+}
+
+Bounds3 intersectBounds(const Bounds3 &a, const Bounds3 &b) {
+    return Bounds3{max(a.pMin, b.pMin), min(a.pMax, b.pMax)};
+}
+
+bool isEmpty(const Bounds3 &bounds) {
+    return bounds.pMin.x > bounds.pMax.x || bounds.pMin.y > bounds.pMax.y || bounds.pMin.z > bounds.pMax.z;
+}
+
+struct SpatialBin {
+    Bounds3 bounds;
+    // references starting and ending in this bin
+    uint entries = 0;
+    uint exits = 0;
+};
+
+/**
+ * Split BVH, see Stich et al., "Spatial Splits in Bounding Volume Hierarchies" (2009). Every node compares the
+ * binned SAH object split with a binned spatial split, which clips the references straddling the split plane into
+ * both children. References are kept in per-node vectors since spatial splits change their number; leaves append
+ * theirs to the final order.
+ */
+struct SBVHBuilder {
+    static constexpr uint PARALLEL_THRESHOLD = 4096;
+    // past this depth only object splits are tried, so that spatial splits cannot keep duplicating references down a
+    // deep recursion of the build
+    static constexpr uint MAX_SPATIAL_SPLIT_DEPTH = 48;
+
+    const cg::BVHBuildOptions &options;
+    const std::vector<Triangle> &triangles;
+    const std::vector<Vertex> &vertices;
+    uint parallelDepth;
+    uint maxLeafSize;
+    // spatial splits are only tried where the object split children overlap by more than this area
+    float minOverlapArea = 0.0f;
+    uint duplicationBudget;
+    std::atomic<uint> duplicated = 0;
+
+    SBVHBuilder(const cg::BVHBuildOptions &options, const std::vector<Triangle> &triangles,
+                const std::vector<Vertex> &vertices)
+        : options(options), triangles(triangles), vertices(vertices), parallelDepth(parallelDepthFor(options)),
+          maxLeafSize(maxLeafSizeFor(options)),
+          duplicationBudget(static_cast<uint>(static_cast<float>(triangles.size()) * options.spatialSplitBudget)) {}
+
+    /**
+     * Binned spatial split: references are clipped into every bin they overlap, and counted in the bins where
+     * they start and end.
+     * @param cost outputs the sum of area times reference count of both children, or infinity if there is no split
+     * @param position outputs the split plane
+     */
+    void findSpatialSplit(const std::vector<BVHPrimitive> &refs, const Bounds3 &bounds, unsigned short &dim,
+                          float &position, float &cost) const {
+        const uint binCount = std::clamp(options.sahBins, 2u, 256u);
+        std::vector<SpatialBin> bins(binCount);
+        std::vector<float> rightArea(binCount);
+        std::vector<uint> rightCount(binCount);
+        cost = std::numeric_limits<float>::max();
+        for (int axis = 0; axis < 3; ++axis) {
+            float lo = bounds.pMin.s[axis], extent = bounds.pMax.s[axis] - lo;
+            if (extent <= 0.0f) {
+                continue;
+            }
+            float binWidth = extent / static_cast<float>(binCount);
+            const auto binIndex = [&](float value) -> uint {
+                auto bin = static_cast<int>((value - lo) / binWidth);
+                return static_cast<uint>(std::clamp(bin, 0, static_cast<int>(binCount) - 1));
+            };
+            std::fill(bins.begin(), bins.end(), SpatialBin());
+            for (const auto &ref: refs) {
+                uint first = binIndex(ref.bounds.pMin.s[axis]), last = binIndex(ref.bounds.pMax.s[axis]);
+                for (uint b = first; b <= last; ++b) {
+                    float binLo = lo + static_cast<float>(b) * binWidth;
+                    float binHi = b + 1 == binCount ? bounds.pMax.s[axis] : binLo + binWidth;
+                    bins[b].bounds += intersectBounds(clipTriangle(triangles[ref.index], vertices, axis, binLo, binHi),
+                        ref.bounds);
+                }
+                bins[first].entries += 1;
+                bins[last].exits += 1;
+            }
+            // same sweeps as the object split, with entries counted on the left and exits on the right
+            Bounds3 accumulated;
+            uint accumulatedCount = 0;
+            for (uint b = binCount - 1; b > 0; --b) {
+                accumulated += bins[b].bounds;
+                accumulatedCount += bins[b].exits;
+                rightArea[b] = accumulatedCount ? accumulated.surfaceArea() : 0.0f;
+                rightCount[b] = accumulatedCount;
+            }
+            accumulated = Bounds3();
+            accumulatedCount = 0;
+            for (uint b = 1; b < binCount; ++b) {
+                accumulated += bins[b - 1].bounds;
+                accumulatedCount += bins[b - 1].entries;
+                if (!accumulatedCount || !rightCount[b]) {
+                    continue;
+                }
+                float splitCost = accumulated.surfaceArea() * static_cast<float>(accumulatedCount)
+                                  + rightArea[b] * static_cast<float>(rightCount[b]);
+                if (splitCost < cost) {
+                    cost = splitCost;
+                    dim = static_cast<unsigned short>(axis);
+                    position = lo + static_cast<float>(b) * binWidth;
+                }
+            }
+        }
+    }
+
+    /**
+     * Distributes the references to both sides of a split plane, clipping the ones that straddle it.
+     * @return false if the split does not separate the references, nothing is changed then
+     */
+    bool splitSpatially(std::vector<BVHPrimitive> &refs, int axis, float position, std::vector<BVHPrimitive> &left,
+                        std::vector<BVHPrimitive> &right) {
+        constexpr float infinity = std::numeric_limits<float>::infinity();
+        uint added = 0;
+        for (const auto &ref: refs) {
+            if (ref.bounds.pMax.s[axis] <= position) {
+                left.push_back(ref);
+            } else if (ref.bounds.pMin.s[axis] >= position) {
+                right.push_back(ref);
+            } else {
+                const auto &triangle = triangles[ref.index];
+                auto leftBounds = intersectBounds(clipTriangle(triangle, vertices, axis, -infinity, position), ref.bounds);
+                auto rightBounds = intersectBounds(clipTriangle(triangle, vertices, axis, position, infinity), ref.bounds);
+                bool inLeft = !isEmpty(leftBounds), inRight = !isEmpty(rightBounds);
+                if (inLeft) {
+                    left.push_back(BVHPrimitive{leftBounds, leftBounds.centroid(), ref.index});
+                }
+                if (inRight) {
+                    right.push_back(BVHPrimitive{rightBounds, rightBounds.centroid(), ref.index});
+                }
+                if (!inLeft && !inRight) {
+                    // rounding lost the reference, keep it whole on one side
+                    left.push_back(ref);
+                }
+                added += inLeft && inRight;
+            }
+        }
+        if (left.empty() || right.empty() || (left.size() == refs.size() && right.size() == refs.size())) {
+            left.clear();
+            right.clear();
+            return false;
+        }
+        duplicated += added;
+        return true;
+    }
+
+    /**
+     * Appends the subtree over refs to nodes in depth-first order, and the references of its leaves to order.
+     * Leaf offsets index order.
+     */
+    uint recur(std::vector<BVHNode> &nodes, std::vector<BVHPrimitive> &order, std::vector<BVHPrimitive> refs,
+               uint depth) {
+        auto length = static_cast<uint>(refs.size());
+        if (length == 1) {
+            order.push_back(refs[0]);
+            return push(nodes, BVHNode{refs[0].bounds, static_cast<uint>(order.size() - 1), 1}); // leaf
+        }
+        auto bounds = refs[0].bounds;
+        auto centroidBounds = Bounds3(refs[0].centroid);
+        for (uint i = 1; i < length; ++i) {
+            bounds += refs[i].bounds;
+            centroidBounds += refs[i].centroid;
+        }
+        if (depth == 0) {
+            minOverlapArea = bounds.surfaceArea() * options.spatialSplitOverlap;
+        }
+
+        unsigned short dim;
+        float splitCost;
+        uint middle = BVHBuilder(options, refs).splitSAH(0, length, bounds, centroidBounds, dim, splitCost);
+        bool objectSplitFound = splitCost < std::numeric_limits<float>::max();
+
+        unsigned short spatialDim = dim;
+        float position = 0.0f, spatialCost = std::numeric_limits<float>::max();
+        if (depth < MAX_SPATIAL_SPLIT_DEPTH && duplicated < duplicationBudget) {
+            Bounds3 leftBounds, rightBounds;
+            for (uint i = 0; i < length; ++i) {
+                (i < middle ? leftBounds : rightBounds) += refs[i].bounds;
+            }
+            auto overlap = intersectBounds(leftBounds, rightBounds);
+            if (!objectSplitFound || (!isEmpty(overlap) && overlap.surfaceArea() > minOverlapArea)) {
+                findSpatialSplit(refs, bounds, spatialDim, position, spatialCost);
+            }
+        }
+
+        if (length <= maxLeafSize) {
+            // make a leaf if testing all references is cheaper than traversing the children
+            float area = bounds.surfaceArea();
+            float leafCost = options.intersectionCost * static_cast<float>(length);
+            float bestCost = std::min(splitCost, spatialCost);
+            if (area <= 0.0f || leafCost <= options.traversalCost + options.intersectionCost * bestCost / area) {
+                auto ret = push(nodes, BVHNode{bounds, static_cast<uint>(order.size()), static_cast<ushort>(length)});
+                order.insert(order.end(), refs.begin(), refs.end());
+                return ret;
+            }
+        }
+        std::vector<BVHPrimitive> left, right;
+        if (spatialCost < splitCost && splitSpatially(refs, spatialDim, position, left, right)) {
+            dim = spatialDim;
+        } else {
+            // object split, or any split if all centroids coincide (see splitSAH)
+            left.assign(refs.begin(), refs.begin() + middle);
+            right.assign(refs.begin() + middle, refs.end());
+        }
+        refs = {};
+
+        auto ret = push(nodes, BVHNode{bounds, 0, 0, dim});
+        if (depth < parallelDepth && length >= PARALLEL_THRESHOLD) {
+            // build the right subtree on another task, then append it and its leaves behind the left one
+            std::vector<BVHNode> rightNodes;
+            std::vector<BVHPrimitive> rightOrder;
+            auto task = std::async(std::launch::async, [&, depth]() {
+                recur(rightNodes, rightOrder, std::move(right), depth + 1);
+            });
+            recur(nodes, order, std::move(left), depth + 1);
+            task.get();
+            auto orderBase = static_cast<uint>(order.size());
+            for (auto &node: rightNodes) {
+                if (node.primitiveCount) {
+                    node.offset += orderBase;
+                }
+            }
+            order.insert(order.end(), rightOrder.begin(), rightOrder.end());
+            nodes[ret].offset = spliceSubtree(nodes, rightNodes);
+        } else {
+            recur(nodes, order, std::move(left), depth + 1);
+            nodes[ret].offset = recur(nodes, order, std::move(right), depth + 1);
+        }
+        return ret;
+    }
+};
+
+/**
+ * Post-build pass over a finished BVH.
+ * Treelets are restructured bottom-up to lower the SAH cost, see Karras and Aila, "Fast Parallel Construction of
+ * High-Quality Bounding Volume Hierarchies" (2013): the treelet below a node is grown by opening its largest
+ * interior leaves, and the optimal binary tree over its leaves is found by dynamic programming over all subsets.
+ * The nodes are then emitted depth-first again. Putting the child of larger surface area directly behind its
+ * parent keeps the path most rays take contiguous in memory.
+ */
+struct BVHOptimizer {
+    static constexpr uint MAX_TREELET_LEAVES = 7;
+
+    struct Node {
+        Bounds3 bounds;
+        // children of an interior node, the first primitive of a leaf in child[0]
+        uint child[2];
+        uint primitiveCount;
+        // SAH cost of the subtree, not normalized by the area of the root
+        float cost;
+    };
+
+    struct Treelet {
+        uint leaves[MAX_TREELET_LEAVES];
+        // nodes reused for the new topology, the root first
+        uint interiors[MAX_TREELET_LEAVES - 1];
+        Bounds3 bounds[1u << MAX_TREELET_LEAVES];
+        float cost[1u << MAX_TREELET_LEAVES];
+        // leaves of the first child of the optimal tree over a subset of the leaves
+        uint split[1u << MAX_TREELET_LEAVES];
+    };
+
+    const cg::BVHBuildOptions &options;
+    std::vector<Node> tree;
+    uint parallelDepth;
+    uint treeletSize;
+
+    BVHOptimizer(const cg::BVHBuildOptions &options, const std::vector<BVHNode> &nodes)
+        : options(options), tree(nodes.size()), parallelDepth(parallelDepthFor(options)),
+          treeletSize(std::min(options.treeletSize, MAX_TREELET_LEAVES)) {
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            const auto &node = nodes[i];
+            uint first = node.primitiveCount ? node.offset : static_cast<uint>(i + 1);
+            tree[i] = Node{node.bounds, {first, node.offset}, node.primitiveCount, 0.0f};
+        }
+    }
+
+    /**
+     * Restructures the subtree of a node bottom-up, and computes the costs of its nodes.
+     */
+    void restructure(uint nodeIdx, uint depth) {
+        auto &node = tree[nodeIdx];
+        float area = node.bounds.surfaceArea();
+        if (node.primitiveCount) {
+            node.cost = options.intersectionCost * area * static_cast<float>(node.primitiveCount);
+            return;
+        }
+        if (depth < parallelDepth) {
+            auto second = std::async(std::launch::async, [&, depth]() {
+                restructure(node.child[1], depth + 1);
+            });
+            restructure(node.child[0], depth + 1);
+            second.get();
+        } else {
+            restructure(node.child[0], depth + 1);
+            restructure(node.child[1], depth + 1);
+        }
+        node.cost = options.traversalCost * area + tree[node.child[0]].cost + tree[node.child[1]].cost;
+        if (treeletSize >= 3) {
+            optimizeTreelet(nodeIdx);
+        }
+    }
+
+    void optimizeTreelet(uint root) {
+        Treelet treelet;
+        treelet.leaves[0] = tree[root].child[0];
+        treelet.leaves[1] = tree[root].child[1];
+        treelet.interiors[0] = root;
+        uint leafCount = 2;
+        uint interiorCount = 1;
+        while (leafCount < treeletSize) {
+            int largest = -1;
+            float largestArea = -1.0f;
+            for (uint i = 0; i < leafCount; ++i) {
+                const auto &leaf = tree[treelet.leaves[i]];
+                if (!leaf.primitiveCount && leaf.bounds.surfaceArea() > largestArea) {
+                    largest = static_cast<int>(i);
+                    largestArea = leaf.bounds.surfaceArea();
+                }
+            }
+            if (largest < 0) {
+                break;
+            }
+            uint opened = treelet.leaves[largest];
+            treelet.interiors[interiorCount++] = opened;
+            treelet.leaves[largest] = tree[opened].child[0];
+            treelet.leaves[leafCount++] = tree[opened].child[1];
+        }
+        if (leafCount < 3) {
+            // two leaves have a single topology
+            return;
+        }
+
+        const uint full = (1u << leafCount) - 1;
+        for (uint subset = 1; subset <= full; ++subset) {
+            uint lowest = subset & (~subset + 1);
+            const auto &leaf = tree[treelet.leaves[std::countr_zero(subset)]];
+            if (subset == lowest) {
+                treelet.bounds[subset] = leaf.bounds;
+                treelet.cost[subset] = leaf.cost;
+                continue;
+            }
+            treelet.bounds[subset] = treelet.bounds[subset ^ lowest] + leaf.bounds;
+            // every partition is tried once, with the lowest leaf in the first part. smaller subsets are done already
+            float bestCost = std::numeric_limits<float>::max();
+            for (uint part = (subset - 1) & subset; part; part = (part - 1) & subset) {
+                if (!(part & lowest)) {
+                    continue;
+                }
+                float cost = treelet.cost[part] + treelet.cost[subset ^ part];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    treelet.split[subset] = part;
+                }
+            }
+            treelet.cost[subset] = options.traversalCost * treelet.bounds[subset].surfaceArea() + bestCost;
+        }
+        if (treelet.cost[full] >= tree[root].cost) {
+            return;
+        }
+        uint next = 0;
+        rebuild(treelet, full, next);
+    }
+
+    /**
+     * Links the optimal tree over a subset of the treelet leaves, reusing the interior nodes of the treelet.
+     * @return the root of the subset's tree
+     */
+    uint rebuild(const Treelet &treelet, uint subset, uint &next) {
+        if (!(subset & (subset - 1))) {
+            return treelet.leaves[std::countr_zero(subset)];
+        }
+        uint nodeIdx = treelet.interiors[next++];
+        uint first = rebuild(treelet, treelet.split[subset], next);
+        uint second = rebuild(treelet, subset ^ treelet.split[subset], next);
+        tree[nodeIdx] = Node{treelet.bounds[subset], {first, second}, 0, treelet.cost[subset]};
+        return nodeIdx;
+    }
+
+    /**
+     * Emits the subtree of a node in depth-first order, see BVHBuilder::recur.
+     * @param primitiveOrder leaves reference ranges of it, it holds primitive indices in the order of the build
+     */
+    uint emit(std::vector<BVHNode> &nodes, std::vector<uint> &primitiveOrder, uint nodeIdx) const {
+        const auto &node = tree[nodeIdx];
+        if (node.primitiveCount) {
+            auto first = static_cast<uint>(primitiveOrder.size());
+            for (uint i = node.child[0]; i < node.child[0] + node.primitiveCount; ++i) {
+                primitiveOrder.push_back(i);
+            }
+            return push(nodes, BVHNode{node.bounds, first, static_cast<ushort>(node.primitiveCount)});
+        }
+        uint first = node.child[0], second = node.child[1];
+        if (options.reorderNodes && tree[second].bounds.surfaceArea() > tree[first].bounds.surfaceArea()) {
+            std::swap(first, second);
+        }
+        // order the children along the axis their centroids are farthest apart on
+        auto delta = tree[second].bounds.centroid() - tree[first].bounds.centroid();
+        int axis = 0;
+        for (int i = 1; i < 3; ++i) {
+            if (std::abs(delta.s[i]) > std::abs(delta.s[axis])) {
+                axis = i;
+            }
+        }
+        auto dim = static_cast<ushort>(delta.s[axis] < 0.0f ? axis | BVH_DIM_SWAPPED : axis);
+        auto ret = push(nodes, BVHNode{node.bounds, 0, 0, dim});
+        emit(nodes, primitiveOrder, first);
+        nodes[ret].offset = emit(nodes, primitiveOrder, second);
+        return ret;
+    }
+};
+}
+
+/**
+ * Runs BVHOptimizer on a built BVH if the options ask for it.
+ * @param order the primitive order of the build, permuted along with the leaves
+ */
+static void optimizeBVH(std::vector<BVHNode> &nodes, std::vector<uint> &order, const cg::BVHBuildOptions &options) {
+    if (options.treeletSize < 3 && !options.reorderNodes) {
+        return;
+    }
+    BVHOptimizer optimizer(options, nodes);
+    if (optimizer.treeletSize >= 3) {
+        optimizer.restructure(0, 0);
+    }
+    std::vector<BVHNode> optimized;
+    optimized.reserve(nodes.size());
+    std::vector<uint> primitiveOrder;
+    primitiveOrder.reserve(order.size());
+    optimizer.emit(optimized, primitiveOrder, 0);
+    nodes.swap(optimized);
+
+    std::vector<uint> permuted(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        permuted[i] = order[primitiveOrder[i]];
+    }
+    order.swap(permuted);
+}
+
+/**
+ * Sets the parent links of a finished BVH, the root is its own parent.
+ */
+static void linkParents(std::vector<BVHNode> &nodes) {
+    nodes[0].parent = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (!nodes[i].primitiveCount) {
+            nodes[i + 1].parent = static_cast<uint>(i);
+            nodes[nodes[i].offset].parent = static_cast<uint>(i);
+        }
+    }
+}
+
+static std::vector<uint> buildLBVH(std::vector<BVHNode> &nodes, const std::vector<Bounds3> &bounds,
+                                   const cg::BVHBuildOptions &options) {
+    std::vector<float3> centroids(bounds.size());
+    Bounds3 centroidBounds;
+    for (size_t i = 0; i < bounds.size(); ++i) {
+        centroids[i] = bounds[i].centroid();
+        centroidBounds += centroids[i];
+    }
+    std::vector<uint> codes, order;
+    if (!options.mortonSorter || !options.mortonSorter(centroids, centroidBounds, codes, order)) {
+        auto extent = centroidBounds.pMax - centroidBounds.pMin;
+        float3 inverseExtent;
+        for (int axis = 0; axis < 3; ++axis) {
+            inverseExtent.s[axis] = extent.s[axis] > 0.0f ? 1.0f / extent.s[axis] : 0.0f;
+        }
+        codes.resize(bounds.size());
+        order.resize(bounds.size());
+        for (size_t i = 0; i < bounds.size(); ++i) {
+            auto p = centroids[i] - centroidBounds.pMin;
+            codes[i] = mortonCode(p.x * inverseExtent.x, p.y * inverseExtent.y, p.z * inverseExtent.z);
+            order[i] = static_cast<uint>(i);
+        }
+        radixSort(codes, order);
+    }
+    LBVHBuilder(options, bounds, codes, order).recur(nodes, 0, static_cast<uint>(bounds.size()), 0);
+    return order;
+}
+
+static std::vector<uint> buildSBVH(std::vector<BVHNode> &nodes, const std::vector<Triangle> &triangles,
+                                   const std::vector<Vertex> &vertices, const std::vector<Bounds3> &bounds,
+                                   const cg::BVHBuildOptions &options) {
+    std::vector<BVHPrimitive> refs(bounds.size());
+    for (size_t i = 0; i < bounds.size(); ++i) {
+        refs[i] = BVHPrimitive{bounds[i], bounds[i].centroid(), static_cast<uint>(i)};
+    }
+    std::vector<BVHPrimitive> leafRefs;
+    leafRefs.reserve(refs.size());
+    SBVHBuilder(options, triangles, vertices).recur(nodes, leafRefs, std::move(refs), 0);
+    std::vector<uint> order(leafRefs.size());
+    for (size_t i = 0; i < leafRefs.size(); ++i) {
+        order[i] = leafRefs[i].index;
+    }
+    return order;
+}
+
+std::vector<uint> cg::BVH::buildFromBounds(const std::vector<Bounds3> &bounds, const BVHBuildOptions &options) {
+    nodes.clear();
+    duplicatedReferences = 0;
+    // prevent empty buffer
+    if (bounds.empty()) {
+        nodes.emplace_back();
+        return {};
+    }
+    nodes.reserve(bounds.size() * 2 - 1);
+    std::vector<uint> order;
+    if (options.method == BVHBuildMethod::LBVH) {
+        order = buildLBVH(nodes, bounds, options);
+    } else {
+        std::vector<BVHPrimitive> refs(bounds.size());
+        for (size_t i = 0; i < bounds.size(); ++i) {
+            refs[i] = BVHPrimitive{bounds[i], bounds[i].centroid(), static_cast<uint>(i)};
+        }
+        BVHBuilder(options, refs).recur(nodes, 0, static_cast<uint>(refs.size()), 0);
+
+        order.resize(refs.size());
+        for (size_t i = 0; i < refs.size(); ++i) {
+            order[i] = refs[i].index;
+        }
+    }
+    optimizeBVH(nodes, order, options);
+    linkParents(nodes);
+    builtCost = sahCost(options);
+    return order;
+}
+
+std::vector<uint> cg::BVH::buildFromTriangles(std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
+                                              const BVHBuildOptions &options) {
+    std::vector<Bounds3> bounds(triangles.size());
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        bounds[i] = triangles[i].bounds(vertices.data());
+    }
+    std::vector<uint> order;
+    if (options.method == BVHBuildMethod::SBVH && !triangles.empty()) {
+        nodes.clear();
+        order = buildSBVH(nodes, triangles, vertices, bounds, options);
+        optimizeBVH(nodes, order, options);
+        linkParents(nodes);
+        builtCost = sahCost(options);
+        duplicatedReferences = static_cast<uint>(order.size() - triangles.size());
+    } else {
+        order = buildFromBounds(bounds, options);
+    }
+    // a single gather of the triangles instead of moving them during the build
+    std::vector<Triangle> ordered(order.size());
+    // copies made by spatial splits refer to the first one
+    std::vector<uint> firstCopy(triangles.size(), std::numeric_limits<uint>::max());
+    for (size_t i = 0; i < order.size(); ++i) {
+        ordered[i] = triangles[order[i]];
+        if (firstCopy[order[i]] == std::numeric_limits<uint>::max()) {
+            firstCopy[order[i]] = static_cast<uint>(i);
+        }
+        ordered[i].original = firstCopy[order[i]];
+    }
+    triangles.swap(ordered);
+    return order;
+}
+
+bool cg::BVH::refit(const std::vector<Bounds3> &bounds, const BVHBuildOptions &options) {
+    if (bounds.empty() || nodes.empty()) {
+        return true;
+    }
+    // children are always stored behind their parent, so a reverse sweep updates them first
+    for (size_t i = nodes.size(); i-- > 0;) {
+        auto &node = nodes[i];
+        if (node.primitiveCount) {
+            node.bounds = bounds[node.offset];
+            for (uint p = node.offset + 1; p < node.offset + node.primitiveCount; ++p) {
+                node.bounds += bounds[p];
+            }
+        } else {
+            node.bounds = nodes[i + 1].bounds + nodes[node.offset].bounds;
+        }
+    }
+    return sahCost(options) <= builtCost * options.maxRefitCostRatio;
+}
+
+float cg::BVH::sahCost(const BVHBuildOptions &options) const {
+    if (nodes.empty()) {
+        return 0.0f;
+    }
+    float rootArea = nodes[0].bounds.surfaceArea();
+    if (rootArea <= 0.0f) {
+        return 0.0f;
+    }
+    float cost = 0.0f;
+    for (const auto &node: nodes) {
+        float area = node.bounds.surfaceArea() / rootArea;
+        cost += node.primitiveCount
+                ? area * options.intersectionCost * static_cast<float>(node.primitiveCount)
+                : area * options.traversalCost;
+    }
+    return cost;
+}
+
+namespace {
+/**
+ * Quantizes child bounds onto the grid of their parent, rounding outwards so that the decoded bounds (computed as
+ * origin + q * step in the kernel, which is exact up to the final addition) always contain the original ones.
+ */
+struct QuantizationGrid {
+    float origin[3];
+    float step[3];
+    uchar exponent[3];
+
+    explicit QuantizationGrid(const Bounds3 &bounds) {
+        const float pMin[3] = {bounds.pMin.x, bounds.pMin.y, bounds.pMin.z};
+        const float pMax[3] = {bounds.pMax.x, bounds.pMax.y, bounds.pMax.z};
+        for (int axis = 0; axis < 3; ++axis) {
+            origin[axis] = pMin[axis];
+            // smallest power of two step whose 255 steps cover the extent, the step must stay a normal float
+            int e;
+            std::frexp((pMax[axis] - pMin[axis]) / 255.0f, &e);
+            int biased = std::clamp(e + 127, 1, 254);
+            while (biased < 254 && origin[axis] + 255.0f * as_float(static_cast<uint>(biased) << 23) < pMax[axis]) {
+                ++biased;
+            }
+            exponent[axis] = static_cast<uchar>(biased);
+            step[axis] = as_float(static_cast<uint>(biased) << 23);
+        }
+    }
+
+    uchar quantizeMin(float value, int axis) const {
+        auto q = static_cast<int>(std::clamp(std::floor((value - origin[axis]) / step[axis]), 0.0f, 255.0f));
+        while (q > 0 && origin[axis] + static_cast<float>(q) * step[axis] > value) {
+            --q;
+        }
+        return static_cast<uchar>(q);
+    }
+
+    uchar quantizeMax(float value, int axis) const {
+        auto q = static_cast<int>(std::clamp(std::ceil((value - origin[axis]) / step[axis]), 0.0f, 255.0f));
+        while (q < 255 && origin[axis] + static_cast<float>(q) * step[axis] < value) {
+            ++q;
+        }
+        return static_cast<uchar>(q);
+    }
+};
+
+struct BVHCompressor {
+    const std::vector<BVHNode> &nodes;
+    std::vector<CompressedBVHNode> &output;
+    uint primitiveBase;
+
+    /**
+     * @param parent index of the compressed parent node
+     */
+    uint reference(uint nodeIdx, uint parent) {
+        const auto &node = nodes[nodeIdx];
+        if (node.primitiveCount) {
+            return (node.offset + primitiveBase) << BVH_CHILD_COUNT_BITS | node.primitiveCount;
+        }
+        return compress(nodeIdx, parent) << BVH_CHILD_COUNT_BITS;
+    }
+
+    uint compress(uint nodeIdx, uint parent) {
+        const auto &node = nodes[nodeIdx];
+        auto index = static_cast<uint>(output.size());
+        output.emplace_back();
+
+        QuantizationGrid grid(node.bounds);
+        CompressedBVHNode compressed{};
+        for (int axis = 0; axis < 3; ++axis) {
+            compressed.origin[axis] = grid.origin[axis];
+            compressed.exponent[axis] = grid.exponent[axis];
+        }
+        compressed.dim = static_cast<uchar>(node.dim);
+        compressed.parent = parent;
+        const uint children[2] = {nodeIdx + 1, node.offset};
+        for (int i = 0; i < 2; ++i) {
+            const auto &bounds = nodes[children[i]].bounds;
+            const float pMin[3] = {bounds.pMin.x, bounds.pMin.y, bounds.pMin.z};
+            const float pMax[3] = {bounds.pMax.x, bounds.pMax.y, bounds.pMax.z};
+            for (int axis = 0; axis < 3; ++axis) {
+                compressed.childBounds[i][0][axis] = grid.quantizeMin(pMin[axis], axis);
+                compressed.childBounds[i][1][axis] = grid.quantizeMax(pMax[axis], axis);
+            }
+            // output may grow during the recursion, so the node is written back only at the end
+            compressed.child[i] = reference(children[i], index);
+        }
+        output[index] = compressed;
+        return index;
+    }
+};
+}
+
+uint cg::BVH::compress(std::vector<CompressedBVHNode> &output, uint primitiveBase) const {
+    // the root is its own parent
+    return BVHCompressor{nodes, output, primitiveBase}.reference(0, static_cast<uint>(output.size()));
+}
+
+namespace {
+/**
+ * Cone of directions around a unit axis, empty until a direction is merged into it.
+ */
+struct DirectionCone {
+    float3 axis{0.0f, 1.0f, 0.0f};
+    float cosTheta = 1.0f;
+    bool empty = true;
+
+    /**
+     * Grows the cone to also contain another one, see DirectionCone::Union of pbrt-v4.
+     */
+    void merge(const DirectionCone &other) {
+        if (other.empty) {
+            return;
+        }
+        if (empty) {
+            *this = other;
+            return;
+        }
+        float theta = std::acos(std::clamp(cosTheta, -1.0f, 1.0f));
+        float otherTheta = std::acos(std::clamp(other.cosTheta, -1.0f, 1.0f));
+        float between = std::acos(std::clamp(dot(axis, other.axis), -1.0f, 1.0f));
+        if (std::min(between + otherTheta, RT_M_PI_F) <= theta) {
+            return;
+        }
+        if (std::min(between + theta, RT_M_PI_F) <= otherTheta) {
+            *this = other;
+            return;
+        }
+        // the merged cone touches both, its axis is rotated from this one towards the other
+        float merged = 0.5f * (theta + between + otherTheta);
+        float3 rotationAxis = cross(axis, other.axis);
+        if (merged >= RT_M_PI_F || dot(rotationAxis, rotationAxis) == 0.0f) {
+            cosTheta = -1.0f;
+            return;
+        }
+        float rotation = merged - theta;
+        rotationAxis = normalize(rotationAxis);
+        axis = normalize(axis * std::cos(rotation) + cross(rotationAxis, axis) * std::sin(rotation));
+        cosTheta = std::cos(merged);
+    }
+
+    /**
+     * Orientation measure of the surface area orientation heuristic, for lights that emit into the hemisphere
+     * around their normal.
+     */
+    float measure() const {
+        float thetaO = std::acos(std::clamp(cosTheta, -1.0f, 1.0f));
+        float thetaW = std::min(thetaO + 0.5f * RT_M_PI_F, RT_M_PI_F);
+        float sinThetaO = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+        return 2.0f * RT_M_PI_F * (1.0f - cosTheta)
+               + 0.5f * RT_M_PI_F * (2.0f * thetaW * sinThetaO - std::cos(thetaO - 2.0f * thetaW)
+                                     - 2.0f * thetaO * sinThetaO + cosTheta);
+    }
+};
+
+/**
+ * Bounds, power and normal cone of a set of lights, a SAOH bin or a light BVH node.
+ */
+struct LightCluster {
+    Bounds3 bounds;
+    DirectionCone cone;
+    float power = 0.0f;
+    uint count = 0;
+
+    void add(const cg::LightBounds &light) {
+        bounds += light.bounds;
+        // lights without power are never picked, they must not widen the cone
+        if (light.power > 0.0f) {
+            cone.merge(DirectionCone{light.normal, 1.0f, false});
+            power += light.power;
+        }
+        ++count;
+    }
+
+    void add(const LightCluster &other) {
+        bounds += other.bounds;
+        cone.merge(other.cone);
+        power += other.power;
+        count += other.count;
+    }
+
+    /**
+     * @param regularization penalty of splitting along a short axis of the parent bounds
+     */
+    float cost(float regularization) const {
+        return count ? power * cone.measure() * bounds.surfaceArea() * regularization : 0.0f;
+    }
+};
+
+struct LightBVHBuilder {
+    const std::vector<cg::LightBounds> &lights;
+    // indices of the lights, partitioned by the build
+    std::vector<uint> &order;
+    std::vector<LightBVHNode> &nodes;
+    std::vector<uint> &leaves;
+    uint binCount;
+
+    /**
+     * Binned split with the lowest surface area orientation heuristic, see Conty Estevez and Kulla, "Importance
+     * Sampling of Many Lights with Adaptive Tree Splitting" (2018).
+     * @return the first light of the right child
+     */
+    uint split(uint begin, uint end, const Bounds3 &bounds, const Bounds3 &centroidBounds) {
+        std::vector<LightCluster> bins(binCount * 3);
+        std::vector<float> rightCost(binCount);
+        float scale[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            float extent = centroidBounds.pMax.s[axis] - centroidBounds.pMin.s[axis];
+            scale[axis] = extent > 0.0f ? static_cast<float>(binCount) / extent : 0.0f;
+        }
+        const auto binIndex = [&](uint light, int axis) -> uint {
+            float centroid = lights[light].bounds.centroid().s[axis];
+            auto bin = static_cast<uint>((centroid - centroidBounds.pMin.s[axis]) * scale[axis]);
+            return std::min(bin, binCount - 1);
+        };
+        for (uint i = begin; i < end; ++i) {
+            for (int axis = 0; axis < 3; ++axis) {
+                bins[axis * binCount + binIndex(order[i], axis)].add(lights[order[i]]);
+            }
+        }
+
+        const float3 extent = bounds.pMax - bounds.pMin;
+        const float maxExtent = std::max({extent.x, extent.y, extent.z});
+        int bestAxis = -1;
+        uint bestSplit = 0;
+        float bestCost = std::numeric_limits<float>::max();
+        for (int axis = 0; axis < 3; ++axis) {
+            if (scale[axis] == 0.0f) {
+                continue;
+            }
+            const LightCluster *axisBins = bins.data() + axis * binCount;
+            float regularization = extent.s[axis] > 0.0f ? maxExtent / extent.s[axis] : 1.0f;
+            // sweep from the right to collect the costs of all right partitions
+            LightCluster accumulated;
+            for (uint b = binCount - 1; b > 0; --b) {
+                accumulated.add(axisBins[b]);
+                rightCost[b] = accumulated.count ? accumulated.cost(regularization) : -1.0f;
+            }
+            // then sweep from the left, splitting between bin (b - 1) and bin b
+            accumulated = LightCluster();
+            for (uint b = 1; b < binCount; ++b) {
+                accumulated.add(axisBins[b - 1]);
+                if (!accumulated.count || rightCost[b] < 0.0f) {
+                    continue;
+                }
+                float splitCost = accumulated.cost(regularization) + rightCost[b];
+                if (splitCost < bestCost) {
+                    bestCost = splitCost;
+                    bestAxis = axis;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        if (bestAxis < 0) {
+            // all centroids coincide, any split is as good as the others
+            return begin + (end - begin) / 2;
+        }
+        auto middle = std::partition(order.begin() + begin, order.begin() + end, [&](uint light) {
+            return binIndex(light, bestAxis) < bestSplit;
+        });
+        return static_cast<uint>(middle - order.begin());
+    }
+
+    /**
+     * Emits the subtree over order[begin, end) in depth-first order like BVHBuilder::recur.
+     */
+    uint recur(uint begin, uint end, uint parent) {
+        LightCluster cluster;
+        Bounds3 centroidBounds;
+        for (uint i = begin; i < end; ++i) {
+            cluster.add(lights[order[i]]);
+            centroidBounds += lights[order[i]].bounds.centroid();
+        }
+        auto index = static_cast<uint>(nodes.size());
+        nodes.push_back(LightBVHNode{cluster.bounds, cluster.cone.axis, cluster.cone.cosTheta, cluster.power, 0,
+                                     parent});
+        if (end - begin == 1) {
+            nodes[index].offset = order[begin] | LIGHT_BVH_LEAF;
+            leaves[order[begin]] = index;
+            return index;
+        }
+        uint middle = split(begin, end, cluster.bounds, centroidBounds);
+        recur(begin, middle, index);
+        // nodes grows during the recursion, so the offset is written back only at the end
+        uint right = recur(middle, end, index);
+        nodes[index].offset = right;
+        return index;
+    }
+};
+}
+
+std::vector<uint> cg::LightBVH::build(const std::vector<LightBounds> &lights, uint bins) {
+    nodes.clear();
+    std::vector<uint> leaves(lights.size());
+    if (lights.empty()) {
+        return leaves;
+    }
+    std::vector<uint> order(lights.size());
+    std::iota(order.begin(), order.end(), 0u);
+    nodes.reserve(2 * lights.size() - 1);
+    // the root is its own parent
+    LightBVHBuilder builder{lights, order, nodes, leaves, std::clamp(bins, 2u, 256u)};
+    builder.recur(0, static_cast<uint>(lights.size()), 0);
+    return leaves;
+}
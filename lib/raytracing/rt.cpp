@@ -12,16 +12,267 @@
 #include <vector>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
 #include <functional>
 #include <random>
 #include <thread>
 
+static void setVertexNormal(VertexShading &shading, glm::vec3 normal) {
+#ifdef QUANTIZED_VERTICES
+    // project onto the octahedron |x| + |y| + |z| = 1 and unfold its lower half
+    float norm = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+    if (norm == 0.0f) {
+        normal = glm::vec3{0.0f, 0.0f, 1.0f};
+        norm = 1.0f;
+    }
+    glm::vec2 p = glm::vec2(normal) / norm;
+    if (normal.z < 0) {
+        p = glm::vec2{
+            (1.0f - std::abs(p.y)) * (p.x >= 0 ? 1.0f : -1.0f),
+            (1.0f - std::abs(p.x)) * (p.y >= 0 ? 1.0f : -1.0f)
+        };
+    }
+    for (int i = 0; i < 2; ++i) {
+        shading.normal[i] = static_cast<short>(std::round(glm::clamp(p[i], -1.0f, 1.0f) * 32767.0f));
+    }
+#else
+    for (int i = 0; i < 3; ++i) {
+        shading.normal[i] = normal[i];
+    }
+#endif
+}
+
+static void setVertexTexcoord(VertexShading &shading, glm::vec2 texcoord) {
+    for (int i = 0; i < 2; ++i) {
+#ifdef QUANTIZED_VERTICES
+        shading.texcoord[i] = glm::packHalf1x16(texcoord[i]);
+#else
+        shading.texcoord[i] = texcoord[i];
+#endif
+    }
+}
+
+/**
+ * Collects the triangles of a geometry in object space. They index the vertices of the geometry, which are copied
+ * once no matter how many triangles share them.
+ * @param vertices outputs the positions of all vertices of the geometry
+ * @param vertexShading outputs their shading attributes
+ * @param vertexToObject outputs the mapping of the grid that QUANTIZED_VERTICES positions are stored on to object
+ * space, the identity otherwise
+ */
+static std::vector<Triangle> collectTriangles(const cg::MeshGeometry &geometry, std::vector<Vertex> &vertices,
+                                              std::vector<VertexShading> &vertexShading,
+                                              glm::mat4 &vertexToObject) {
+    std::vector<Triangle> triangles;
+    vertexToObject = glm::mat4{1.0f};
+    auto positionAttribute = geometry.getAttribute("position");
+    if (!positionAttribute.has_value()) {
+        return triangles;
+    }
+    const auto &position = *positionAttribute.value();
+    auto texcoord = geometry.getAttribute("texcoord").value_or(nullptr);
+    auto normal = geometry.getAttribute("normal").value_or(nullptr);
+    const size_t vertexCount = position.buf.size() / position.itemSize;
+    const auto point = [&](size_t v) {
+        return glm::vec3{
+            position.buf[v * position.itemSize + 0],
+            position.buf[v * position.itemSize + 1],
+            position.buf[v * position.itemSize + 2]
+        };
+    };
+#ifdef QUANTIZED_VERTICES
+    // a 16 bit grid over the bounds of the geometry, flat axes keep a unit step
+    glm::vec3 lo{std::numeric_limits<float>::max()}, hi{std::numeric_limits<float>::lowest()};
+    for (size_t v = 0; v < vertexCount; ++v) {
+        lo = glm::min(lo, point(v));
+        hi = glm::max(hi, point(v));
+    }
+    for (int axis = 0; axis < 3; ++axis) {
+        vertexToObject[axis][axis] = hi[axis] > lo[axis] ? (hi[axis] - lo[axis]) / 65535.0f : 1.0f;
+    }
+    if (vertexCount) {
+        vertexToObject[3] = glm::vec4{lo, 1.0f};
+    }
+#endif
+    const glm::mat4 objectToVertex = glm::inverse(vertexToObject);
+    vertices.resize(vertexCount);
+    vertexShading.resize(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v) {
+        glm::vec3 p{objectToVertex * glm::vec4{point(v), 1.0f}};
+        for (int axis = 0; axis < 3; ++axis) {
+#ifdef QUANTIZED_VERTICES
+            vertices[v].position[axis] = static_cast<ushort>(std::round(glm::clamp(p[axis], 0.0f, 65535.0f)));
+#else
+            vertices[v].position[axis] = p[axis];
+#endif
+        }
+        if (normal) {
+            const auto &buf = normal->buf;
+            const auto size = normal->itemSize;
+            setVertexNormal(vertexShading[v], glm::vec3{buf[v * size + 0], buf[v * size + 1], buf[v * size + 2]});
+        }
+        if (texcoord) {
+            const auto &buf = texcoord->buf;
+            const auto size = texcoord->itemSize;
+            setVertexTexcoord(vertexShading[v], glm::vec2{buf[v * size + 0], buf[v * size + 1]});
+        }
+    }
+    const auto addTriangle = [&](uint32_t v0, uint32_t v1, uint32_t v2) {
+        triangles.push_back(Triangle{.vertex = {v0, v1, v2}});
+    };
+    if (geometry.hasIndices()) {
+        const auto &indices = geometry.getIndices().value();
+        for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+            addTriangle(indices[i], indices[i + 1], indices[i + 2]);
+        }
+    } else {
+        for (size_t i = 0; i + 2 < vertexCount; i += 3) {
+            addTriangle(i, i + 1, i + 2);
+        }
+    }
+    return triangles;
+}
+
+/**
+ * Visits every ray traced instance with its world transform: one for every mesh, or one for every instance of an
+ * InstancedMesh.
+ */
+template<typename Func>
+static void forEachInstance(cg::Scene &scene, Func &&func) {
+    scene.traverse([&](cg::Object3D &object) {
+        cg::Mesh *mesh = object.isMesh();
+        if (!mesh || mesh->isBackground()) return;
+        auto modelMatrix = object.modelMatrix();
+        if (auto *instancedMesh = mesh->isInstancedMesh()) {
+            for (int i = 0; i < instancedMesh->instanceCount(); ++i) {
+                func(*mesh, modelMatrix * instancedMesh->instanceMatrix(i));
+            }
+        } else {
+            func(*mesh, modelMatrix);
+        }
+    });
+}
+
+/**
+ * @param vertexToObject BottomLevel::vertexToObject of the instanced geometry
+ */
+static void setInstanceTransform(RayTracingInstance &instance, const glm::mat4 &modelMatrix,
+                                 const glm::mat4 &vertexToObject) {
+    auto transform = modelMatrix * vertexToObject;
+    auto inverse = glm::inverse(transform);
+    for (int i = 0; i < 4; ++i) {
+        instance.objectToWorld[i] = toFloat3(glm::vec3(transform[i]));
+        instance.worldToObject[i] = toFloat3(glm::vec3(inverse[i]));
+    }
+    instance.normalScale = toFloat3(1.0f / glm::vec3{vertexToObject[0][0], vertexToObject[1][1], vertexToObject[2][2]});
+}
+
+/**
+ * World space bounds of the transformed corners of object space bounds.
+ */
+static Bounds3 transformBounds(const Bounds3 &bounds, const glm::mat4 &modelMatrix) {
+    Bounds3 result;
+    for (int corner = 0; corner < 8; ++corner) {
+        glm::vec4 point{
+            (corner & 1 ? bounds.pMax : bounds.pMin).x,
+            (corner & 2 ? bounds.pMax : bounds.pMin).y,
+            (corner & 4 ? bounds.pMax : bounds.pMin).z,
+            1.0f
+        };
+        result += toFloat3(glm::vec3(modelMatrix * point));
+    }
+    return result;
+}
+
+/**
+ * Makes an instance of a sphere or a front side plane an analytic shape, which is intersected exactly instead of
+ * through a bottom-level BVH of its tessellation. Emissive spheres stay meshes, light sampling picks their triangles.
+ * @return whether the geometry is such a shape
+ */
+static bool setAnalyticShape(RayTracingInstance &instance, const cg::MeshGeometry &geometry, bool emissive) {
+    if (auto *sphere = geometry.isSphereGeometry(); sphere && !emissive) {
+        instance.shape = SHAPE_SPHERE;
+        instance.shapeSize[0] = sphere->radius();
+        return true;
+    }
+    if (auto *plane = geometry.isPlaneGeometry(); plane && plane->side() == cg::Side::FrontSide) {
+        instance.shape = SHAPE_QUAD;
+        instance.shapeSize[0] = plane->sizeX();
+        instance.shapeSize[1] = plane->sizeZ();
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Object space bounds of an instance, the root of its bottom-level BVH unless it is an analytic shape.
+ */
+static Bounds3 instanceObjectBounds(const RayTracingInstance &instance, const std::vector<BVHNode> &bvhNodes) {
+    switch (instance.shape) {
+        case SHAPE_SPHERE: {
+            float radius = instance.shapeSize[0];
+            return Bounds3{float3{-radius, -radius, -radius}, float3{radius, radius, radius}};
+        }
+        case SHAPE_QUAD: {
+            float halfX = 0.5f * instance.shapeSize[0], halfZ = 0.5f * instance.shapeSize[1];
+            return Bounds3{float3{-halfX, 0.0f, -halfZ}, float3{halfX, 0.0f, halfZ}};
+        }
+        default:
+            return bvhNodes[instance.bvhRoot].bounds;
+    }
+}
+
+const cg::RayTracingScene::BottomLevel &
+cg::RayTracingScene::bottomLevel(const std::shared_ptr<MeshGeometry> &geometry) {
+    const uint maxLeafSize = bvhOptions.maxLeafSize;
+    auto it = bottomLevelCache.find(geometry.get());
+    if (it != bottomLevelCache.end()) {
+        const auto &cached = it->second;
+        if (cached.geometry.lock() == geometry && cached.method == bvhOptions.method
+            && cached.maxLeafSize == maxLeafSize && cached.treeletSize == bvhOptions.treeletSize
+            && cached.deferredLeafSize == bvhOptions.deferredLeafSize) {
+            return cached;
+        }
+    }
+    BottomLevel entry{
+        .geometry = geometry,
+        .method = bvhOptions.method,
+        .maxLeafSize = maxLeafSize,
+        .treeletSize = bvhOptions.treeletSize,
+        .deferredLeafSize = bvhOptions.deferredLeafSize,
+    };
+    entry.triangles = collectTriangles(*geometry, entry.vertices, entry.vertexShading, entry.vertexToObject);
+    auto buildStart = std::chrono::steady_clock::now();
+    entry.bvh.buildFromTriangles(entry.triangles, entry.vertices, bvhOptions);
+    std::chrono::duration<double, std::milli> buildTime = std::chrono::steady_clock::now() - buildStart;
+    printf("BVH of %zu triangles built in %.1f ms: %zu nodes, SAH cost %.2f\n",
+        entry.triangles.size() - entry.bvh.duplicatedReferences, buildTime.count(), entry.bvh.nodes.size(),
+        entry.bvh.builtCost);
+    if (entry.bvh.duplicatedReferences) {
+        printf("Spatial splits duplicated %u triangle references\n", entry.bvh.duplicatedReferences);
+    }
+    return bottomLevelCache[geometry.get()] = std::move(entry);
+}
+
 void cg::RayTracingScene::setFromScene(cg::Scene &scene) {
     bufferNeedUpdate = true;
+    topLevelNeedUpdate = false;
     materials.clear();
+    instances.clear();
+    bvhNodes.clear();
+    compressedNodes.clear();
     triangles.clear();
+    vertices.clear();
+    vertexShading.clear();
     textures.clear();
+    textureData.clear();
     lights.clear();
+    sourceInstances.clear();
+    instanceRecords.clear();
+    // drop the BVHs of geometries that no longer exist
+    std::erase_if(bottomLevelCache, [](const auto &entry) {
+        return entry.second.geometry.expired();
+    });
     std::map<Material *, uint32_t> mtlMap;
     std::map<uint, uint> usedTextures;
     const auto addTexture = [&](const std::optional<Texture> &tex) -> uint {
@@ -42,20 +293,17 @@ void cg::RayTracingScene::setFromScene(cg::Scene &scene) {
         usedTextures.emplace(tex->tex(), static_cast<uint>(textures.size() - 1));
         return textures.size() - 1;
     };
-    scene.traverse([&](Object3D &object) {
-        Mesh *mesh = object.isMesh();
-        if (!mesh || mesh->isBackground()) return;
-        MeshGeometry *geometry = mesh->geometry();
-        Material *mtl = mesh->material();
-        auto bufInfo = [](
-            const std::optional<const MeshGeometry::Attribute *> &buf) -> std::optional<std::pair<std::reference_wrapper<const MeshGeometry::buffer_t>, uint32_t>> {
-            if (buf.has_value()) {
-                return std::make_optional(
-                    std::make_pair(std::reference_wrapper<const MeshGeometry::buffer_t>(buf.value()->buf),
-                        buf.value()->itemSize));
-            }
-            return std::nullopt;
-        };
+    // root nodes and triangle range of every geometry in bvhNodes, compressedNodes and triangles
+    struct PlacedGeometry {
+        uint root;
+        uint compressedRoot;
+        InstanceRecord record;
+    };
+    std::map<const MeshGeometry *, PlacedGeometry> placedGeometries;
+    forEachInstance(scene, [&](Mesh &mesh, const glm::mat4 &modelMatrix) {
+        auto sourceIndex = static_cast<uint>(sourceInstances.size());
+        sourceInstances.push_back(SourceInstance{&mesh, modelMatrix});
+        Material *mtl = mesh.material();
         uint mtlIndex;
         auto mtlIt = mtlMap.find(mtl);
         if (mtlIt != mtlMap.end()) {
@@ -88,83 +336,87 @@ void cg::RayTracingScene::setFromScene(cg::Scene &scene) {
             mtlMap[mtl] = mtlIndex;
             materials.emplace_back(rtMtl);
         }
-        auto position = bufInfo(geometry->getAttribute("position"));
-        if (!position.has_value()) return;
-        auto texcoord = bufInfo(geometry->getAttribute("texcoord"));
-        auto normal = bufInfo(geometry->getAttribute("normal"));
-        auto modelMatrix = object.modelMatrix();
-        const auto transform = [&](auto &&buf, uint v0, uint size) -> float4 {
-            return toFloat4(modelMatrix * glm::vec4{
-                buf.get()[v0 * size + 0], buf.get()[v0 * size + 1], buf.get()[v0 * size + 2], 1.0f
-            });
-        };
-        const auto transformNormal = [&](auto &&buf, uint v0, uint size) -> float4 {
-            return toFloat4(modelMatrix * glm::vec4{
-                buf.get()[v0 * size + 0], buf.get()[v0 * size + 1], buf.get()[v0 * size + 2], 0.0f
-            });
-        };
-        const auto addTriangle = [&](uint32_t v0, uint32_t v1, uint32_t v2) {
-            Triangle triangle{
-                .mtlIndex = mtlIndex,
+
+        RayTracingInstance shapeInstance{.mtlIndex = mtlIndex};
+        const auto &emission = materials[mtlIndex].emission;
+        if (setAnalyticShape(shapeInstance, *mesh.geometry(), emission.x + emission.y + emission.z > 1e-5f)) {
+            InstanceRecord record{sourceIndex, 0, 0, glm::mat4{1.0f}};
+            setInstanceTransform(shapeInstance, modelMatrix, record.vertexToObject);
+            instances.push_back(shapeInstance);
+            instanceRecords.push_back(record);
+            return;
+        }
+        auto placed = placedGeometries.find(mesh.geometry());
+        if (placed == placedGeometries.end()) {
+            const auto &blas = bottomLevel(mesh.sharedGeometry());
+            auto nodeBase = static_cast<uint>(bvhNodes.size());
+            auto triangleBase = static_cast<uint>(triangles.size());
+            auto vertexBase = static_cast<uint>(vertices.size());
+            PlacedGeometry geometry{
+                nodeBase, 0, {sourceIndex, triangleBase, static_cast<uint>(blas.triangles.size()), blas.vertexToObject}
             };
-            // position
-            {
-                auto&[buf, size] = position.value();
-                triangle.v0.position = transform(buf, v0, size);
-                triangle.v1.position = transform(buf, v1, size);
-                triangle.v2.position = transform(buf, v2, size);
-            }
-            // texcoord
-            if (texcoord.has_value()) {
-                auto&[buf, size] = texcoord.value();
-                triangle.v0.texcoord = float2{buf.get()[v0 * size + 0], buf.get()[v0 * size + 1]};
-                triangle.v1.texcoord = float2{buf.get()[v1 * size + 0], buf.get()[v1 * size + 1]};
-                triangle.v2.texcoord = float2{buf.get()[v2 * size + 0], buf.get()[v2 * size + 1]};
-            }
-            // normal
-            if (normal.has_value()) {
-                auto&[buf, size] = normal.value();
-                triangle.v0.normal = transformNormal(buf, v0, size);
-                triangle.v1.normal = transformNormal(buf, v1, size);
-                triangle.v2.normal = transformNormal(buf, v2, size);
-            }
-            triangles.emplace_back(triangle);
-        };
-        if (geometry->hasIndices()) {
-            const auto &indices = geometry->getIndices().value();
-            for (unsigned int i = 0; i < indices.size() - 2; i += 3) {
-                addTriangle(indices[i], indices[i + 1], indices[i + 2]);
-            }
-        } else {
-            const size_t vertices = position.value().first.get().size();
-            for (size_t i = 0; i < vertices - 2; i += 3) {
-                addTriangle(i, i + 1, i + 2);
+            if (geometry.record.triangleCount) {
+                for (auto node: blas.bvh.nodes) {
+                    node.offset += node.primitiveCount ? triangleBase : nodeBase;
+                    node.parent += nodeBase;
+                    bvhNodes.push_back(node);
+                }
+                for (auto triangle: blas.triangles) {
+                    triangle.original += triangleBase;
+                    for (auto &vertex: triangle.vertex) {
+                        vertex += vertexBase;
+                    }
+                    triangles.push_back(triangle);
+                }
+                vertices.insert(vertices.end(), blas.vertices.begin(), blas.vertices.end());
+                vertexShading.insert(vertexShading.end(), blas.vertexShading.begin(), blas.vertexShading.end());
+#ifdef QUANTIZED_BVH
+                // deferred leaves exceed the triangle count of compressed leaves, only the cpu renderer traces
+                // such BVHs and it does not read the compressed nodes
+                if (!bvhOptions.deferredLeafSize) {
+                    geometry.compressedRoot = blas.bvh.compress(compressedNodes, triangleBase);
+                }
+#endif
             }
+            placed = placedGeometries.emplace(mesh.geometry(), geometry).first;
         }
+        auto record = placed->second.record;
+        if (!record.triangleCount) return;
+        record.source = sourceIndex;
+        RayTracingInstance instance{
+            .bvhRoot = placed->second.root,
+            .mtlIndex = mtlIndex,
+            .compressedRoot = placed->second.compressedRoot,
+        };
+        setInstanceTransform(instance, modelMatrix, record.vertexToObject);
+        instances.push_back(instance);
+        instanceRecords.push_back(record);
     });
-    std::vector<int> isLight;
-    for (auto &material: materials) {
-        isLight.emplace_back(material.emission.x + material.emission.y + material.emission.z > 1e-5f);
+    printf("Collected %zu instances of %zu geometries, %zu triangles\n", instances.size(),
+        placedGeometries.size(), triangles.size());
+    buildTopLevel();
+    // prevent empty buffers, or opencl would be angry
+    if (instances.empty()) {
+        instances.emplace_back();
     }
-    puts("Building BVH from collected triangles");
-    bvh.buildFromTriangles(triangles);
-    // gather lighting triangles here since triangles might have been reordered
-    puts("Collecting light sources");
-    for (size_t i = 0; i < triangles.size(); ++i) {
-        if (isLight[triangles[i].mtlIndex]) {
-            lights.push_back(i);
-        }
+    if (bvhNodes.empty()) {
+        bvhNodes.emplace_back();
+    }
+    if (compressedNodes.empty()) {
+        compressedNodes.emplace_back();
     }
-    // prevent empty buffers, or opencl would be angry
     if (triangles.empty()) {
         triangles.emplace_back();
     }
+    if (vertices.empty()) {
+        vertices.emplace_back();
+    }
+    if (vertexShading.empty()) {
+        vertexShading.emplace_back();
+    }
     if (materials.empty()) {
         materials.emplace_back();
     }
-    if (lights.empty()) {
-        lights.emplace_back();
-    }
     if (textures.empty()) {
         textures.emplace_back();
     }
@@ -174,6 +426,147 @@ void cg::RayTracingScene::setFromScene(cg::Scene &scene) {
     puts("Scene building finished");
 }
 
+void cg::RayTracingScene::buildTopLevel() {
+    std::vector<Bounds3> bounds(instanceRecords.size());
+    for (size_t i = 0; i < instanceRecords.size(); ++i) {
+        bounds[i] = transformBounds(instanceObjectBounds(instances[i], bvhNodes),
+            sourceInstances[instanceRecords[i].source].modelMatrix * instanceRecords[i].vertexToObject);
+    }
+    // the wide top-level BVH cannot build deferred subtrees
+    auto topLevelOptions = bvhOptions;
+    topLevelOptions.deferredLeafSize = 0;
+    auto order = tlas.buildFromBounds(bounds, topLevelOptions);
+    std::vector<RayTracingInstance> orderedInstances(order.size());
+    std::vector<InstanceRecord> orderedRecords(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        orderedInstances[i] = instances[order[i]];
+        orderedRecords[i] = instanceRecords[order[i]];
+    }
+    instances.swap(orderedInstances);
+    instanceRecords.swap(orderedRecords);
+
+    // gather lighting triangles here since instances have been reordered
+    collectLights();
+}
+
+void cg::RayTracingScene::collectLights() {
+    lights.clear();
+    std::vector<LightBounds> lightBounds;
+    for (size_t i = 0; i < instanceRecords.size(); ++i) {
+        auto &instance = instances[i];
+        instance.firstLight = static_cast<uint>(lights.size());
+        instance.lightCount = 0;
+        const auto &emission = materials[instance.mtlIndex].emission;
+        if (emission.x + emission.y + emission.z <= 1e-5f) {
+            continue;
+        }
+        const auto &record = instanceRecords[i];
+        const auto transform = sourceInstances[record.source].modelMatrix * record.vertexToObject;
+        const auto normalMatrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+        // same weights as luminance() of the kernel
+        const float emittedLuminance = emission.x * .6f + emission.y * .3f + emission.z * .1f;
+        const auto addLight = [&](uint triangle, const glm::vec3 *corners, int cornerCount, glm::vec3 front,
+                                  float area) {
+            LightBounds light;
+            for (int c = 0; c < cornerCount; ++c) {
+                light.bounds += toFloat3(corners[c]);
+            }
+            // the front side is decided in object space, see facesLight in render_kernel
+            glm::vec3 normal = normalMatrix * front;
+            if (area > 0.0f && glm::length(normal) > 0.0f) {
+                light.power = emittedLuminance * area;
+                light.normal = toFloat3(glm::normalize(normal));
+            }
+            lights.push_back(RayTracingLight{static_cast<uint>(i), triangle});
+            lightBounds.push_back(light);
+        };
+        if (instance.shape == SHAPE_QUAD) {
+            float halfX = 0.5f * instance.shapeSize[0], halfZ = 0.5f * instance.shapeSize[1];
+            glm::vec3 corners[4];
+            for (int c = 0; c < 4; ++c) {
+                glm::vec4 corner{c & 1 ? halfX : -halfX, 0.0f, c & 2 ? halfZ : -halfZ, 1.0f};
+                corners[c] = glm::vec3(transform * corner);
+            }
+            float area = glm::length(glm::cross(corners[1] - corners[0], corners[2] - corners[0]));
+            addLight(LIGHT_WHOLE_SHAPE, corners, 4, glm::vec3{0.0f, 1.0f, 0.0f}, area);
+        } else {
+            for (uint t = record.firstTriangle; t < record.firstTriangle + record.triangleCount; ++t) {
+                // hits report the first copy of a triangle duplicated by spatial splits
+                if (triangles[t].original != t) {
+                    continue;
+                }
+                glm::vec3 points[3], corners[3];
+                for (int v = 0; v < 3; ++v) {
+                    const auto p = vertices[triangles[t].vertex[v]].point();
+                    points[v] = glm::vec3{p.x, p.y, p.z};
+                    corners[v] = glm::vec3(transform * glm::vec4{points[v], 1.0f});
+                }
+                float area = 0.5f * glm::length(glm::cross(corners[1] - corners[0], corners[2] - corners[0]));
+                addLight(t, corners, 3, glm::cross(points[1] - points[0], points[2] - points[0]), area);
+            }
+        }
+        instance.lightCount = static_cast<uint>(lights.size()) - instance.firstLight;
+    }
+    auto leaves = lightTree.build(lightBounds);
+    for (size_t l = 0; l < lights.size(); ++l) {
+        lights[l].node = leaves[l];
+    }
+    // prevent empty buffers, or opencl would be angry. the placeholder light has no power and is never picked
+    if (lights.empty()) {
+        lights.emplace_back();
+        lightTree.build({LightBounds{}});
+    }
+}
+
+bool cg::RayTracingScene::updateFromScene(cg::Scene &scene) {
+    std::vector<int> moved(sourceInstances.size());
+    bool anyMoved = false;
+    size_t count = 0;
+    bool sameInstances = true;
+    forEachInstance(scene, [&](Mesh &mesh, const glm::mat4 &modelMatrix) {
+        if (count >= sourceInstances.size() || sourceInstances[count].mesh != &mesh) {
+            sameInstances = false;
+        } else if (modelMatrix != sourceInstances[count].modelMatrix) {
+            sourceInstances[count].modelMatrix = modelMatrix;
+            moved[count] = anyMoved = true;
+        }
+        ++count;
+    });
+    if (!sameInstances || count != sourceInstances.size()) {
+        return false;
+    }
+    if (!anyMoved || instanceRecords.empty()) {
+        return true;
+    }
+
+    std::vector<Bounds3> bounds(instanceRecords.size());
+    for (size_t i = 0; i < instanceRecords.size(); ++i) {
+        const auto &record = instanceRecords[i];
+        const auto &modelMatrix = sourceInstances[record.source].modelMatrix;
+        if (moved[record.source]) {
+            setInstanceTransform(instances[i], modelMatrix, record.vertexToObject);
+        }
+        bounds[i] = transformBounds(instanceObjectBounds(instances[i], bvhNodes), modelMatrix * record.vertexToObject);
+    }
+    if (!tlas.refit(bounds, bvhOptions)) {
+        puts("Top-level BVH degraded by refitting, rebuilding");
+        buildTopLevel();
+    } else {
+        // the light BVH is in world space
+        collectLights();
+    }
+    topLevelNeedUpdate = true;
+    return true;
+}
+
+std::vector<BottomLevelNode> &cg::RayTracingScene::bottomLevelNodes() {
+#ifdef QUANTIZED_BVH
+    return compressedNodes;
+#else
+    return bvhNodes;
+#endif
+}
+
 struct CPUDispatcher {
     int cores = 1;
 
@@ -212,15 +605,39 @@ struct CPUDispatcher {
 void cg::RayTracingRenderer::renderCPU(cg::RayTracingScene &scene, cg::Camera &camera) {
     auto triangleMemBuffer = scene.triangles.data();
     auto materialMemBuffer = scene.materials.data();
-    auto bvhMemBuffer = scene.bvh.nodes.data();
+    auto bvhMemBuffer = scene.bottomLevelNodes().data();
     rayMemBuffer.resize(_width * _height * spp);
     accumulateFrameBuffer.resize(_width * _height * 4);
-    if (camera.up() != up || camera.lookDir() != dir || camera.position() != pos) {
+    momentFrameBuffer.resize(_width * _height);
+    albedoFrameBuffer.resize(_width * _height * 4);
+    normalDepthFrameBuffer.resize(_width * _height * 4);
+    // the scene is read in place, a change only invalidates the accumulated samples
+    bool sceneChanged = scene.bufferNeedUpdate || scene.topLevelNeedUpdate;
+    // after a resize the tiles of adaptive sampling are not known yet
+    bool needClear = sceneChanged || lightSamplingChanged || denoiseChanged || activeTiles.size() != tileCount();
+    lightSamplingChanged = denoiseChanged = false;
+    if (scene.bufferNeedUpdate) {
+        wideBVH.buildBottomLevel(scene.bvhNodes, scene.instances, scene.triangles, scene.bvhOptions);
+    }
+    if (sceneChanged) {
+        wideBVH.buildTopLevel(scene.tlas.nodes, scene.instances);
+    }
+    scene.bufferNeedUpdate = scene.topLevelNeedUpdate = false;
+    if (needClear || camera.up() != up || camera.lookDir() != dir || camera.position() != pos) {
+        needClear = true;
         up = camera.up();
         dir = camera.lookDir();
         pos = camera.position();
         samples = 0;
         std::fill(accumulateFrameBuffer.begin(), accumulateFrameBuffer.end(), 0.0f);
+        std::fill(momentFrameBuffer.begin(), momentFrameBuffer.end(), 0.0f);
+        std::fill(albedoFrameBuffer.begin(), albedoFrameBuffer.end(), 0.0f);
+        std::fill(normalDepthFrameBuffer.begin(), normalDepthFrameBuffer.end(), 0.0f);
+        selectActivePixels(true);
+    }
+    if (converged()) {
+        drawFrameBuffer();
+        return;
     }
     samples += spp;
     CPUDispatcher dispatcher{.cores = 16};
@@ -233,24 +650,132 @@ void cg::RayTracingRenderer::renderCPU(cg::RayTracingScene &scene, cg::Camera &c
         toFloat3(pos), toFloat3(dir), toFloat3(up),
         perspectiveCamera->fov() / 180.f * math::pi<float>(), perspectiveCamera->near());
 
-    // __global float4 *output, uint width, uint height,
-    // __global BVHNode *bvh, __global Triangle *triangles, __global RayTracingMaterial *materials,
+    if (packetSize) {
+        // one task per tile and sample, the camera rays of a sample start at the same point
+        float3 cameraPosition = toFloat3(camera.position());
+        uint tilesX = (_width + packetSize - 1) / packetSize;
+        uint tilesY = (_height + packetSize - 1) / packetSize;
+        primaryRayHits.intersections.resize(rayMemBuffer.size());
+        primaryRayHits.hits.resize(rayMemBuffer.size());
+        dispatcher.dispatch(tilesX * tilesY * spp, [&]() {
+            uint task = get_global_id(0);
+            uint sample = task % spp;
+            uint tile = task / spp;
+            uint x0 = tile % tilesX * packetSize, y0 = tile / tilesX * packetSize;
+            // packets do not straddle the tiles of adaptive sampling, see setPacketSize. ReSTIR needs the hits of the stopped tiles too,
+            // their reservoirs are neighbors of the others
+            if (lightSampling != LIGHT_SAMPLING_RESTIR
+                && !activeTiles[y0 / ADAPTIVE_TILE_SIZE * this->tilesX() + x0 / ADAPTIVE_TILE_SIZE]) {
+                return;
+            }
+            Ray rays[CPU_MAX_PACKET_SIZE];
+            uint rayIds[CPU_MAX_PACKET_SIZE];
+            uint count = 0;
+            for (uint y = y0; y < std::min(y0 + packetSize, uint(_height)); ++y) {
+                for (uint x = x0; x < std::min(x0 + packetSize, uint(_width)); ++x) {
+                    rayIds[count] = (y * _width + x) * spp + sample;
+                    rays[count].origin = cameraPosition;
+                    rays[count].direction = rayMemBuffer[rayIds[count]];
+                    ++count;
+                }
+            }
+            Intersection intersections[CPU_MAX_PACKET_SIZE];
+            bool hits[CPU_MAX_PACKET_SIZE];
+            wideBVH.firstIntersections(rays, count, scene.instances.data(), triangleMemBuffer,
+                scene.vertices.data(), intersections, hits);
+            for (uint r = 0; r < count; ++r) {
+                primaryRayHits.intersections[rayIds[r]] = intersections[r];
+                primaryRayHits.hits[rayIds[r]] = hits[r];
+            }
+        });
+        activePrimaryRayHits = &primaryRayHits;
+    }
+
+    restartCount = 0;
+    activeWideBVHScene = &wideBVH;
+    if (lightSampling == LIGHT_SAMPLING_RESTIR) {
+        // the reservoirs of the last frame only help if the camera and the scene stayed, and the frame size
+        uint temporalReuse = !needClear && surfaceMemBuffer.size() == static_cast<size_t>(_width) * _height;
+        surfaceMemBuffer.resize(_width * _height);
+        reservoirMemBuffer.resize(_width * _height);
+        finalReservoirMemBuffer.resize(_width * _height);
+        dispatcher.dispatch(_width * _height, restir_initial_kernel,
+            _width, _height,
+            scene.tlas.nodes.data(), static_cast<uint>(scene.tlas.nodes.size()), scene.instances.data(),
+            bvhMemBuffer, triangleMemBuffer, scene.vertices.data(), scene.vertexShading.data(), materialMemBuffer,
+            scene.textures.data(), reinterpret_cast<float4 *>(scene.textureData.data()),
+            scene.lights.data(), scene.lightTree.nodes.data(),
+            rayMemBuffer.data(), toFloat3(camera.position()), spp, seedMemBuffer.data(),
+            surfaceMemBuffer.data(), reservoirMemBuffer.data(), finalReservoirMemBuffer.data(), temporalReuse,
+            &restartCount
+        );
+        dispatcher.dispatch(_width * _height, restir_spatial_kernel,
+            _width, _height,
+            scene.tlas.nodes.data(), static_cast<uint>(scene.tlas.nodes.size()), scene.instances.data(),
+            bvhMemBuffer, triangleMemBuffer, scene.vertices.data(), seedMemBuffer.data(),
+            surfaceMemBuffer.data(), reservoirMemBuffer.data(), finalReservoirMemBuffer.data(), &restartCount
+        );
+    }
+    // __global float4 *output, __global float *moments,
+    // __global float4 *albedo, __global float4 *normalDepth, uint writeAOVs, uint width, uint height,
+    // __global uint *pixels, uint pixelCount,
+    // __global BVHNode *tlas, uint tlasSize, __global RayTracingInstance *instances,
+    // __global BottomLevelNode *bvh, __global Triangle *triangles, __global Vertex *vertices,
+    // __global VertexShading *vertexShading,
+    // __global RayTracingMaterial *materials,
     // __global RayTracingTextureRange *textures, __global float4 *textureImage,
-    // __global uint *lights, uint lightCount,
-    // __global float3 *rays, float3 cameraPosition, uint bounces,
-    // ulong globalSeed, uint spp
-    dispatcher.dispatch(_width * _height, render_kernel,
-        reinterpret_cast<float4 *>(accumulateFrameBuffer.data()), _width, _height,
-        bvhMemBuffer, triangleMemBuffer, materialMemBuffer,
+    // __global RayTracingLight *lights, uint lightCount, __global LightBVHNode *lightTree,
+    // __global float3 *rays, float3 cameraPosition, uint bounces, uint lightSampling,
+    // __global Reservoir *reservoirs, ulong globalSeed, uint spp, __global uint *traversalRestarts
+    dispatcher.dispatch(activePixels.size(), render_kernel,
+        reinterpret_cast<float4 *>(accumulateFrameBuffer.data()), momentFrameBuffer.data(),
+        reinterpret_cast<float4 *>(albedoFrameBuffer.data()), reinterpret_cast<float4 *>(normalDepthFrameBuffer.data()),
+        uint(denoise), _width, _height,
+        activePixels.data(), static_cast<uint>(activePixels.size()),
+        scene.tlas.nodes.data(), static_cast<uint>(scene.tlas.nodes.size()), scene.instances.data(),
+        bvhMemBuffer, triangleMemBuffer, scene.vertices.data(), scene.vertexShading.data(), materialMemBuffer,
         scene.textures.data(), reinterpret_cast<float4 *>(scene.textureData.data()),
-        scene.lights.data(), scene.lights.size(),
-        rayMemBuffer.data(), toFloat3(camera.position()), bounces,
-        seedMemBuffer.data(), spp
+        scene.lights.data(), scene.lights.size(), scene.lightTree.nodes.data(),
+        rayMemBuffer.data(), toFloat3(camera.position()), bounces, lightSampling,
+        finalReservoirMemBuffer.data(), seedMemBuffer.data(), spp, &restartCount
     );
+    activeWideBVHScene = nullptr;
+    activePrimaryRayHits = nullptr;
     dispatcher.dispatch(_width * _height * 4, [&]() {
         uint id = get_global_id(0);
-        frameBuffer[id] = accumulateFrameBuffer[id] / static_cast<float>(samples);
+        // pixels have their own sample counts, in w
+        float count = accumulateFrameBuffer[id | 3];
+        frameBuffer[id] = count > 0.0f ? accumulateFrameBuffer[id] / count : 0.0f;
     });
+    if (adaptive()) {
+        tileErrors.resize(tileCount());
+        dispatcher.dispatch(tileCount(), tile_error_kernel,
+            reinterpret_cast<float4 *>(accumulateFrameBuffer.data()), momentFrameBuffer.data(), _width, _height,
+            adaptiveMaxSamples, tileErrors.data());
+        selectActivePixels(false);
+    }
+    if (denoise) {
+        for (auto &buffer: denoiseFrameBuffers) {
+            buffer.resize(_width * _height * 4);
+        }
+        for (auto &buffer: varianceFrameBuffers) {
+            buffer.resize(_width * _height);
+        }
+        dispatcher.dispatch(_width * _height, denoise_variance_kernel,
+            reinterpret_cast<float4 *>(accumulateFrameBuffer.data()), momentFrameBuffer.data(), _width, _height,
+            varianceFrameBuffers[0].data());
+        // the first pass reads the frame buffer and the last one writes it, the others alternate between the buffers
+        for (uint pass = 0; pass < DENOISE_PASSES; ++pass) {
+            float *input = pass ? denoiseFrameBuffers[(pass - 1) % 2].data() : frameBuffer.data();
+            float *output = pass + 1 < DENOISE_PASSES ? denoiseFrameBuffers[pass % 2].data() : frameBuffer.data();
+            dispatcher.dispatch(_width * _height, denoise_kernel,
+                reinterpret_cast<float4 *>(accumulateFrameBuffer.data()),
+                reinterpret_cast<float4 *>(albedoFrameBuffer.data()),
+                reinterpret_cast<float4 *>(normalDepthFrameBuffer.data()),
+                reinterpret_cast<float4 *>(input), varianceFrameBuffers[pass % 2].data(), _width, _height, 1u << pass,
+                reinterpret_cast<float4 *>(output), varianceFrameBuffers[(pass + 1) % 2].data());
+        }
+    }
     drawFrameBuffer();
 }
 
@@ -265,6 +790,10 @@ void cg::RayTracingRenderer::render(RayTracingScene &scene, Camera &camera) {
 
         triangleBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
             scene.triangles.size() * sizeof(Triangle), scene.triangles.data(), &err);
+        vertexBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            scene.vertices.size() * sizeof(Vertex), scene.vertices.data(), &err);
+        vertexShadingBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            scene.vertexShading.size() * sizeof(VertexShading), scene.vertexShading.data(), &err);
         materialBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
             scene.materials.size() * sizeof(RayTracingScene), scene.materials.data(), &err);
         textureRangeBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
@@ -272,9 +801,7 @@ void cg::RayTracingRenderer::render(RayTracingScene &scene, Camera &camera) {
         textureDataBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
             scene.textureData.size() * sizeof(float), scene.textureData.data(), &err);
         bvhBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-            scene.bvh.nodes.size() * sizeof(BVHNode), scene.bvh.nodes.data(), &err);
-        lightBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-            scene.lights.size() * sizeof(uint), scene.lights.data(), &err);
+            scene.bottomLevelNodes().size() * sizeof(BottomLevelNode), scene.bottomLevelNodes().data(), &err);
 
         // __global Ray *output,
         rayGenerationKernel.setArg(0, rayBuffer());
@@ -285,45 +812,165 @@ void cg::RayTracingRenderer::render(RayTracingScene &scene, Camera &camera) {
         // ulong globalSeed,
         rayGenerationKernel.setArg(4, seedBuffer());
 
-        // __global float4 *output, uint width, uint height,
+        // __global float4 *output, __global float *moments,
+        // __global float4 *albedo, __global float4 *normalDepth, uint writeAOVs, uint width, uint height,
         renderKernel.setArg(RenderKernelArgs::output, accumulateBuffer());
+        renderKernel.setArg(RenderKernelArgs::moments, momentBuffer());
+        renderKernel.setArg(RenderKernelArgs::albedo, albedoBuffer());
+        renderKernel.setArg(RenderKernelArgs::normalDepth, normalDepthBuffer());
+        renderKernel.setArg(RenderKernelArgs::writeAOVs, uint(denoise));
         renderKernel.setArg(RenderKernelArgs::width, _width);
         renderKernel.setArg(RenderKernelArgs::height, _height);
-        // __global BVHNode *bvh, __global Triangle *triangles, __global RayTracingMaterial *materials,
+        // __global uint *pixels,
+        renderKernel.setArg(RenderKernelArgs::pixels, pixelBuffer());
+        // __global BottomLevelNode *bvh, __global Triangle *triangles, __global Vertex *vertices,
+        // __global VertexShading *vertexShading,
+        // __global RayTracingMaterial *materials,
         renderKernel.setArg(RenderKernelArgs::bvh, bvhBuffer());
         renderKernel.setArg(RenderKernelArgs::triangles, triangleBuffer());
+        renderKernel.setArg(RenderKernelArgs::vertices, vertexBuffer());
+        renderKernel.setArg(RenderKernelArgs::vertexShading, vertexShadingBuffer());
         renderKernel.setArg(RenderKernelArgs::materials, materialBuffer());
         // __global RayTracingTextureRange *textures, __global float *textureImage,
         renderKernel.setArg(RenderKernelArgs::textures, textureRangeBuffer());
         renderKernel.setArg(RenderKernelArgs::textureImage, textureDataBuffer());
-        // __global uint *lights, uint lightCount,
-        renderKernel.setArg(RenderKernelArgs::lights, lightBuffer());
-        renderKernel.setArg(RenderKernelArgs::lightCount, static_cast<uint>(scene.lights.size()));
-        // __global Ray *rays, float3 cameraPosition, uint bounces,
+        // __global Ray *rays, float3 cameraPosition, uint bounces, uint lightSampling,
         renderKernel.setArg(RenderKernelArgs::rays, rayBuffer());
         renderKernel.setArg(RenderKernelArgs::cameraPosition, toFloat3(pos));
         renderKernel.setArg(RenderKernelArgs::bounces, bounces);
+        renderKernel.setArg(RenderKernelArgs::lightSampling, lightSampling);
+        // __global Reservoir *reservoirs
+        renderKernel.setArg(RenderKernelArgs::reservoirs, finalReservoirBuffer());
         // ulong globalSeed, uint spp
         renderKernel.setArg(RenderKernelArgs::globalSeed, seedBuffer());
         renderKernel.setArg(RenderKernelArgs::spp, spp);
+        // __global uint *traversalRestarts
+        renderKernel.setArg(RenderKernelArgs::traversalRestarts, restartBuffer());
+
+        // uint width, uint height,
+        // __global BottomLevelNode *bvh, __global Triangle *triangles, __global Vertex *vertices,
+        // __global VertexShading *vertexShading, __global RayTracingMaterial *materials,
+        // __global RayTracingTextureRange *textures, __global float4 *textureImage,
+        restirInitialKernel.setArg(RestirInitialKernelArgs::width, _width);
+        restirInitialKernel.setArg(RestirInitialKernelArgs::height, _height);
+        restirInitialKernel.setArg(RestirInitialKernelArgs::bvh, bvhBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::triangles, triangleBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::vertices, vertexBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::vertexShading, vertexShadingBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::materials, materialBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::textures, textureRangeBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::textureImage, textureDataBuffer());
+        // __global float3 *rays, float3 cameraPosition, uint spp, __global ulong *globalSeed,
+        restirInitialKernel.setArg(RestirInitialKernelArgs::rays, rayBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::cameraPosition, toFloat3(pos));
+        restirInitialKernel.setArg(RestirInitialKernelArgs::spp, spp);
+        restirInitialKernel.setArg(RestirInitialKernelArgs::globalSeed, seedBuffer());
+        // __global ReservoirSurface *surfaces, __global Reservoir *reservoirs, __global Reservoir *history,
+        // uint temporalReuse, __global uint *traversalRestarts
+        restirInitialKernel.setArg(RestirInitialKernelArgs::surfaces, surfaceBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::reservoirs, reservoirBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::history, finalReservoirBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::traversalRestarts, restartBuffer());
+
+        // uint width, uint height,
+        // __global BottomLevelNode *bvh, __global Triangle *triangles, __global Vertex *vertices,
+        // __global ulong *globalSeed,
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::width, _width);
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::height, _height);
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::bvh, bvhBuffer());
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::triangles, triangleBuffer());
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::vertices, vertexBuffer());
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::globalSeed, seedBuffer());
+        // __global ReservoirSurface *surfaces, __global Reservoir *reservoirs, __global Reservoir *finalReservoirs,
+        // __global uint *traversalRestarts
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::surfaces, surfaceBuffer());
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::reservoirs, reservoirBuffer());
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::finalReservoirs, finalReservoirBuffer());
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::traversalRestarts, restartBuffer());
 
-        // __global float4 *output, uint width, uint height
+        // __global float4 *output, __global float *moments, uint width, uint height
         clearKernel.setArg(0, accumulateBuffer());
-        clearKernel.setArg(1, _width);
-        clearKernel.setArg(2, _height);
+        clearKernel.setArg(1, momentBuffer());
+        clearKernel.setArg(2, albedoBuffer());
+        clearKernel.setArg(3, normalDepthBuffer());
+        clearKernel.setArg(4, _width);
+        clearKernel.setArg(5, _height);
 
-        // __global float4 *input, uint width, uint height, uint spp, __global float4 *output
+        // __global float4 *input, uint width, uint height, __global float4 *output
         accumulateKernel.setArg(0, accumulateBuffer());
         accumulateKernel.setArg(1, _width);
         accumulateKernel.setArg(2, _height);
-        accumulateKernel.setArg(3, spp);
-        accumulateKernel.setArg(4, outputBuffer());
+        accumulateKernel.setArg(3, outputBuffer());
+
+        // __global float4 *accumulated, __global float *moments, uint width, uint height, uint maxSamples,
+        // __global float *tileErrors
+        tileErrorKernel.setArg(0, accumulateBuffer());
+        tileErrorKernel.setArg(1, momentBuffer());
+        tileErrorKernel.setArg(2, _width);
+        tileErrorKernel.setArg(3, _height);
+        tileErrorKernel.setArg(5, tileErrorBuffer());
+
+        // __global float4 *accumulated, __global float *moments, uint width, uint height, __global float *variance
+        denoiseVarianceKernel.setArg(0, accumulateBuffer());
+        denoiseVarianceKernel.setArg(1, momentBuffer());
+        denoiseVarianceKernel.setArg(2, _width);
+        denoiseVarianceKernel.setArg(3, _height);
+        denoiseVarianceKernel.setArg(4, varianceBuffers[0]());
+
+        // __global float4 *accumulated, __global float4 *albedo, __global float4 *normalDepth,
+        denoiseKernel.setArg(0, accumulateBuffer());
+        denoiseKernel.setArg(1, albedoBuffer());
+        denoiseKernel.setArg(2, normalDepthBuffer());
+        // uint width, uint height
+        denoiseKernel.setArg(5, _width);
+        denoiseKernel.setArg(6, _height);
 
         scene.bufferNeedUpdate = false;
         sceneBufferNeedUpdate = false;
 
         printf("Scene inited for RT");
     }
+    if (needClear || scene.topLevelNeedUpdate) {
+        // the top level is small, moving instances only uploads it again
+        needClear = true;
+        tlasBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            scene.tlas.nodes.size() * sizeof(BVHNode), scene.tlas.nodes.data(), &err);
+        instanceBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            scene.instances.size() * sizeof(RayTracingInstance), scene.instances.data(), &err);
+        lightBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            scene.lights.size() * sizeof(RayTracingLight), scene.lights.data(), &err);
+        lightTreeBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            scene.lightTree.nodes.size() * sizeof(LightBVHNode), scene.lightTree.nodes.data(), &err);
+        // __global BVHNode *tlas, uint tlasSize, __global RayTracingInstance *instances,
+        renderKernel.setArg(RenderKernelArgs::tlas, tlasBuffer());
+        renderKernel.setArg(RenderKernelArgs::tlasSize, static_cast<uint>(scene.tlas.nodes.size()));
+        renderKernel.setArg(RenderKernelArgs::instances, instanceBuffer());
+        // __global RayTracingLight *lights, uint lightCount, __global LightBVHNode *lightTree,
+        renderKernel.setArg(RenderKernelArgs::lights, lightBuffer());
+        renderKernel.setArg(RenderKernelArgs::lightCount, static_cast<uint>(scene.lights.size()));
+        renderKernel.setArg(RenderKernelArgs::lightTree, lightTreeBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::tlas, tlasBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::tlasSize, static_cast<uint>(scene.tlas.nodes.size()));
+        restirInitialKernel.setArg(RestirInitialKernelArgs::instances, instanceBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::lights, lightBuffer());
+        restirInitialKernel.setArg(RestirInitialKernelArgs::lightTree, lightTreeBuffer());
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::tlas, tlasBuffer());
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::tlasSize, static_cast<uint>(scene.tlas.nodes.size()));
+        restirSpatialKernel.setArg(RestirSpatialKernelArgs::instances, instanceBuffer());
+        scene.topLevelNeedUpdate = false;
+    }
+    if (lightSamplingChanged) {
+        // samples of different estimators are not accumulated together
+        needClear = true;
+        lightSamplingChanged = false;
+        renderKernel.setArg(RenderKernelArgs::lightSampling, lightSampling);
+    }
+    if (denoiseChanged) {
+        // the AOVs were not written for the samples so far
+        needClear = true;
+        denoiseChanged = false;
+        renderKernel.setArg(RenderKernelArgs::writeAOVs, uint(denoise));
+    }
     // update camera
     auto perspective = camera.isPerspectiveCamera();
     if (!perspective) {
@@ -342,6 +989,7 @@ void cg::RayTracingRenderer::render(RayTracingScene &scene, Camera &camera) {
 
         // float3 cameraPosition
         renderKernel.setArg(RenderKernelArgs::cameraPosition, toFloat3(pos));
+        restirInitialKernel.setArg(RestirInitialKernelArgs::cameraPosition, toFloat3(pos));
 
         // float3 cameraPosition, float3 cameraDir, float3 cameraUp,
         rayGenerationKernel.setArg(5, toFloat3(pos));
@@ -350,16 +998,25 @@ void cg::RayTracingRenderer::render(RayTracingScene &scene, Camera &camera) {
     }
     if (needClear) {
         samples = 0;
+        selectActivePixels(true);
+    } else if (converged()) {
+        // nothing left to sample, the frame buffer holds the last result
+        drawFrameBuffer();
+        return;
     }
     samples += spp;
+    if (activePixelsChanged) {
+        activePixelsChanged = false;
+        err = commandQueue.enqueueWriteBuffer(pixelBuffer, CL_TRUE, 0, activePixels.size() * sizeof(uint),
+            activePixels.data());
+        // uint pixelCount
+        renderKernel.setArg(RenderKernelArgs::pixelCount, static_cast<uint>(activePixels.size()));
+    }
 
     // float fov, float near
     rayGenerationKernel.setArg(8, (perspective->fov() / 180.f * math::pi<float>()));
     rayGenerationKernel.setArg(9, perspective->near());
 
-    // spp
-    accumulateKernel.setArg(3, samples);
-
     // ray tracing
     cl::Event rayGen;
     err = commandQueue.enqueueNDRangeKernel(
@@ -373,17 +1030,93 @@ void cg::RayTracingRenderer::render(RayTracingScene &scene, Camera &camera) {
             &ev);
         preRenderEvents.emplace_back(ev);
     }
+    const uint noRestarts = 0;
+    err = commandQueue.enqueueWriteBuffer(restartBuffer, CL_TRUE, 0, sizeof(uint), &noRestarts);
+#ifdef LOCAL_TRAVERSAL
+    // work-groups share the staged top-level nodes, the kernels skip the work items past the last pixel
+    auto roundUp = [](uint size) {
+        return (size + RENDER_WORK_GROUP_SIZE - 1) / RENDER_WORK_GROUP_SIZE * RENDER_WORK_GROUP_SIZE;
+    };
+#endif
+    if (lightSampling == LIGHT_SAMPLING_RESTIR) {
+        // the reservoirs of the last frame are only reused while the camera and the scene stay
+        restirInitialKernel.setArg(RestirInitialKernelArgs::temporalReuse, uint(!needClear));
+        cl::Event initial, spatial;
+#ifdef LOCAL_TRAVERSAL
+        err = commandQueue.enqueueNDRangeKernel(
+            restirInitialKernel, cl::NullRange, roundUp(_width * _height), RENDER_WORK_GROUP_SIZE, &preRenderEvents,
+            &initial
+        );
+        std::vector<cl::Event> initialEvent = {initial};
+        err = commandQueue.enqueueNDRangeKernel(
+            restirSpatialKernel, cl::NullRange, roundUp(_width * _height), RENDER_WORK_GROUP_SIZE, &initialEvent,
+            &spatial
+        );
+#else
+        err = commandQueue.enqueueNDRangeKernel(
+            restirInitialKernel, cl::NullRange, _width * _height, cl::NullRange, &preRenderEvents, &initial
+        );
+        std::vector<cl::Event> initialEvent = {initial};
+        err = commandQueue.enqueueNDRangeKernel(
+            restirSpatialKernel, cl::NullRange, _width * _height, cl::NullRange, &initialEvent, &spatial
+        );
+#endif
+        preRenderEvents.emplace_back(spatial);
+    }
     std::vector<cl::Event> raytracingEvent(1);
+#ifdef LOCAL_TRAVERSAL
+    err = commandQueue.enqueueNDRangeKernel(
+        renderKernel, cl::NullRange, roundUp(activePixels.size()), RENDER_WORK_GROUP_SIZE, &preRenderEvents,
+        raytracingEvent.data()
+    );
+#else
     err = commandQueue.enqueueNDRangeKernel(
-        renderKernel, cl::NullRange, _width * _height, cl::NullRange, &preRenderEvents, raytracingEvent.data()
+        renderKernel, cl::NullRange, activePixels.size(), cl::NullRange, &preRenderEvents, raytracingEvent.data()
     );
+#endif
     std::vector<cl::Event> accumulateEvent(1);
     err = commandQueue.enqueueNDRangeKernel(
         accumulateKernel, cl::NullRange, _width * _height, cl::NullRange, &raytracingEvent, accumulateEvent.data()
     );
+    if (denoise) {
+        cl::Event variance;
+        err = commandQueue.enqueueNDRangeKernel(
+            denoiseVarianceKernel, cl::NullRange, _width * _height, cl::NullRange, &raytracingEvent, &variance
+        );
+        accumulateEvent.emplace_back(variance);
+        // the first pass reads the output buffer and the last one writes it, the others alternate between the buffers
+        for (uint pass = 0; pass < DENOISE_PASSES; ++pass) {
+            // __global float4 *input, __global float *variance,
+            denoiseKernel.setArg(3, pass ? denoiseBuffers[(pass - 1) % 2]() : outputBuffer());
+            denoiseKernel.setArg(4, varianceBuffers[pass % 2]());
+            // uint step, __global float4 *output, __global float *filteredVariance
+            denoiseKernel.setArg(7, 1u << pass);
+            denoiseKernel.setArg(8, pass + 1 < DENOISE_PASSES ? denoiseBuffers[pass % 2]() : outputBuffer());
+            denoiseKernel.setArg(9, varianceBuffers[(pass + 1) % 2]());
+            cl::Event filtered;
+            err = commandQueue.enqueueNDRangeKernel(
+                denoiseKernel, cl::NullRange, _width * _height, cl::NullRange, &accumulateEvent, &filtered
+            );
+            accumulateEvent = {filtered};
+        }
+    }
     err = commandQueue.enqueueReadBuffer(
         outputBuffer, CL_TRUE, 0, frameBufferSize(), frameBuffer.data(), &accumulateEvent, nullptr
     );
+    err = commandQueue.enqueueReadBuffer(restartBuffer, CL_TRUE, 0, sizeof(uint), &restartCount,
+        &raytracingEvent, nullptr);
+    if (adaptive()) {
+        // uint maxSamples
+        tileErrorKernel.setArg(4, adaptiveMaxSamples);
+        std::vector<cl::Event> errorEvent(1);
+        err = commandQueue.enqueueNDRangeKernel(
+            tileErrorKernel, cl::NullRange, tileCount(), cl::NullRange, &raytracingEvent, errorEvent.data()
+        );
+        tileErrors.resize(tileCount());
+        err = commandQueue.enqueueReadBuffer(tileErrorBuffer, CL_TRUE, 0, tileErrors.size() * sizeof(float),
+            tileErrors.data(), &errorEvent, nullptr);
+        selectActivePixels(false);
+    }
     commandQueue.finish();
     // draw to screen
     drawFrameBuffer();
@@ -488,6 +1221,23 @@ bool cg::RayTracingRenderer::initCL(int width, int height) {
             seedMemBuffer.data(), &err);;
         outputBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(float4), nullptr, &err);
         accumulateBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(float4), nullptr, &err);
+        momentBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(float), nullptr, &err);
+        albedoBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(float4), nullptr, &err);
+        normalDepthBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(float4), nullptr, &err);
+        for (uint i = 0; i < 2; ++i) {
+            denoiseBuffers[i] = cl::Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(float4), nullptr,
+                &err);
+            varianceBuffers[i] = cl::Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(float), nullptr,
+                &err);
+        }
+        pixelBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, width * height * sizeof(uint), nullptr, &err);
+        tileErrorBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, tileCount() * sizeof(float), nullptr, &err);
+        restartBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(uint), nullptr, &err);
+        surfaceBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(ReservoirSurface), nullptr,
+            &err);
+        reservoirBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(Reservoir), nullptr, &err);
+        finalReservoirBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(Reservoir), nullptr,
+            &err);
         sceneBufferNeedUpdate = true;
     }
     return true;
@@ -498,7 +1248,20 @@ bool cg::RayTracingRenderer::reloadShader() {
     commandQueue.finish();
     sceneBufferNeedUpdate = true;
     program = cl::Program(context, source);
-    cl_int result = program.build({device});
+    std::string options;
+#ifdef QUANTIZED_BVH
+    options += " -DQUANTIZED_BVH";
+#endif
+#ifdef WATERTIGHT_TRIANGLES
+    options += " -DWATERTIGHT_TRIANGLES";
+#endif
+#ifdef QUANTIZED_VERTICES
+    options += " -DQUANTIZED_VERTICES";
+#endif
+#ifdef LOCAL_TRAVERSAL
+    options += " -DLOCAL_TRAVERSAL";
+#endif
+    cl_int result = program.build({device}, options.c_str());
     if (result) {
         fprintf(stderr, "error during compilation (%d):\n", result);
     }
@@ -509,11 +1272,108 @@ bool cg::RayTracingRenderer::reloadShader() {
     }
     rayGenerationKernel = cl::Kernel(program, "raygeneration_kernel");
     renderKernel = cl::Kernel(program, "render_kernel");
+    restirInitialKernel = cl::Kernel(program, "restir_initial_kernel");
+    restirSpatialKernel = cl::Kernel(program, "restir_spatial_kernel");
     accumulateKernel = cl::Kernel(program, "accumulate_kernel");
     clearKernel = cl::Kernel(program, "clear_kernel");
+    denoiseVarianceKernel = cl::Kernel(program, "denoise_variance_kernel");
+    denoiseKernel = cl::Kernel(program, "denoise_kernel");
+    tileErrorKernel = cl::Kernel(program, "tile_error_kernel");
+    mortonKernel = cl::Kernel(program, "morton_kernel");
+    radixCountKernel = cl::Kernel(program, "radix_count_kernel");
+    radixScanKernel = cl::Kernel(program, "radix_scan_kernel");
+    radixScatterKernel = cl::Kernel(program, "radix_scatter_kernel");
     return true;
 }
 
+cg::BVHBuildOptions::MortonSorter cg::RayTracingRenderer::mortonSorter() {
+    if (!programInited) {
+        return {};
+    }
+    return [this](const std::vector<float3> &centroids, const Bounds3 &centroidBounds,
+                  std::vector<uint> &codes, std::vector<uint> &indices) {
+        return sortMortonCodes(centroids, centroidBounds, codes, indices);
+    };
+}
+
+bool cg::RayTracingRenderer::sortMortonCodes(const std::vector<float3> &centroids, const Bounds3 &centroidBounds,
+                                             std::vector<uint> &codes, std::vector<uint> &indices) {
+    // each work item of the sort owns a block of elements
+    constexpr uint blockCount = 1024;
+    const auto count = static_cast<uint>(centroids.size());
+    const uint blockSize = (count + blockCount - 1) / blockCount;
+    int err;
+    cl::Buffer centroidBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, count * sizeof(float3),
+        const_cast<float3 *>(centroids.data()), &err);
+    if (err != CL_SUCCESS) {
+        return false;
+    }
+    cl::Buffer keyBuffers[2] = {
+        cl::Buffer(context, CL_MEM_READ_WRITE, count * sizeof(uint)),
+        cl::Buffer(context, CL_MEM_READ_WRITE, count * sizeof(uint)),
+    };
+    cl::Buffer valueBuffers[2] = {
+        cl::Buffer(context, CL_MEM_READ_WRITE, count * sizeof(uint)),
+        cl::Buffer(context, CL_MEM_READ_WRITE, count * sizeof(uint)),
+    };
+    cl::Buffer histogramBuffer(context, CL_MEM_READ_WRITE, blockCount * RADIX_BUCKETS * sizeof(uint));
+
+    auto extent = centroidBounds.pMax - centroidBounds.pMin;
+    float3 inverseExtent;
+    for (int axis = 0; axis < 3; ++axis) {
+        inverseExtent.s[axis] = extent.s[axis] > 0.0f ? 1.0f / extent.s[axis] : 0.0f;
+    }
+    // __global const float3 *centroids, uint count, float3 boundsMin, float3 inverseExtent,
+    // __global uint *codes, __global uint *indices
+    mortonKernel.setArg(0, centroidBuffer());
+    mortonKernel.setArg(1, count);
+    mortonKernel.setArg(2, centroidBounds.pMin);
+    mortonKernel.setArg(3, inverseExtent);
+    mortonKernel.setArg(4, keyBuffers[0]());
+    mortonKernel.setArg(5, valueBuffers[0]());
+    commandQueue.enqueueNDRangeKernel(mortonKernel, cl::NullRange, count, cl::NullRange);
+
+    // the queue is in-order, so the passes need no explicit events
+    uint current = 0;
+    for (uint shift = 0; shift < 30; shift += RADIX_BITS) {
+        // __global const uint *keys, uint count, uint shift, uint blockSize, uint blockCount,
+        // __global uint *histogram
+        radixCountKernel.setArg(0, keyBuffers[current]());
+        radixCountKernel.setArg(1, count);
+        radixCountKernel.setArg(2, shift);
+        radixCountKernel.setArg(3, blockSize);
+        radixCountKernel.setArg(4, blockCount);
+        radixCountKernel.setArg(5, histogramBuffer());
+        commandQueue.enqueueNDRangeKernel(radixCountKernel, cl::NullRange, blockCount, cl::NullRange);
+
+        // __global uint *histogram, uint size
+        radixScanKernel.setArg(0, histogramBuffer());
+        radixScanKernel.setArg(1, blockCount * RADIX_BUCKETS);
+        commandQueue.enqueueNDRangeKernel(radixScanKernel, cl::NullRange, 1, cl::NullRange);
+
+        // __global const uint *keys, __global const uint *values, uint count, uint shift, uint blockSize,
+        // uint blockCount, __global const uint *histogram, __global uint *keysOut, __global uint *valuesOut
+        radixScatterKernel.setArg(0, keyBuffers[current]());
+        radixScatterKernel.setArg(1, valueBuffers[current]());
+        radixScatterKernel.setArg(2, count);
+        radixScatterKernel.setArg(3, shift);
+        radixScatterKernel.setArg(4, blockSize);
+        radixScatterKernel.setArg(5, blockCount);
+        radixScatterKernel.setArg(6, histogramBuffer());
+        radixScatterKernel.setArg(7, keyBuffers[1 - current]());
+        radixScatterKernel.setArg(8, valueBuffers[1 - current]());
+        commandQueue.enqueueNDRangeKernel(radixScatterKernel, cl::NullRange, blockCount, cl::NullRange);
+        current = 1 - current;
+    }
+    codes.resize(count);
+    indices.resize(count);
+    err = commandQueue.enqueueReadBuffer(keyBuffers[current], CL_TRUE, 0, count * sizeof(uint), codes.data());
+    if (err == CL_SUCCESS) {
+        err = commandQueue.enqueueReadBuffer(valueBuffers[current], CL_TRUE, 0, count * sizeof(uint), indices.data());
+    }
+    return err == CL_SUCCESS;
+}
+
 #else
 bool cg::RayTracingRenderer::initCL(int width, int height) {
     return initCPU(width, height);
@@ -526,6 +1386,10 @@ void cg::RayTracingRenderer::render(RayTracingScene &scene, Camera &camera) {
 bool cg::RayTracingRenderer::reloadShader() {
     return true;
 }
+
+cg::BVHBuildOptions::MortonSorter cg::RayTracingRenderer::mortonSorter() {
+    return {};
+}
 #endif
 
 void cg::RayTracingRenderer::drawFrameBuffer() {
@@ -544,6 +1408,62 @@ void cg::RayTracingRenderer::setBounces(uint newBounces) {
     this->bounces = std::clamp(newBounces, uint(1), uint(15));
 }
 
+void cg::RayTracingRenderer::setLightSampling(uint mode) {
+    if (mode != lightSampling) {
+        lightSampling = std::min(mode, uint(LIGHT_SAMPLING_RESTIR));
+        lightSamplingChanged = true;
+    }
+}
+
+void cg::RayTracingRenderer::setPacketSize(uint size) {
+    // a packet holds at most CPU_MAX_PACKET_SIZE rays, and its tile must not straddle those of adaptive sampling
+    size = std::min(size, uint(8));
+    while (size && ADAPTIVE_TILE_SIZE % size) {
+        --size;
+    }
+    this->packetSize = size;
+}
+
+void cg::RayTracingRenderer::setAdaptiveSampling(float threshold, uint maxSamples) {
+    adaptiveThreshold = std::max(threshold, 0.0f);
+    adaptiveMaxSamples = maxSamples;
+    // tiles that stopped under the old criterion are checked again after the next frame
+    selectActivePixels(true);
+}
+
+void cg::RayTracingRenderer::setDenoise(bool enable) {
+    if (enable != denoise) {
+        denoise = enable;
+        denoiseChanged = true;
+    }
+}
+
+uint cg::RayTracingRenderer::activePixelCount() const noexcept {
+    return activePixels.size();
+}
+
+bool cg::RayTracingRenderer::converged() const noexcept {
+    return activePixels.empty() && !activeTiles.empty();
+}
+
+void cg::RayTracingRenderer::selectActivePixels(bool all) {
+    activePixels.clear();
+    activeTiles.assign(tileCount(), 0);
+    for (uint tile = 0; tile < tileCount(); ++tile) {
+        if (!all && adaptive() && !(tileErrors[tile] > adaptiveThreshold)) {
+            continue;
+        }
+        activeTiles[tile] = 1;
+        uint x0 = tile % tilesX() * ADAPTIVE_TILE_SIZE, y0 = tile / tilesX() * ADAPTIVE_TILE_SIZE;
+        for (uint y = y0; y < std::min(y0 + ADAPTIVE_TILE_SIZE, uint(_height)); ++y) {
+            for (uint x = x0; x < std::min(x0 + ADAPTIVE_TILE_SIZE, uint(_width)); ++x) {
+                activePixels.push_back(y * _width + x);
+            }
+        }
+    }
+    activePixelsChanged = true;
+}
+
 const float *cg::RayTracingRenderer::frameBufferData() const noexcept {
     return frameBuffer.data();
 }
@@ -552,6 +1472,10 @@ int cg::RayTracingRenderer::sampleCount() const noexcept {
     return samples;
 }
 
+uint cg::RayTracingRenderer::traversalRestarts() const noexcept {
+    return restartCount;
+}
+
 void cg::RayTracingRenderer::initFrameBuffer(int width, int height) {
     if (width != _width || height != _height) {
         _width = width;
@@ -563,6 +1487,9 @@ void cg::RayTracingRenderer::initFrameBuffer(int width, int height) {
         for (ulong &ul: seedMemBuffer) {
             ul = distribution(engine);
         }
+        // the reservoirs of the old size are not reused
+        surfaceMemBuffer.clear();
+        activeTiles.clear();
     }
 }
 
@@ -581,65 +1508,6 @@ int cg::RayTracingRenderer::width() const noexcept {
     return _width;
 }
 
-template<typename ...Args>
-static uint push(std::vector<BVHNode> &nodes, Args &&...args) {
-    uint ret = static_cast<uint>(nodes.size());
-    nodes.emplace_back(std::forward<Args &&>(args)...);
-    return ret;
-};
-
-uint recur(std::vector<BVHNode> &nodes, std::vector<Triangle>::iterator first, std::vector<Triangle>::iterator last,
-           uint baseIndex) {
-    auto length = last - first;
-    if (length == 1) {
-        return push(nodes, BVHNode{first->bounds(), baseIndex, 1}); // leaf
-    }
-    if (length == 2) {
-        auto bounds = first->bounds() + std::next(first)->bounds();
-        unsigned short dim = bounds.maxExtent();
-        auto ret = push(nodes, BVHNode{bounds, 0, 0, dim});
-        if (first->bounds().centroid().s[dim] < (std::next(first))->bounds().centroid().s[dim]) {
-            // left
-            recur(nodes, first, std::next(first), baseIndex);
-            // right
-            nodes[ret].offset = recur(nodes, std::next(first), last, baseIndex + 1);
-        } else {
-            // right
-            recur(nodes, std::next(first), last, baseIndex + 1);
-            // left
-            nodes[ret].offset = recur(nodes, first, std::next(first), baseIndex);
-        }
-        return ret;
-    }
-    auto bounds = first->bounds();
-    auto centroidBounds = Bounds3(bounds.centroid());
-    for (auto i = std::next(first); i != last; ++i) {
-        Bounds3 iBound = i->bounds();
-        bounds += iBound;
-        centroidBounds += iBound.centroid();
-    }
-    auto maxExtend = bounds.maxExtent();
-    auto leftSize = length / 2;
-    std::nth_element(first, first + leftSize, last, [maxExtend](const Triangle &a, const Triangle &b) -> bool {
-        return a.bounds().centroid().s[maxExtend] < b.bounds().centroid().s[maxExtend];
-    });
-
-    auto ret = push(nodes, BVHNode{bounds, 0, 0, maxExtend});
-    recur(nodes, first, first + leftSize, baseIndex);
-    nodes[ret].offset = recur(nodes, first + leftSize, last, baseIndex + leftSize);
-    return ret;
-};
-
-void cg::BVH::buildFromTriangles(std::vector<Triangle> &triangles) {
-    nodes.clear();
-    // prevent empty buffer
-    if (triangles.empty()) {
-        nodes.emplace_back();
-        return;
-    }
-    recur(nodes, triangles.begin(), triangles.end(), 0u);
-}
-
 const char *trivialShaderVert = R"(
 #version 330 core
 
@@ -0,0 +1,672 @@
+#include <wide_bvh.h>
+#include "lib/shaders/rt_definition.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define WIDE_BVH_SSE
+#include <xmmintrin.h>
+#endif
+
+// entries of the traversal stack before it moves to the heap, every visited node pushes at most Width of them
+#define WIDE_BVH_STACK_SIZE 256
+
+template<uint Width>
+uint cg::WideBVH<Width>::collapse(const std::vector<BVHNode> &binary, uint root,
+                                  std::vector<BVHNode> *deferredLeaves) {
+    auto nodeIndex = static_cast<uint>(nodes.size());
+    nodes.emplace_back();
+
+    uint children[Width];
+    uint childCount = 0;
+    const auto &rootNode = binary[root];
+    if (rootNode.bounds.pMin.x > rootNode.bounds.pMax.x) {
+        // placeholder of an empty BVH, leave all slots unused
+    } else if (rootNode.primitiveCount) {
+        children[childCount++] = root;
+    } else {
+        children[childCount++] = root + 1;
+        children[childCount++] = rootNode.offset;
+        // pull grandchildren up by opening the largest interior child, it is the one most likely to be hit
+        while (childCount < Width) {
+            int largest = -1;
+            float largestArea = -1.0f;
+            for (uint i = 0; i < childCount; ++i) {
+                const auto &child = binary[children[i]];
+                if (!child.primitiveCount && child.bounds.surfaceArea() > largestArea) {
+                    largest = static_cast<int>(i);
+                    largestArea = child.bounds.surfaceArea();
+                }
+            }
+            if (largest < 0) {
+                break;
+            }
+            uint opened = children[largest];
+            children[largest] = opened + 1;
+            children[childCount++] = binary[opened].offset;
+        }
+    }
+
+    Node node{};
+    for (uint i = 0; i < Width; ++i) {
+        for (uint axis = 0; axis < 3; ++axis) {
+            node.bounds[0][axis][i] = std::numeric_limits<float>::max();
+            node.bounds[1][axis][i] = std::numeric_limits<float>::lowest();
+        }
+    }
+    for (uint i = 0; i < childCount; ++i) {
+        const auto &child = binary[children[i]];
+        node.bounds[0][0][i] = child.bounds.pMin.x;
+        node.bounds[0][1][i] = child.bounds.pMin.y;
+        node.bounds[0][2][i] = child.bounds.pMin.z;
+        node.bounds[1][0][i] = child.bounds.pMax.x;
+        node.bounds[1][1][i] = child.bounds.pMax.y;
+        node.bounds[1][2][i] = child.bounds.pMax.z;
+        if (child.primitiveCount > BVH_MAX_LEAF_SIZE && deferredLeaves) {
+            node.child[i] = static_cast<uint>(deferredLeaves->size());
+            node.primitiveCount[i] = WIDE_BVH_DEFERRED;
+            deferredLeaves->push_back(child);
+        } else if (child.primitiveCount) {
+            node.child[i] = child.offset;
+            node.primitiveCount[i] = child.primitiveCount;
+        } else {
+            // the recursion appends to nodes, so node is written back only at the end
+            node.child[i] = collapse(binary, children[i], deferredLeaves);
+            node.primitiveCount[i] = 0;
+        }
+    }
+    nodes[nodeIndex] = node;
+    return nodeIndex;
+}
+
+template
+struct cg::WideBVH<4>;
+
+template
+struct cg::WideBVH<8>;
+
+namespace {
+/**
+ * A ray prepared for slab tests: for every axis, the side of the bounds that is entered first.
+ */
+struct WideRay {
+    float origin[3];
+    float inverseDirection[3];
+    uint nearSide[3];
+
+    explicit WideRay(const Ray &ray) {
+        const float direction[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+        const float rayOrigin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+        for (uint axis = 0; axis < 3; ++axis) {
+            origin[axis] = rayOrigin[axis];
+            inverseDirection[axis] = 1.0f / direction[axis];
+            // the sign of the inverse also distinguishes -0 from +0
+            nearSide[axis] = std::signbit(inverseDirection[axis]) ? 1 : 0;
+        }
+    }
+};
+
+struct StackEntry {
+    uint child;
+    uint primitiveCount;
+    float tNear;
+};
+
+/**
+ * A packet of rays with a common origin, the rays selected by a bit mask from an array of at most
+ * CPU_MAX_PACKET_SIZE. Prepared for slab tests of the whole packet, with the range of the inverse directions along
+ * every axis, and of its rays one by one.
+ */
+struct RayPacket {
+    float origin[3];
+    float inverseMin[3], inverseMax[3];
+    uint nearSide[3];
+    // [axis][ray]
+    float inverseDirection[3][CPU_MAX_PACKET_SIZE];
+    // whether the directions of all rays have the same sign along every axis, the ranges are unusable otherwise
+    bool coherent = true;
+
+    RayPacket(const Ray *rays, uint64_t active) {
+        const Ray &first = rays[std::countr_zero(active)];
+        const float rayOrigin[3] = {first.origin.x, first.origin.y, first.origin.z};
+        for (uint axis = 0; axis < 3; ++axis) {
+            origin[axis] = rayOrigin[axis];
+            inverseMin[axis] = std::numeric_limits<float>::max();
+            inverseMax[axis] = std::numeric_limits<float>::lowest();
+        }
+        for (uint64_t mask = active; mask; mask &= mask - 1) {
+            auto r = static_cast<uint>(std::countr_zero(mask));
+            const float direction[3] = {rays[r].direction.x, rays[r].direction.y, rays[r].direction.z};
+            for (uint axis = 0; axis < 3; ++axis) {
+                inverseDirection[axis][r] = 1.0f / direction[axis];
+                inverseMin[axis] = std::min(inverseMin[axis], inverseDirection[axis][r]);
+                inverseMax[axis] = std::max(inverseMax[axis], inverseDirection[axis][r]);
+            }
+        }
+        for (uint axis = 0; axis < 3; ++axis) {
+            // zero directions have infinite inverses, which the interval products cannot handle
+            coherent &= std::isfinite(inverseMin[axis]) && std::isfinite(inverseMax[axis])
+                        && std::signbit(inverseMin[axis]) == std::signbit(inverseMax[axis]);
+            nearSide[axis] = std::signbit(inverseMin[axis]) ? 1 : 0;
+        }
+    }
+};
+
+struct PacketStackEntry {
+    uint child;
+    uint primitiveCount;
+    // lowest entry distance of the packet
+    float tNear;
+    // rays of the packet that may hit the child
+    uint64_t rays;
+};
+
+/**
+ * Traversal stack, in a fixed array unless a deep tree overflows it. Lazily built or degenerate subtrees are not
+ * bounded in depth, so it then moves to the heap instead of dropping nodes.
+ */
+template<typename Entry>
+struct TraversalStack {
+    Entry local[WIDE_BVH_STACK_SIZE];
+    std::vector<Entry> heap;
+    Entry *entries = local;
+    uint capacity = WIDE_BVH_STACK_SIZE;
+
+    /**
+     * Makes room for count more entries on top of the first size ones.
+     */
+    void reserve(uint size, uint count) {
+        if (size + count <= capacity) {
+            return;
+        }
+        if (heap.empty()) {
+            heap.assign(local, local + size);
+        }
+        capacity = std::max(capacity * 2, size + count);
+        heap.resize(capacity);
+        entries = heap.data();
+    }
+
+    Entry &operator[](uint i) {
+        return entries[i];
+    }
+};
+
+/**
+ * Tests a ray against all children of a node.
+ * A NaN slab distance (ray origin on a slab it is parallel to) is ignored rather than rejecting the child, which is
+ * why the running distances are always the second operand of min and max.
+ * @param tNear outputs the entry distance of every child that was hit
+ * @return bit mask of the children hit in [0, maxT]
+ */
+template<uint Width>
+uint intersectChildren(const typename cg::WideBVH<Width>::Node &node, const WideRay &ray, float maxT,
+                       float *tNear) {
+#if defined(__AVX__)
+    if constexpr (Width == 8) {
+        __m256 tEntry = _mm256_setzero_ps();
+        __m256 tExit = _mm256_set1_ps(maxT);
+        for (uint axis = 0; axis < 3; ++axis) {
+            __m256 origin = _mm256_set1_ps(ray.origin[axis]);
+            __m256 inverse = _mm256_set1_ps(ray.inverseDirection[axis]);
+            __m256 nearPlane = _mm256_load_ps(node.bounds[ray.nearSide[axis]][axis]);
+            __m256 farPlane = _mm256_load_ps(node.bounds[1 - ray.nearSide[axis]][axis]);
+            tEntry = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearPlane, origin), inverse), tEntry);
+            tExit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(farPlane, origin), inverse), tExit);
+        }
+        _mm256_storeu_ps(tNear, tEntry);
+        return static_cast<uint>(_mm256_movemask_ps(_mm256_cmp_ps(tEntry, tExit, _CMP_LE_OQ)));
+    }
+#endif
+#if defined(__AVX__) || defined(WIDE_BVH_SSE)
+    if constexpr (Width % 4 == 0) {
+        uint mask = 0;
+        for (uint lane = 0; lane < Width; lane += 4) {
+            __m128 tEntry = _mm_setzero_ps();
+            __m128 tExit = _mm_set1_ps(maxT);
+            for (uint axis = 0; axis < 3; ++axis) {
+                __m128 origin = _mm_set1_ps(ray.origin[axis]);
+                __m128 inverse = _mm_set1_ps(ray.inverseDirection[axis]);
+                __m128 nearPlane = _mm_load_ps(node.bounds[ray.nearSide[axis]][axis] + lane);
+                __m128 farPlane = _mm_load_ps(node.bounds[1 - ray.nearSide[axis]][axis] + lane);
+                tEntry = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, origin), inverse), tEntry);
+                tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farPlane, origin), inverse), tExit);
+            }
+            _mm_storeu_ps(tNear + lane, tEntry);
+            mask |= static_cast<uint>(_mm_movemask_ps(_mm_cmple_ps(tEntry, tExit))) << lane;
+        }
+        return mask;
+    }
+#endif
+    uint mask = 0;
+    for (uint i = 0; i < Width; ++i) {
+        float tEntry = 0.0f, tExit = maxT;
+        for (uint axis = 0; axis < 3; ++axis) {
+            uint side = ray.nearSide[axis];
+            float nearT = (node.bounds[side][axis][i] - ray.origin[axis]) * ray.inverseDirection[axis];
+            float farT = (node.bounds[1 - side][axis][i] - ray.origin[axis]) * ray.inverseDirection[axis];
+            tEntry = nearT > tEntry ? nearT : tEntry;
+            tExit = farT < tExit ? farT : tExit;
+        }
+        tNear[i] = tEntry;
+        mask |= static_cast<uint>(tEntry <= tExit) << i;
+    }
+    return mask;
+}
+
+/**
+ * Tests a packet of rays against all children of a node at once. A child counts as hit if the lowest entry distance
+ * of the rays is below their highest exit distance, which holds for every child hit by any of the rays, but also for
+ * some that none of them hits.
+ * @param tNear outputs the lowest entry distance of every child that was hit
+ * @return bit mask of the children hit in [0, maxT]
+ */
+template<uint Width>
+uint intersectChildren(const typename cg::WideBVH<Width>::Node &node, const RayPacket &packet, float maxT,
+                       float *tNear) {
+    float tEntry[Width], tExit[Width];
+    for (uint i = 0; i < Width; ++i) {
+        tEntry[i] = 0.0f;
+        tExit[i] = maxT;
+    }
+    for (uint axis = 0; axis < 3; ++axis) {
+        uint side = packet.nearSide[axis];
+        for (uint i = 0; i < Width; ++i) {
+            float nearDistance = node.bounds[side][axis][i] - packet.origin[axis];
+            float farDistance = node.bounds[1 - side][axis][i] - packet.origin[axis];
+            float nearT = std::min(nearDistance * packet.inverseMin[axis], nearDistance * packet.inverseMax[axis]);
+            float farT = std::max(farDistance * packet.inverseMin[axis], farDistance * packet.inverseMax[axis]);
+            tEntry[i] = nearT > tEntry[i] ? nearT : tEntry[i];
+            tExit[i] = farT < tExit[i] ? farT : tExit[i];
+        }
+    }
+    uint mask = 0;
+    for (uint i = 0; i < Width; ++i) {
+        tNear[i] = tEntry[i];
+        mask |= static_cast<uint>(tEntry[i] <= tExit[i]) << i;
+    }
+    return mask;
+}
+
+/**
+ * Tests ray r of a packet against child i of a node, the same slab test as intersectChildren for a single ray.
+ */
+template<uint Width>
+bool rayHitsChild(const typename cg::WideBVH<Width>::Node &node, uint i, const RayPacket &packet, uint r,
+                  float maxT) {
+    float tEntry = 0.0f, tExit = maxT;
+    for (uint axis = 0; axis < 3; ++axis) {
+        uint side = packet.nearSide[axis];
+        float nearT = (node.bounds[side][axis][i] - packet.origin[axis]) * packet.inverseDirection[axis][r];
+        float farT = (node.bounds[1 - side][axis][i] - packet.origin[axis]) * packet.inverseDirection[axis][r];
+        tEntry = nearT > tEntry ? nearT : tEntry;
+        tExit = farT < tExit ? farT : tExit;
+    }
+    return tEntry <= tExit;
+}
+
+/**
+ * Closest hit traversal of a wide BVH by a packet of rays. Interior nodes are culled for the whole packet, and their
+ * children visited by ascending lowest entry distance. Leaves are culled once more ray by ray, so that visitLeaf
+ * only tests the rays that hit their bounds.
+ * @param active rays of the packet to trace
+ * @param maxT closest hit distance of every ray, updated by visitLeaf
+ * @param visitLeaf void(uint first, uint count, uint64_t rays), tests the primitives of a leaf against some rays
+ * @param expandDeferred uint(uint deferred), returns the node of a deferred child once it is reached
+ */
+template<uint Width, typename LeafFunc, typename ExpandFunc>
+void traversePacket(const cg::WideBVH<Width> &bvh, uint root, const RayPacket &packet, uint64_t active,
+                    const float *maxT, LeafFunc &&visitLeaf, ExpandFunc &&expandDeferred) {
+    TraversalStack<PacketStackEntry> stack;
+    stack[0] = PacketStackEntry{root, 0, 0.0f, active};
+    uint stackSize = 1;
+    while (stackSize) {
+        PacketStackEntry entry = stack[--stackSize];
+        float packetMaxT = 0.0f;
+        for (uint64_t mask = entry.rays; mask; mask &= mask - 1) {
+            packetMaxT = std::max(packetMaxT, maxT[std::countr_zero(mask)]);
+        }
+        if (entry.tNear > packetMaxT) {
+            continue;
+        }
+        if (entry.primitiveCount == WIDE_BVH_DEFERRED) {
+            entry.child = expandDeferred(entry.child);
+            entry.primitiveCount = 0;
+        }
+        if (entry.primitiveCount) {
+            visitLeaf(entry.child, entry.primitiveCount, entry.rays);
+            continue;
+        }
+        stack.reserve(stackSize, Width);
+        const auto &node = bvh.nodes[entry.child];
+        float tNear[Width];
+        uint mask = intersectChildren<Width>(node, packet, packetMaxT, tNear);
+        uint first = stackSize;
+        while (mask) {
+            auto i = static_cast<uint>(std::countr_zero(mask));
+            mask &= mask - 1;
+            uint64_t rays = 0;
+            if (node.primitiveCount[i] && node.primitiveCount[i] != WIDE_BVH_DEFERRED) {
+                for (uint64_t candidates = entry.rays; candidates; candidates &= candidates - 1) {
+                    auto r = static_cast<uint>(std::countr_zero(candidates));
+                    if (rayHitsChild<Width>(node, i, packet, r, maxT[r])) {
+                        rays |= uint64_t(1) << r;
+                    }
+                }
+            } else {
+                // narrow the rays to the range between the first and the last that hit, which is cheap to find
+                // for coherent rays that mostly hit the same children
+                uint64_t candidates = entry.rays;
+                while (candidates) {
+                    auto r = static_cast<uint>(std::countr_zero(candidates));
+                    if (rayHitsChild<Width>(node, i, packet, r, maxT[r])) {
+                        break;
+                    }
+                    candidates &= candidates - 1;
+                }
+                while (candidates) {
+                    auto r = static_cast<uint>(63 - std::countl_zero(candidates));
+                    if (rayHitsChild<Width>(node, i, packet, r, maxT[r])) {
+                        break;
+                    }
+                    candidates &= ~(uint64_t(1) << r);
+                }
+                rays = candidates;
+            }
+            if (!rays) {
+                continue;
+            }
+            // keep the pushed children sorted by descending distance, so the nearest one is on top
+            uint position = stackSize++;
+            while (position > first && stack[position - 1].tNear < tNear[i]) {
+                stack[position] = stack[position - 1];
+                --position;
+            }
+            stack[position] = PacketStackEntry{node.child[i], node.primitiveCount[i], tNear[i], rays};
+        }
+    }
+}
+
+/**
+ * Closest hit traversal of a wide BVH. Children are visited nearest first, and subtrees entered beyond the closest
+ * hit so far are skipped when popped.
+ * @tparam AnyHit stop as soon as visitLeaf reports a hit
+ * @param maxT only hits closer than this are reported, updated by visitLeaf
+ * @param visitLeaf bool(uint first, uint count, float &maxT), tests the primitives of a leaf and returns
+ * whether it found a closer hit
+ * @param expandDeferred uint(uint deferred), returns the node of a deferred child once it is reached
+ */
+template<bool AnyHit = false, uint Width, typename LeafFunc, typename ExpandFunc>
+bool traverse(const cg::WideBVH<Width> &bvh, uint root, const Ray &ray, float &maxT, LeafFunc &&visitLeaf,
+              ExpandFunc &&expandDeferred) {
+    WideRay wideRay(ray);
+    TraversalStack<StackEntry> stack;
+    stack[0] = StackEntry{root, 0, 0.0f};
+    uint stackSize = 1;
+    bool hasIntersection = false;
+    while (stackSize) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.tNear > maxT) {
+            continue;
+        }
+        if (entry.primitiveCount == WIDE_BVH_DEFERRED) {
+            entry.child = expandDeferred(entry.child);
+            entry.primitiveCount = 0;
+        }
+        if (entry.primitiveCount) {
+            hasIntersection |= visitLeaf(entry.child, entry.primitiveCount, maxT);
+            if (AnyHit && hasIntersection) {
+                return true;
+            }
+            continue;
+        }
+        stack.reserve(stackSize, Width);
+        const auto &node = bvh.nodes[entry.child];
+        float tNear[Width];
+        uint mask = intersectChildren<Width>(node, wideRay, maxT, tNear);
+        uint first = stackSize;
+        while (mask) {
+            auto i = static_cast<uint>(std::countr_zero(mask));
+            mask &= mask - 1;
+            // keep the pushed children sorted by descending distance, so the nearest one is on top
+            uint position = stackSize++;
+            while (position > first && stack[position - 1].tNear < tNear[i]) {
+                stack[position] = stack[position - 1];
+                --position;
+            }
+            stack[position] = StackEntry{node.child[i], node.primitiveCount[i], tNear[i]};
+        }
+    }
+    return hasIntersection;
+}
+
+// expandDeferred of the top-level BVH, which has no deferred subtrees
+uint noDeferredSubtrees(uint) {
+    return 0;
+}
+}
+
+void cg::WideBVHScene::buildBottomLevel(const std::vector<BVHNode> &bvhNodes,
+                                        const std::vector<RayTracingInstance> &instances,
+                                        const std::vector<Triangle> &triangles, const BVHBuildOptions &options) {
+    bottomLevel.nodes.clear();
+    bottomLevelRoots.clear();
+    std::vector<BVHNode> deferredLeaves;
+    for (const auto &instance: instances) {
+        if (instance.shape == SHAPE_MESH && !bottomLevelRoots.contains(instance.bvhRoot)) {
+            bottomLevelRoots.emplace(instance.bvhRoot,
+                bottomLevel.collapse(bvhNodes, instance.bvhRoot, &deferredLeaves));
+        }
+    }
+
+    deferredSubtrees.clear();
+    deferredTriangles.clear();
+    if (deferredLeaves.empty()) {
+        return;
+    }
+    size_t deferredCount = 0;
+    for (const auto &leaf: deferredLeaves) {
+        deferredSubtrees.emplace_back().leaf = leaf;
+        deferredCount += leaf.primitiveCount;
+    }
+    // a subtree over n primitives collapses into fewer than n nodes
+    bottomLevel.nodes.reserve(bottomLevel.nodes.size() + deferredCount);
+    deferredTriangles = triangles;
+    deferredOptions = options;
+    deferredOptions.deferredLeafSize = 0;
+    // the subtrees are small and built by the render threads themselves
+    deferredOptions.threads = 1;
+}
+
+uint cg::WideBVHScene::expandDeferred(uint deferred, const Vertex *vertices) const {
+    auto &subtree = deferredSubtrees[deferred];
+    std::call_once(subtree.built, [&]() {
+        uint first = subtree.leaf.offset, count = subtree.leaf.primitiveCount;
+        std::vector<Bounds3> bounds(count);
+        for (uint i = 0; i < count; ++i) {
+            bounds[i] = deferredTriangles[first + i].bounds(vertices);
+        }
+        BVH bvh;
+        auto order = bvh.buildFromBounds(bounds, deferredOptions);
+        std::vector<Triangle> range(deferredTriangles.begin() + first, deferredTriangles.begin() + first + count);
+        for (uint i = 0; i < count; ++i) {
+            deferredTriangles[first + i] = range[order[i]];
+        }
+        for (auto &node: bvh.nodes) {
+            if (node.primitiveCount) {
+                node.offset += first;
+            }
+        }
+        std::lock_guard lock(deferredMutex);
+        subtree.root = bottomLevel.collapse(bvh.nodes, 0);
+    });
+    return subtree.root;
+}
+
+void cg::WideBVHScene::buildTopLevel(const std::vector<BVHNode> &tlas,
+                                     const std::vector<RayTracingInstance> &instances) {
+    topLevel.nodes.clear();
+    topLevel.collapse(tlas, 0);
+    instanceRoots.resize(instances.size());
+    for (size_t i = 0; i < instances.size(); ++i) {
+        // analytic shapes have no bottom-level BVH
+        instanceRoots[i] = instances[i].shape == SHAPE_MESH ? bottomLevelRoots.at(instances[i].bvhRoot) : 0;
+    }
+}
+
+bool cg::WideBVHScene::firstIntersection(Ray ray, const RayTracingInstance *instances, Triangle *primitives,
+                                         Vertex *vertices, Intersection *output) const {
+    Triangle *leafPrimitives = leafTriangles(primitives);
+    const auto expand = [&](uint deferred) {
+        return expandDeferred(deferred, vertices);
+    };
+    float maxT = 1e20f;
+    Intersection intersection;
+    return traverse(topLevel, 0, ray, maxT, [&](uint first, uint count, float &closestT) {
+        bool hasIntersection = false;
+        for (uint i = first; i < first + count; ++i) {
+            Ray objectRay = worldToObjectRay(instances + i, ray);
+            bool hit;
+            if (instances[i].shape != SHAPE_MESH) {
+                hit = intersectShape(objectRay, instances + i, closestT, &intersection);
+                if (hit) {
+                    closestT = intersection.distance;
+                }
+            } else {
+                hit = traverse(bottomLevel, instanceRoots[i], objectRay, closestT,
+                    [&](uint firstTriangle, uint triangleCount, float &leafT) {
+                        if (intersectLeaf(objectRay, leafPrimitives, vertices, firstTriangle, triangleCount, leafT,
+                                          &intersection)) {
+                            leafT = intersection.distance;
+                            return true;
+                        }
+                        return false;
+                    }, expand);
+            }
+            if (hit) {
+                intersection.instance = i;
+                intersection.position = ray.origin + closestT * ray.direction;
+                *output = intersection;
+                hasIntersection = true;
+            }
+        }
+        return hasIntersection;
+    }, noDeferredSubtrees);
+}
+
+bool cg::WideBVHScene::occluded(Ray ray, float maxT, const RayTracingInstance *instances,
+                                Triangle *primitives, Vertex *vertices) const {
+    Triangle *leafPrimitives = leafTriangles(primitives);
+    const auto expand = [&](uint deferred) {
+        return expandDeferred(deferred, vertices);
+    };
+    return traverse<true>(topLevel, 0, ray, maxT, [&](uint first, uint count, float &closestT) {
+        for (uint i = first; i < first + count; ++i) {
+            Ray objectRay = worldToObjectRay(instances + i, ray);
+            if (instances[i].shape != SHAPE_MESH) {
+                Intersection unused;
+                if (intersectShape(objectRay, instances + i, closestT, &unused)) {
+                    return true;
+                }
+                continue;
+            }
+            bool hit = traverse<true>(bottomLevel, instanceRoots[i], objectRay, closestT,
+                [&](uint firstTriangle, uint triangleCount, float &leafT) {
+                    return leafOccludes(objectRay, leafPrimitives, vertices, firstTriangle, triangleCount, leafT);
+                }, expand);
+            if (hit) {
+                return true;
+            }
+        }
+        return false;
+    }, noDeferredSubtrees);
+}
+
+void cg::WideBVHScene::firstIntersections(const Ray *rays, uint count, const RayTracingInstance *instances,
+                                          Triangle *primitives, Vertex *vertices, Intersection *outputs,
+                                          bool *hits) const {
+    uint64_t all = count < 64 ? (uint64_t(1) << count) - 1 : ~uint64_t(0);
+    RayPacket packet(rays, all);
+    if (!packet.coherent) {
+        for (uint r = 0; r < count; ++r) {
+            hits[r] = firstIntersection(rays[r], instances, primitives, vertices, outputs + r);
+        }
+        return;
+    }
+    float maxT[CPU_MAX_PACKET_SIZE];
+    for (uint r = 0; r < count; ++r) {
+        maxT[r] = 1e20f;
+        hits[r] = false;
+    }
+    Triangle *leafPrimitives = leafTriangles(primitives);
+    const auto expand = [&](uint deferred) {
+        return expandDeferred(deferred, vertices);
+    };
+    // ray r hit a leaf of instance i in object space, closer than any hit before
+    const auto recordHit = [&](uint r, uint i, Intersection &intersection) {
+        maxT[r] = intersection.distance;
+        intersection.instance = i;
+        intersection.position = rays[r].origin + maxT[r] * rays[r].direction;
+        outputs[r] = intersection;
+        hits[r] = true;
+    };
+    traversePacket(topLevel, 0, packet, all, maxT, [&](uint first, uint instanceCount, uint64_t active) {
+        for (uint i = first; i < first + instanceCount; ++i) {
+            Ray objectRays[CPU_MAX_PACKET_SIZE];
+            for (uint64_t mask = active; mask; mask &= mask - 1) {
+                auto r = static_cast<uint>(std::countr_zero(mask));
+                objectRays[r] = worldToObjectRay(instances + i, rays[r]);
+            }
+            if (instances[i].shape != SHAPE_MESH) {
+                for (uint64_t mask = active; mask; mask &= mask - 1) {
+                    auto r = static_cast<uint>(std::countr_zero(mask));
+                    Intersection intersection;
+                    if (intersectShape(objectRays[r], instances + i, maxT[r], &intersection)) {
+                        recordHit(r, i, intersection);
+                    }
+                }
+                continue;
+            }
+            RayPacket objectPacket(objectRays, active);
+            if (objectPacket.coherent) {
+                traversePacket(bottomLevel, instanceRoots[i], objectPacket, active, maxT,
+                    [&](uint firstTriangle, uint triangleCount, uint64_t leafRays) {
+                        for (uint64_t mask = leafRays; mask; mask &= mask - 1) {
+                            auto r = static_cast<uint>(std::countr_zero(mask));
+                            Intersection intersection;
+                            if (intersectLeaf(objectRays[r], leafPrimitives, vertices, firstTriangle, triangleCount,
+                                              maxT[r], &intersection)) {
+                                recordHit(r, i, intersection);
+                            }
+                        }
+                    }, expand);
+                continue;
+            }
+            // the transform of the instance separated the directions along an axis
+            for (uint64_t mask = active; mask; mask &= mask - 1) {
+                auto r = static_cast<uint>(std::countr_zero(mask));
+                Intersection intersection;
+                float closestT = maxT[r];
+                bool hit = traverse(bottomLevel, instanceRoots[i], objectRays[r], closestT,
+                    [&](uint firstTriangle, uint triangleCount, float &leafT) {
+                        if (intersectLeaf(objectRays[r], leafPrimitives, vertices, firstTriangle, triangleCount, leafT,
+                                          &intersection)) {
+                            leafT = intersection.distance;
+                            return true;
+                        }
+                        return false;
+                    }, expand);
+                if (hit) {
+                    recordHit(r, i, intersection);
+                }
+            }
+        }
+    }, noDeferredSubtrees);
+}
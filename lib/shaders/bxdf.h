@@ -91,4 +91,28 @@ float3 MixedBRDF(float3 L, float3 V, float3 N, float roughness, float3 diffuseCo
         + SpecularBRDF(L, V, N, roughness, metallicR0 + diffuseColor * specTrans * IorToR0(dot(V, H), eta)), 1.0f);
 }
 
+/**
+ * Solid angle density of the directions render_kernel samples at a surface. Diffuse and rough metallic lobes both
+ * sample the cosine-weighted hemisphere, smooth metallic reflection and refraction are delta lobes that no other
+ * strategy can produce, so they are left out.
+ * @param continuousChance probability of selecting one of the non-delta lobes
+ */
+float BSDFPdf(float3 L, float3 N, float continuousChance) {
+    float NdotL = dot(N, L);
+    return NdotL > 0.0f ? continuousChance * NdotL * RT_M_1_PI_F : 0.0f;
+}
+
+/**
+ * Multiple importance sampling weight of a sample taken with density pdf, where another strategy would have taken
+ * it with density otherPdf.
+ * @param power power heuristic with exponent 2 instead of the balance heuristic
+ */
+float MISWeight(float pdf, float otherPdf, bool power) {
+    if (power) {
+        pdf *= pdf;
+        otherPdf *= otherPdf;
+    }
+    return pdf > 0.0f ? pdf / (pdf + otherPdf) : 0.0f;
+}
+
 #endif //ASSIGNMENT_BXDF_H
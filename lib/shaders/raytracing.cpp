@@ -2,26 +2,68 @@
 #include "lib/shaders/rt_common.h"
 #include "lib/shaders/bxdf.h"
 
+#ifdef __cplusplus
+#include <wide_bvh.h>
+#endif
+
+/**
+ * Position of vertex v (0, 1 or 2) of a triangle.
+ */
+float3 triangleVertex(__global Vertex *vertices, Triangle triangle, uint v) {
+    __global Vertex *vertex = &vertices[triangle.vertex[v]];
+    return vec3(vertex->position[0], vertex->position[1], vertex->position[2]);
+}
+
+/**
+ * Object space normal of a vertex, not normalized unless it is decoded from QUANTIZED_VERTICES.
+ */
+float3 vertexNormal(VertexShading shading) {
+#ifdef QUANTIZED_VERTICES
+    // fold the octahedron back onto the sphere
+    float x = max(shading.normal[0] / 32767.0f, -1.0f);
+    float y = max(shading.normal[1] / 32767.0f, -1.0f);
+    float z = 1.0f - fabs(x) - fabs(y);
+    if (z < 0) {
+        float foldedX = (1.0f - fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+        y = (1.0f - fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+        x = foldedX;
+    }
+    return normalize(vec3(x, y, z));
+#else
+    return vec3(shading.normal[0], shading.normal[1], shading.normal[2]);
+#endif
+}
+
+float2 vertexTexcoord(VertexShading shading) {
+#ifdef QUANTIZED_VERTICES
+    return vload_half2(0, (const half *) shading.texcoord);
+#else
+    return vec2(shading.texcoord[0], shading.texcoord[1]);
+#endif
+}
+
 /**
  * Checks if a ray intersects with a triangle.
  * @param ray the ray to check
+ * @param vertices the vertex pool the triangle indexes
  * @param triangle the triangle to check
  * @param collision outputs collision info if intersects
  * @return whether the ray and the triangle intersects
  */
-bool intersect(Ray ray, Triangle triangle, Intersection *intersection) {
+bool intersect(Ray ray, __global Vertex *vertices, Triangle triangle, Intersection *intersection) {
     // Reference:
     // https://scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection
 
-    float3 e01 = triangle.v1.position - triangle.v0.position;
-    float3 e02 = triangle.v2.position - triangle.v0.position;
+    float3 v0 = triangleVertex(vertices, triangle, 0);
+    float3 e01 = triangleVertex(vertices, triangle, 1) - v0;
+    float3 e02 = triangleVertex(vertices, triangle, 2) - v0;
 
     float3 pvec = cross(ray.direction, e02);
     float det = dot(e01, pvec);
     if (fabs(det) < 1e-5f) return false;
     float invDet = 1 / det;
 
-    float3 tvec = ray.origin - triangle.v0.position;
+    float3 tvec = ray.origin - v0;
     float u = dot(tvec, pvec) * invDet;
     if (u < 0 || u > 1) return false;
 
@@ -41,6 +83,262 @@ bool intersect(Ray ray, Triangle triangle, Intersection *intersection) {
     return true;
 }
 
+#ifdef __cplusplus
+// a fixed trip count lets the compiler vectorize the leaf loop across triangles
+#define LEAF_BATCH_SIZE(count) BVH_MAX_LEAF_SIZE
+#else
+#define LEAF_BATCH_SIZE(count) (count)
+#endif
+
+#ifdef WATERTIGHT_TRIANGLES
+
+/**
+ * Computes the per ray constants of the watertight test, once for all triangles of a leaf.
+ */
+WatertightRay watertightRay(Ray ray) {
+    WatertightRay result;
+    float direction[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+    float ax = fabs(ray.direction.x), ay = fabs(ray.direction.y), az = fabs(ray.direction.z);
+    result.kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    result.kx = result.kz == 2 ? 0 : result.kz + 1;
+    result.ky = result.kx == 2 ? 0 : result.kx + 1;
+    // keep the winding of the triangles, so the sign of the determinant still tells the side
+    if (direction[result.kz] < 0) {
+        uint swap = result.kx;
+        result.kx = result.ky;
+        result.ky = swap;
+    }
+    result.sx = direction[result.kx] / direction[result.kz];
+    result.sy = direction[result.ky] / direction[result.kz];
+    result.sz = 1.0f / direction[result.kz];
+    result.origin[0] = ray.origin.x;
+    result.origin[1] = ray.origin.y;
+    result.origin[2] = ray.origin.z;
+    return result;
+}
+
+/**
+ * Checks a ray against all triangles of a BVH leaf in one batch with the watertight test, which never lets a ray
+ * slip through the shared edge of two triangles.
+ * @param first index of the first triangle of the leaf
+ * @param count number of triangles of the leaf
+ * @param maxT only hits closer than this are reported
+ * @param intersection outputs the closest hit, including the index of the first copy of its triangle
+ * @return whether any triangle was hit in (1e-5, maxT)
+ */
+bool intersectLeaf(Ray ray, __global Triangle *primitives, __global Vertex *vertices, uint first, uint count,
+                   float maxT, Intersection *intersection) {
+    WatertightRay wray = watertightRay(ray);
+    // vertices relative to the ray origin in the permuted axes, [vertex][axis][lane]
+    float p[3][3][BVH_MAX_LEAF_SIZE];
+    for (uint i = 0; i < LEAF_BATCH_SIZE(count); ++i) {
+        // lanes past the end of the leaf repeat its first triangle and are masked out below
+        __global Triangle *triangle = &primitives[first + (i < count ? i : 0)];
+        for (uint v = 0; v < 3; ++v) {
+            __global Vertex *vertex = &vertices[triangle->vertex[v]];
+            p[v][0][i] = vertex->position[wray.kx] - wray.origin[wray.kx];
+            p[v][1][i] = vertex->position[wray.ky] - wray.origin[wray.ky];
+            p[v][2][i] = vertex->position[wray.kz] - wray.origin[wray.kz];
+        }
+    }
+
+    float hitT[BVH_MAX_LEAF_SIZE], hitU[BVH_MAX_LEAF_SIZE], hitV[BVH_MAX_LEAF_SIZE], hitW[BVH_MAX_LEAF_SIZE];
+    float hitDet[BVH_MAX_LEAF_SIZE];
+    for (uint i = 0; i < LEAF_BATCH_SIZE(count); ++i) {
+        // sheared so that the ray runs along z
+        float ax = p[0][0][i] - wray.sx * p[0][2][i];
+        float ay = p[0][1][i] - wray.sy * p[0][2][i];
+        float bx = p[1][0][i] - wray.sx * p[1][2][i];
+        float by = p[1][1][i] - wray.sy * p[1][2][i];
+        float cx = p[2][0][i] - wray.sx * p[2][2][i];
+        float cy = p[2][1][i] - wray.sy * p[2][2][i];
+
+        // scaled barycentrics, the edge functions of the opposite edges
+        float u = cx * by - cy * bx;
+        float v = ax * cy - ay * cx;
+        float w = bx * ay - by * ax;
+        float det = u + v + w;
+        float t = (u * p[0][2][i] + v * p[1][2][i] + w * p[2][2][i]) * wray.sz / det;
+
+        bool inside = ((u >= 0) & (v >= 0) & (w >= 0)) | ((u <= 0) & (v <= 0) & (w <= 0));
+        bool hit = (i < count) & inside & (det != 0) & (t >= 1e-5f) & (t < maxT);
+        hitT[i] = hit ? t : maxT;
+        hitU[i] = u;
+        hitV[i] = v;
+        hitW[i] = w;
+        hitDet[i] = det;
+    }
+
+    uint closest = count;
+    for (uint i = 0; i < count; ++i) {
+        if (hitT[i] < maxT) {
+            maxT = hitT[i];
+            closest = i;
+        }
+    }
+    if (closest == count) {
+        return false;
+    }
+    float invDet = 1.0f / hitDet[closest];
+    intersection->barycentric.x = hitU[closest] * invDet;
+    intersection->barycentric.y = hitV[closest] * invDet;
+    intersection->barycentric.z = hitW[closest] * invDet;
+    intersection->distance = maxT;
+    intersection->position = ray.origin + maxT * ray.direction;
+    intersection->side = hitDet[closest] < 0;
+    intersection->index = primitives[first + closest].original;
+    return true;
+}
+
+/**
+ * Checks whether a ray hits any triangle of a BVH leaf in (1e-5, maxT), with the same test as intersectLeaf. Stops
+ * at the first hit and computes neither its barycentrics nor its position.
+ */
+bool leafOccludes(Ray ray, __global Triangle *primitives, __global Vertex *vertices, uint first, uint count,
+                  float maxT) {
+    WatertightRay wray = watertightRay(ray);
+    for (uint i = first; i < first + count; ++i) {
+        __global VertexCoordinate *a = vertices[primitives[i].vertex[0]].position;
+        __global VertexCoordinate *b = vertices[primitives[i].vertex[1]].position;
+        __global VertexCoordinate *c = vertices[primitives[i].vertex[2]].position;
+        float az = a[wray.kz] - wray.origin[wray.kz];
+        float bz = b[wray.kz] - wray.origin[wray.kz];
+        float cz = c[wray.kz] - wray.origin[wray.kz];
+        float ax = a[wray.kx] - wray.origin[wray.kx] - wray.sx * az;
+        float ay = a[wray.ky] - wray.origin[wray.ky] - wray.sy * az;
+        float bx = b[wray.kx] - wray.origin[wray.kx] - wray.sx * bz;
+        float by = b[wray.ky] - wray.origin[wray.ky] - wray.sy * bz;
+        float cx = c[wray.kx] - wray.origin[wray.kx] - wray.sx * cz;
+        float cy = c[wray.ky] - wray.origin[wray.ky] - wray.sy * cz;
+        float u = cx * by - cy * bx;
+        float v = ax * cy - ay * cx;
+        float w = bx * ay - by * ax;
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) {
+            continue;
+        }
+        float det = u + v + w;
+        if (det == 0) {
+            continue;
+        }
+        float t = (u * az + v * bz + w * cz) * wray.sz / det;
+        if (t >= 1e-5f && t < maxT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#else
+
+/**
+ * Checks a ray against all triangles of a BVH leaf in one batch (Moller-Trumbore, same as intersect).
+ * Vertex positions are copied to arrays first so that the tests run without branches across triangles.
+ * @param first index of the first triangle of the leaf
+ * @param count number of triangles of the leaf
+ * @param maxT only hits closer than this are reported
+ * @param intersection outputs the closest hit, including the index of the first copy of its triangle
+ * @return whether any triangle was hit in (1e-5, maxT)
+ */
+bool intersectLeaf(Ray ray, __global Triangle *primitives, __global Vertex *vertices, uint first, uint count,
+                   float maxT, Intersection *intersection) {
+    float p0[3][BVH_MAX_LEAF_SIZE], e01[3][BVH_MAX_LEAF_SIZE], e02[3][BVH_MAX_LEAF_SIZE];
+    for (uint i = 0; i < LEAF_BATCH_SIZE(count); ++i) {
+        // lanes past the end of the leaf repeat its first triangle and are masked out below
+        __global Triangle *triangle = &primitives[first + (i < count ? i : 0)];
+        __global VertexCoordinate *a = vertices[triangle->vertex[0]].position;
+        __global VertexCoordinate *b = vertices[triangle->vertex[1]].position;
+        __global VertexCoordinate *c = vertices[triangle->vertex[2]].position;
+        for (uint axis = 0; axis < 3; ++axis) {
+            p0[axis][i] = a[axis];
+            e01[axis][i] = b[axis] - a[axis];
+            e02[axis][i] = c[axis] - a[axis];
+        }
+    }
+
+    float hitT[BVH_MAX_LEAF_SIZE], hitU[BVH_MAX_LEAF_SIZE], hitV[BVH_MAX_LEAF_SIZE], hitDet[BVH_MAX_LEAF_SIZE];
+    float dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+    for (uint i = 0; i < LEAF_BATCH_SIZE(count); ++i) {
+        float px = dy * e02[2][i] - dz * e02[1][i];
+        float py = dz * e02[0][i] - dx * e02[2][i];
+        float pz = dx * e02[1][i] - dy * e02[0][i];
+        float det = e01[0][i] * px + e01[1][i] * py + e01[2][i] * pz;
+        float invDet = 1.0f / det;
+
+        float tx = ray.origin.x - p0[0][i];
+        float ty = ray.origin.y - p0[1][i];
+        float tz = ray.origin.z - p0[2][i];
+        float u = (tx * px + ty * py + tz * pz) * invDet;
+
+        float qx = ty * e01[2][i] - tz * e01[1][i];
+        float qy = tz * e01[0][i] - tx * e01[2][i];
+        float qz = tx * e01[1][i] - ty * e01[0][i];
+        float v = (dx * qx + dy * qy + dz * qz) * invDet;
+        float t = (e02[0][i] * qx + e02[1][i] * qy + e02[2][i] * qz) * invDet;
+
+        bool hit = (i < count) & (fabs(det) >= 1e-5f) & (u >= 0) & (u <= 1) & (v >= 0) & (u + v <= 1)
+                   & (t >= 1e-5f) & (t < maxT);
+        hitT[i] = hit ? t : maxT;
+        hitU[i] = u;
+        hitV[i] = v;
+        hitDet[i] = det;
+    }
+
+    uint closest = count;
+    for (uint i = 0; i < count; ++i) {
+        if (hitT[i] < maxT) {
+            maxT = hitT[i];
+            closest = i;
+        }
+    }
+    if (closest == count) {
+        return false;
+    }
+    intersection->barycentric.x = 1 - hitU[closest] - hitV[closest];
+    intersection->barycentric.y = hitU[closest];
+    intersection->barycentric.z = hitV[closest];
+    intersection->distance = maxT;
+    intersection->position = ray.origin + maxT * ray.direction;
+    intersection->side = hitDet[closest] < 0;
+    intersection->index = primitives[first + closest].original;
+    return true;
+}
+
+/**
+ * Checks whether a ray hits any triangle of a BVH leaf in (1e-5, maxT), with the same test as intersectLeaf. Stops
+ * at the first hit and computes neither its barycentrics nor its position.
+ */
+bool leafOccludes(Ray ray, __global Triangle *primitives, __global Vertex *vertices, uint first, uint count,
+                  float maxT) {
+    for (uint i = first; i < first + count; ++i) {
+        float3 v0 = triangleVertex(vertices, primitives[i], 0);
+        float3 e01 = triangleVertex(vertices, primitives[i], 1) - v0;
+        float3 e02 = triangleVertex(vertices, primitives[i], 2) - v0;
+        float3 p = cross(ray.direction, e02);
+        float det = dot(e01, p);
+        if (fabs(det) < 1e-5f) {
+            continue;
+        }
+        float invDet = 1.0f / det;
+        float3 tv = ray.origin - v0;
+        float u = dot(tv, p) * invDet;
+        if (u < 0 || u > 1) {
+            continue;
+        }
+        float3 q = cross(tv, e01);
+        float v = dot(ray.direction, q) * invDet;
+        if (v < 0 || u + v > 1) {
+            continue;
+        }
+        float t = dot(e02, q) * invDet;
+        if (t >= 1e-5f && t < maxT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
+
 bool boundsRayIntersects(Ray ray, Bounds3 bounds3, float *tmin_out, float *tmax_out) {
 #ifdef __cplusplus
     float3 inverseRay = 1.0f / ray.direction;
@@ -90,59 +388,675 @@ bool boundsRayIntersects(Ray ray, Bounds3 bounds3, float *tmin_out, float *tmax_
     return true;
 }
 
-bool firstIntersection(Ray ray, __global BVHNode *bvh, __global Triangle *primitives, Intersection *output) {
-    uint stack[64];
-    stack[0] = 0;
-    uint stackSize = 1;
+float3 objectToWorldPoint(__global const RayTracingInstance *instance, float3 p) {
+    return instance->objectToWorld[0] * p.x + instance->objectToWorld[1] * p.y + instance->objectToWorld[2] * p.z
+           + instance->objectToWorld[3];
+}
+
+float3 objectToWorldVector(__global const RayTracingInstance *instance, float3 v) {
+    return instance->objectToWorld[0] * v.x + instance->objectToWorld[1] * v.y + instance->objectToWorld[2] * v.z;
+}
+
+/**
+ * Transforms a normal of the vertex attributes, which are not in the grid space of quantized positions.
+ */
+float3 objectToWorldNormal(__global const RayTracingInstance *instance, float3 n) {
+    return objectToWorldVector(instance, n * instance->normalScale);
+}
+
+/**
+ * Transforms a ray into the object space of an instance. The direction is not normalized, so the ray parameter t
+ * of a hit is the same in both spaces.
+ */
+Ray worldToObjectRay(__global const RayTracingInstance *instance, Ray ray) {
+    Ray result;
+    result.origin = instance->worldToObject[0] * ray.origin.x + instance->worldToObject[1] * ray.origin.y
+                    + instance->worldToObject[2] * ray.origin.z + instance->worldToObject[3];
+    result.direction = instance->worldToObject[0] * ray.direction.x + instance->worldToObject[1] * ray.direction.y
+                       + instance->worldToObject[2] * ray.direction.z;
+    return result;
+}
+
+/**
+ * Intersects an object space ray with the analytic shape of an instance, which is not SHAPE_MESH. The hit position
+ * in object space is stored in Intersection::barycentric for shapeSurface.
+ * @param maxT only hits closer than this are considered
+ */
+bool intersectShape(Ray ray, __global const RayTracingInstance *instance, float maxT, Intersection *intersection) {
+    float t;
+    bool inside;
+    if (instance->shape == SHAPE_SPHERE) {
+        float radius = instance->shapeSize[0];
+        float a = dot(ray.direction, ray.direction);
+        float b = dot(ray.origin, ray.direction);
+        float c = dot(ray.origin, ray.origin) - radius * radius;
+        float discriminant = b * b - a * c;
+        if (discriminant < 0) return false;
+        // the root that does not cancel, see Numerical Recipes 5.6
+        float q = -(b + (b < 0 ? -sqrt(discriminant) : sqrt(discriminant)));
+        float t0 = q / a, t1 = c / q;
+        if (t0 > t1) {
+            float swap = t0;
+            t0 = t1;
+            t1 = swap;
+        }
+        t = t0 < SHAPE_EPSILON ? t1 : t0;
+        if (!(t >= SHAPE_EPSILON)) return false;
+        // rays leaving the sphere hit its far side
+        inside = t == t1 && t0 < SHAPE_EPSILON;
+    } else {
+        t = -ray.origin.y / ray.direction.y;
+        if (!(t >= SHAPE_EPSILON)) return false;
+        inside = ray.direction.y > 0;
+    }
+    if (t >= maxT) return false;
+    float3 p = ray.origin + t * ray.direction;
+    if (instance->shape == SHAPE_QUAD
+        && (fabs(p.x) > 0.5f * instance->shapeSize[0] || fabs(p.z) > 0.5f * instance->shapeSize[1])) {
+        return false;
+    }
+    intersection->barycentric = p;
+    intersection->distance = t;
+    intersection->position = p;
+    intersection->side = inside;
+    intersection->index = 0;
+    return true;
+}
+
+/**
+ * Object space normal of an analytic shape at a hit position from intersectShape, and its texcoord, which follows
+ * SphereGeometry and PlaneGeometry.
+ */
+float3 shapeSurface(__global const RayTracingInstance *instance, float3 p, float2 *texcoord) {
+    if (instance->shape == SHAPE_SPHERE) {
+        float3 n = p / instance->shapeSize[0];
+        float phi = atan2(-n.z, n.x);
+        if (phi < 0) phi += 2.0f * RT_M_PI_F;
+        *texcoord = vec2(phi * 0.5f * RT_M_1_PI_F, acos(clamp(n.y, -1.0f, 1.0f)) * RT_M_1_PI_F);
+        return n;
+    }
+    *texcoord = vec2(p.z / instance->shapeSize[1] + 0.5f, p.x / instance->shapeSize[0] + 0.5f);
+    return vec3(0.0f, 1.0f, 0.0f);
+}
+
+/**
+ * World space shading normal at a hit, on the side the ray came from, and the texcoord there.
+ */
+float3 hitNormal(__global const RayTracingInstance *instance, __global Triangle *triangles,
+                 __global VertexShading *vertexShading, const Intersection *intersection, float2 *texcoord) {
+    float3 normal;
+    if (instance->shape == SHAPE_MESH) {
+        Triangle triangle = triangles[intersection->index];
+        VertexShading s0 = vertexShading[triangle.vertex[0]];
+        VertexShading s1 = vertexShading[triangle.vertex[1]];
+        VertexShading s2 = vertexShading[triangle.vertex[2]];
+        normal = normalize(objectToWorldNormal(instance,
+            vertexNormal(s0) * intersection->barycentric.x +
+            vertexNormal(s1) * intersection->barycentric.y +
+            vertexNormal(s2) * intersection->barycentric.z
+        ));
+        *texcoord = (
+            vertexTexcoord(s0) * intersection->barycentric.x +
+            vertexTexcoord(s1) * intersection->barycentric.y +
+            vertexTexcoord(s2) * intersection->barycentric.z
+        );
+    } else {
+        normal = normalize(objectToWorldNormal(instance, shapeSurface(instance, intersection->barycentric, texcoord)));
+    }
+    return intersection->side ? -normal : normal;
+}
+
+/**
+ * Solid angle density with which the light sampling of render_kernel picks a point on an emitter: a light with
+ * probability lightPmf, then a point uniformly by area. The area is converted to solid angle with the geometric
+ * normal of the emitter, so that light and BSDF samples of smooth shaded emitters agree on the density.
+ * @param triangle the triangle of the light, or LIGHT_WHOLE_SHAPE for a SHAPE_QUAD
+ * @param direction unit direction between the shaded point and the point on the emitter, either way
+ * @param distance distance from the shaded point to the point on the emitter
+ */
+float lightSamplePdf(__global const RayTracingInstance *instance, __global Triangle *triangles,
+                     __global Vertex *vertices, uint triangle, float lightPmf, float3 direction, float distance) {
+    // the cross product of the world space edges is normal to the emitter, its length the area of the parallelogram
+    float3 areaNormal;
+    if (triangle == LIGHT_WHOLE_SHAPE) {
+        areaNormal = cross(objectToWorldVector(instance, vec3(instance->shapeSize[0], 0.0f, 0.0f)),
+                           objectToWorldVector(instance, vec3(0.0f, 0.0f, instance->shapeSize[1])));
+    } else {
+        Triangle lightTriangle = triangles[triangle];
+        float3 v0 = triangleVertex(vertices, lightTriangle, 0);
+        float3 e01 = objectToWorldVector(instance, triangleVertex(vertices, lightTriangle, 1) - v0);
+        float3 e02 = objectToWorldVector(instance, triangleVertex(vertices, lightTriangle, 2) - v0);
+        areaNormal = 0.5f * cross(e01, e02);
+    }
+    // |cos| times the area
+    return lightPmf * distance * distance / fabs(dot(areaNormal, direction));
+}
+
+/**
+ * cos(max(0, a - b)) of two angles in [0, pi] given by their sines and cosines.
+ */
+float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+}
+
+/**
+ * sin(max(0, a - b)) of two angles in [0, pi] given by their sines and cosines.
+ */
+float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+}
+
+/**
+ * Estimate of the light that the lights below a light BVH node send to a shading point: their power over the squared
+ * distance, times the smallest angles under which their normals and the normal of the point can face each other
+ * given the node's bounds and normal cone. It is only zero where none of the lights can contribute.
+ * @param normal normal of the shading point, lights on either side of it count
+ */
+float lightNodeImportance(__global const LightBVHNode *node, float3 p, float3 normal) {
+    if (!(node->power > 0.0f)) return 0.0f;
+    float3 center = 0.5f * (node->bounds.pMin + node->bounds.pMax);
+    float3 diagonal = node->bounds.pMax - node->bounds.pMin;
+    float radius2 = 0.25f * dot(diagonal, diagonal);
+    float distance2 = dot(p - center, p - center);
+    float3 wi = distance2 > 0.0f ? (p - center) / sqrt(distance2) : node->axis;
+    // angle under which the bounding sphere of the node is seen, all directions from inside of it
+    float cosBounds = distance2 > radius2 ? sqrt(1.0f - radius2 / distance2) : -1.0f;
+    float sinBounds = sqrt(max(0.0f, 1.0f - cosBounds * cosBounds));
+    // angle between wi and the closest normal in the cone, less the angle of the bounds
+    float cosW = dot(node->axis, wi);
+    float sinW = sqrt(max(0.0f, 1.0f - cosW * cosW));
+    float sinCone = sqrt(max(0.0f, 1.0f - node->cosTheta * node->cosTheta));
+    float cosX = cosSubClamped(sinW, cosW, sinCone, node->cosTheta);
+    float sinX = sinSubClamped(sinW, cosW, sinCone, node->cosTheta);
+    float cosLight = cosSubClamped(sinX, cosX, sinBounds, cosBounds);
+    // lights only emit on their front side
+    if (cosLight <= 0.0f) return 0.0f;
+    float cosI = fabs(dot(wi, normal));
+    float sinI = sqrt(max(0.0f, 1.0f - cosI * cosI));
+    return node->power * cosLight * cosSubClamped(sinI, cosI, sinBounds, cosBounds) / max(distance2, radius2);
+}
+
+/**
+ * Picks a light by descending the light BVH from the root, choosing each child with a probability proportional to
+ * its importance for the shading point.
+ * @param light outputs the index of the light in lights
+ * @param pmf outputs the probability of picking it, which lightTreePmf reproduces
+ * @return false if no light can contribute to the point
+ */
+bool sampleLightTree(__global const LightBVHNode *lightTree, float3 p, float3 normal, ulong *seed, uint *light,
+                     float *pmf) {
+    if (!(lightTree->power > 0.0f)) return false;
+    uint index = 0;
+    *pmf = 1.0f;
+    while (!(lightTree[index].offset & LIGHT_BVH_LEAF)) {
+        uint right = lightTree[index].offset;
+        float leftImportance = lightNodeImportance(lightTree + index + 1, p, normal);
+        float rightImportance = lightNodeImportance(lightTree + right, p, normal);
+        float total = leftImportance + rightImportance;
+        if (!(total > 0.0f)) return false;
+        if (randomFloat(seed) * total < leftImportance) {
+            *pmf *= leftImportance / total;
+            index = index + 1;
+        } else {
+            *pmf *= rightImportance / total;
+            index = right;
+        }
+    }
+    *light = lightTree[index].offset & ~LIGHT_BVH_LEAF;
+    return true;
+}
+
+/**
+ * Probability with which sampleLightTree picks a light for a shading point, by walking up from its leaf.
+ * @param leaf RayTracingLight::node of the light
+ */
+float lightTreePmf(__global const LightBVHNode *lightTree, float3 p, float3 normal, uint leaf) {
+    if (!(lightTree->power > 0.0f)) return 0.0f;
+    float pmf = 1.0f;
+    for (uint index = leaf; index && pmf > 0.0f; index = lightTree[index].parent) {
+        uint parent = lightTree[index].parent;
+        float leftImportance = lightNodeImportance(lightTree + parent + 1, p, normal);
+        float rightImportance = lightNodeImportance(lightTree + lightTree[parent].offset, p, normal);
+        float total = leftImportance + rightImportance;
+        pmf *= total > 0.0f ? (index == parent + 1 ? leftImportance : rightImportance) / total : 0.0f;
+    }
+    return pmf;
+}
+
+/**
+ * Finds the light of an emissive instance that a ray hit.
+ * @param triangle the hit triangle, ignored for a SHAPE_QUAD
+ * @return index into lights, the instance must have lights
+ */
+uint hitLight(__global const RayTracingLight *lights, __global const RayTracingInstance *instance, uint triangle) {
+    uint lo = instance->firstLight, hi = instance->firstLight + instance->lightCount - 1;
+    if (instance->shape == SHAPE_QUAD) return lo;
+    // the lights of an instance are ordered by triangle
+    while (lo < hi) {
+        uint mid = (lo + hi) / 2;
+        if (lights[mid].triangle < triangle) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Picks a point uniformly by area on a light.
+ * @param normal outputs the unit world space normal of the emitting side of the light at the point
+ * @param area outputs the world space area of the light
+ * @return the point in world space
+ */
+float3 sampleLightPoint(RayTracingLight light, __global const RayTracingInstance *instance,
+                        __global Triangle *triangles, __global Vertex *vertices, ulong *seed, float3 *normal,
+                        float *area) {
+    float s, t;
+    float3 v0, v1, v2, front;
+    if (light.triangle == LIGHT_WHOLE_SHAPE) {
+        // spanned by v0, v1 and v2 like a parallelogram
+        s = randomFloat(seed);
+        t = randomFloat(seed);
+        float halfX = 0.5f * instance->shapeSize[0];
+        float halfZ = 0.5f * instance->shapeSize[1];
+        v0 = vec3(-halfX, 0.0f, -halfZ);
+        v1 = vec3(halfX, 0.0f, -halfZ);
+        v2 = vec3(-halfX, 0.0f, halfZ);
+        front = vec3(0.0f, 1.0f, 0.0f);
+    } else {
+        Triangle lightTriangle = triangles[light.triangle];
+        // warps the unit square onto the triangle
+        float r = sqrt(randomFloat(seed));
+        t = r * randomFloat(seed);
+        s = r - t;
+        v0 = triangleVertex(vertices, lightTriangle, 0);
+        v1 = triangleVertex(vertices, lightTriangle, 1);
+        v2 = triangleVertex(vertices, lightTriangle, 2);
+        front = cross(v1 - v0, v2 - v0);
+    }
+    float3 lv0 = objectToWorldPoint(instance, v0);
+    float3 e01 = objectToWorldPoint(instance, v1) - lv0;
+    float3 e02 = objectToWorldPoint(instance, v2) - lv0;
+    *area = (light.triangle == LIGHT_WHOLE_SHAPE ? 1.0f : 0.5f) * length(cross(e01, e02));
+    // by the inverse transpose, so that the side agrees with Intersection::side
+    *normal = normalize(vec3(dot(instance->worldToObject[0], front), dot(instance->worldToObject[1], front),
+                             dot(instance->worldToObject[2], front)));
+    return lv0 + s * e01 + t * e02;
+}
+
+/**
+ * Decodes the bounds of a child of a quantized node.
+ */
+Bounds3 compressedChildBounds(__global const CompressedBVHNode *node, uint child) {
+    float3 origin = vec3(node->origin[0], node->origin[1], node->origin[2]);
+    float3 step = vec3(as_float((uint) node->exponent[0] << 23), as_float((uint) node->exponent[1] << 23),
+        as_float((uint) node->exponent[2] << 23));
+    Bounds3 bounds;
+    bounds.pMin = origin + step * vec3((float) node->childBounds[child][0][0], (float) node->childBounds[child][0][1],
+        (float) node->childBounds[child][0][2]);
+    bounds.pMax = origin + step * vec3((float) node->childBounds[child][1][0], (float) node->childBounds[child][1][1],
+        (float) node->childBounds[child][1][2]);
+    return bounds;
+}
+
+/**
+ * Index into {nodeIdx + 1, offset} (or CompressedBVHNode::child) of the child of an interior node that the ray
+ * enters last.
+ */
+int farChildSlot(Ray ray, uint dim) {
+    int sign[3];
+    sign[0] = ray.direction.x > 0;
+    sign[1] = ray.direction.y > 0;
+    sign[2] = ray.direction.z > 0;
+    return sign[dim & BVH_DIM_AXIS_MASK] ^ ((dim & BVH_DIM_SWAPPED) != 0);
+}
+
+void initShortStack(TRAVERSAL_STACK ShortStack *stack, uint root) {
+    stack->top = 0;
+    stack->size = 0;
+    stack->overflowed = 0;
+    stack->finished = root;
+}
+
+/**
+ * Pushes a far child, overwriting the oldest entry if the stack is full.
+ */
+void shortStackPush(TRAVERSAL_STACK ShortStack *stack, uint child, uint parent) {
+    uint slot = stack->top++ & (BVH_SHORT_STACK_SIZE - 1);
+    stack->child[slot] = child;
+    stack->parent[slot] = parent;
+    if (stack->size == BVH_SHORT_STACK_SIZE) {
+        stack->overflowed = 1;
+    } else {
+        ++stack->size;
+    }
+}
+
+bool shortStackPop(TRAVERSAL_STACK ShortStack *stack, uint *child) {
+    if (!stack->size) {
+        return false;
+    }
+    --stack->size;
+    uint slot = --stack->top & (BVH_SHORT_STACK_SIZE - 1);
+    *child = stack->child[slot];
+    // its sibling was visited first, so the parent's subtree is done once the stack runs empty
+    stack->finished = stack->parent[slot];
+    return true;
+}
+
+/**
+ * Continues a traversal whose stack ran empty after dropping entries. The far children of the ancestors of the
+ * last finished subtree whose near child lies on the way up are the ones not visited yet.
+ * @param next outputs the node to visit next
+ * @return false if the traversal is complete
+ */
+bool restartTraversal(TRAVERSAL_STACK ShortStack *stack, __global BVHNode *bvh, uint root, Ray ray, float maxT,
+                      uint *next) {
+    float tMin, tMax;
+    uint child = stack->finished;
+    while (child != root) {
+        uint parent = bvh[child].parent;
+        uint t[2] = {parent + 1, bvh[parent].offset};
+        int farSlot = farChildSlot(ray, bvh[parent].dim);
+        if (t[1 - farSlot] == child && boundsRayIntersects(ray, bvh[t[farSlot]].bounds, &tMin, &tMax) && tMin <= maxT) {
+            stack->finished = parent;
+            *next = t[farSlot];
+            return true;
+        }
+        child = parent;
+    }
+    return false;
+}
+
+/**
+ * Same as restartTraversal for quantized BVHs, `root` and the output are node indices and child references.
+ */
+bool restartCompressedTraversal(TRAVERSAL_STACK ShortStack *stack, __global CompressedBVHNode *bvh, uint root, Ray ray,
+                                float maxT, uint *next) {
+    float tMin, tMax;
+    uint child = stack->finished;
+    while (child != root) {
+        uint parent = bvh[child].parent;
+        __global const CompressedBVHNode *node = bvh + parent;
+        int farSlot = farChildSlot(ray, node->dim);
+        if (node->child[1 - farSlot] == child << BVH_CHILD_COUNT_BITS
+            && boundsRayIntersects(ray, compressedChildBounds(node, farSlot), &tMin, &tMax) && tMin <= maxT) {
+            stack->finished = parent;
+            *next = node->child[farSlot];
+            return true;
+        }
+        child = parent;
+    }
+    return false;
+}
+
+#ifdef QUANTIZED_BVH
+/**
+ * Finds the closest triangle hit closer than maxT in the quantized bottom-level BVH whose root is referenced by
+ * `root`. Child bounds are decoded from the parent, so leaves are tested without reading another node.
+ * @param anyHit stop at the first hit found instead, without writing output
+ * @param traversal counts short stack restarts
+ */
+bool bottomLevelIntersection(Ray ray, __global BottomLevelNode *bvh, uint root, __global Triangle *primitives,
+                             __global Vertex *vertices, float maxT, bool anyHit, Intersection *output,
+                             TraversalState *traversal) {
+    float tMin, tMax;
+#ifdef LOCAL_TRAVERSAL_KERNEL
+    __local ShortStack *stack = traversal->stacks + 1;
+#else
+    ShortStack bottomLevelStack;
+    ShortStack *stack = &bottomLevelStack;
+#endif
+    initShortStack(stack, root >> BVH_CHILD_COUNT_BITS);
+    uint reference = root;
     Intersection intersection;
-    float maxT = 1e20f;
-    float mss = 0.0f;
     bool hasIntersection = false;
-    while (stackSize) {
-        mss = max(mss, (float) stackSize);
-        uint nodeIdx = stack[--stackSize];
+    while (true) {
+        uint count = reference & BVH_CHILD_COUNT_MASK;
+        if (count && anyHit) {
+            if (leafOccludes(ray, primitives, vertices, reference >> BVH_CHILD_COUNT_BITS, count, maxT)) {
+                return true;
+            }
+        } else if (count) {
+            if (intersectLeaf(ray, primitives, vertices, reference >> BVH_CHILD_COUNT_BITS, count, maxT,
+                              &intersection)) {
+                maxT = intersection.distance;
+                *output = intersection;
+                hasIntersection = true;
+            }
+        } else {
+            uint nodeIdx = reference >> BVH_CHILD_COUNT_BITS;
+            __global const CompressedBVHNode *node = bvh + nodeIdx;
+            int farSlot = farChildSlot(ray, node->dim);
+            bool hitNear = boundsRayIntersects(ray, compressedChildBounds(node, 1 - farSlot), &tMin, &tMax)
+                           && tMin <= maxT;
+            bool hitFar = boundsRayIntersects(ray, compressedChildBounds(node, farSlot), &tMin, &tMax) && tMin <= maxT;
+            if (hitNear) {
+                if (hitFar) {
+                    shortStackPush(stack, node->child[farSlot], nodeIdx);
+                }
+                reference = node->child[1 - farSlot];
+                continue;
+            }
+            if (hitFar) {
+                reference = node->child[farSlot];
+                continue;
+            }
+        }
+        if (!shortStackPop(stack, &reference)) {
+            if (!stack->overflowed
+                || !restartCompressedTraversal(stack, bvh, root >> BVH_CHILD_COUNT_BITS, ray, maxT, &reference)) {
+                break;
+            }
+            ++traversal->restarts;
+        }
+    }
+    return hasIntersection;
+}
+#else
+/**
+ * Finds the closest triangle hit closer than maxT in the bottom-level BVH rooted at `root`.
+ * @param anyHit stop at the first hit found instead, without writing output
+ * @param traversal counts short stack restarts
+ */
+bool bottomLevelIntersection(Ray ray, __global BottomLevelNode *bvh, uint root, __global Triangle *primitives,
+                             __global Vertex *vertices, float maxT, bool anyHit, Intersection *output,
+                             TraversalState *traversal) {
+    float tMin, tMax;
+    if (!boundsRayIntersects(ray, bvh[root].bounds, &tMin, &tMax) || tMin > maxT) {
+        return false;
+    }
+#ifdef LOCAL_TRAVERSAL_KERNEL
+    __local ShortStack *stack = traversal->stacks + 1;
+#else
+    ShortStack bottomLevelStack;
+    ShortStack *stack = &bottomLevelStack;
+#endif
+    initShortStack(stack, root);
+    uint nodeIdx = root;
+    Intersection intersection;
+    bool hasIntersection = false;
+    while (true) {
         BVHNode node = bvh[nodeIdx];
-        if (node.isLeaf) {
-            if (intersect(ray, primitives[node.offset], &intersection)) {
-                if (intersection.distance < 1e-5f) {
+        if (node.primitiveCount && anyHit) {
+            if (leafOccludes(ray, primitives, vertices, node.offset, node.primitiveCount, maxT)) {
+                return true;
+            }
+        } else if (node.primitiveCount) {
+            if (intersectLeaf(ray, primitives, vertices, node.offset, node.primitiveCount, maxT, &intersection)) {
+                maxT = intersection.distance;
+                *output = intersection;
+                hasIntersection = true;
+            }
+        } else {
+            uint t[2] = {nodeIdx + 1, node.offset};
+            int farSlot = farChildSlot(ray, node.dim);
+            bool hitNear = boundsRayIntersects(ray, bvh[t[1 - farSlot]].bounds, &tMin, &tMax) && tMin <= maxT;
+            bool hitFar = boundsRayIntersects(ray, bvh[t[farSlot]].bounds, &tMin, &tMax) && tMin <= maxT;
+            if (hitNear) {
+                if (hitFar) {
+                    shortStackPush(stack, t[farSlot], nodeIdx);
+                }
+                nodeIdx = t[1 - farSlot];
+                continue;
+            }
+            if (hitFar) {
+                nodeIdx = t[farSlot];
+                continue;
+            }
+        }
+        if (!shortStackPop(stack, &nodeIdx)) {
+            if (!stack->overflowed || !restartTraversal(stack, bvh, root, ray, maxT, &nodeIdx)) {
+                break;
+            }
+            ++traversal->restarts;
+        }
+    }
+    return hasIntersection;
+}
+#endif
 
-                } else if (intersection.distance < maxT) {
+/**
+ * Reads a node of the top-level BVH, from the copy in local memory if the work-group staged it there.
+ */
+BVHNode topLevelNode(__global BVHNode *tlas, TraversalState *traversal, uint index) {
+#ifdef LOCAL_TRAVERSAL_KERNEL
+    if (index < traversal->tlasCacheSize) {
+        return traversal->tlasCache[index];
+    }
+#endif
+    return tlas[index];
+}
+
+/**
+ * Traces a ray through the scene: the top-level BVH over the instances is traversed in world space, the
+ * bottom-level BVH of every instance it reaches in object space.
+ * @param maxT only hits closer than this are considered
+ * @param anyHit stop at the first hit found instead of the closest one, without writing output
+ * @param traversal counts short stack restarts
+ */
+bool sceneIntersection(Ray ray, float maxT, bool anyHit, __global BVHNode *tlas,
+                       __global RayTracingInstance *instances, __global BottomLevelNode *bvh,
+                       __global Triangle *primitives, __global Vertex *vertices, Intersection *output,
+                       TraversalState *traversal) {
+    float tMin, tMax;
+    // also rejects the placeholder root of an empty scene
+    if (!boundsRayIntersects(ray, topLevelNode(tlas, traversal, 0).bounds, &tMin, &tMax) || tMin > maxT) {
+        return false;
+    }
+#ifdef LOCAL_TRAVERSAL_KERNEL
+    __local ShortStack *stack = traversal->stacks;
+#else
+    ShortStack topLevelStack;
+    ShortStack *stack = &topLevelStack;
+#endif
+    initShortStack(stack, 0);
+    uint nodeIdx = 0;
+    Intersection intersection;
+    bool hasIntersection = false;
+    while (true) {
+        BVHNode node = topLevelNode(tlas, traversal, nodeIdx);
+        if (node.primitiveCount) {
+            for (uint i = node.offset; i < node.offset + node.primitiveCount; ++i) {
+                Ray objectRay = worldToObjectRay(instances + i, ray);
+#ifdef QUANTIZED_BVH
+                uint root = instances[i].compressedRoot;
+#else
+                uint root = instances[i].bvhRoot;
+#endif
+                bool hit = instances[i].shape == SHAPE_MESH
+                           ? bottomLevelIntersection(objectRay, bvh, root, primitives, vertices, maxT, anyHit,
+                                                     &intersection, traversal)
+                           : intersectShape(objectRay, instances + i, maxT, &intersection);
+                if (hit) {
+                    if (anyHit) {
+                        return true;
+                    }
                     maxT = intersection.distance;
-                    intersection.index = node.offset;
-                    intersection.position = ray.origin + ray.direction * intersection.distance;
+                    intersection.instance = i;
+                    intersection.position = ray.origin + maxT * ray.direction;
                     *output = intersection;
                     hasIntersection = true;
                 }
             }
         } else {
-            int sign[3];
-            sign[0] = ray.direction.x > 0;
-            sign[1] = ray.direction.y > 0;
-            sign[2] = ray.direction.z > 0;
-
             uint t[2] = {nodeIdx + 1, node.offset};
-            float tMin, tMax;
-            if (boundsRayIntersects(ray, bvh[t[sign[node.dim]]].bounds, &tMin, &tMax)) {
-                if (tMin <= maxT) {
-                    stack[stackSize++] = t[sign[node.dim]];
+            int farSlot = farChildSlot(ray, node.dim);
+            bool hitNear = boundsRayIntersects(ray, topLevelNode(tlas, traversal, t[1 - farSlot]).bounds, &tMin, &tMax)
+                           && tMin <= maxT;
+            bool hitFar = boundsRayIntersects(ray, topLevelNode(tlas, traversal, t[farSlot]).bounds, &tMin, &tMax)
+                          && tMin <= maxT;
+            if (hitNear) {
+                if (hitFar) {
+                    shortStackPush(stack, t[farSlot], nodeIdx);
                 }
+                nodeIdx = t[1 - farSlot];
+                continue;
             }
-            if (boundsRayIntersects(ray, bvh[t[1 - sign[node.dim]]].bounds, &tMin, &tMax)) {
-                if (tMin <= maxT) {
-                    stack[stackSize++] = t[1 - sign[node.dim]];
-                }
+            if (hitFar) {
+                nodeIdx = t[farSlot];
+                continue;
             }
         }
-        if (stackSize >= 63) {
-            // prevent stack overflow
-            break;
+        if (!shortStackPop(stack, &nodeIdx)) {
+            if (!stack->overflowed || !restartTraversal(stack, tlas, 0, ray, maxT, &nodeIdx)) {
+                break;
+            }
+            ++traversal->restarts;
         }
     }
-    output->padding = mss;
-
     return hasIntersection;
 }
 
+/**
+ * Finds the closest hit in the scene.
+ * @param traversal counts short stack restarts
+ */
+bool firstIntersection(Ray ray, __global BVHNode *tlas, __global RayTracingInstance *instances,
+                       __global BottomLevelNode *bvh, __global Triangle *primitives, __global Vertex *vertices,
+                       Intersection *output, TraversalState *traversal) {
+#ifdef __cplusplus
+    if (cg::activeWideBVHScene) {
+        return cg::activeWideBVHScene->firstIntersection(ray, instances, primitives, vertices, output);
+    }
+#endif
+    return sceneIntersection(ray, 1e20f, false, tlas, instances, bvh, primitives, vertices, output, traversal);
+}
+
+/**
+ * firstIntersection for the camera ray of a sample. The CPU renderer may have traced it ahead, in a packet with the
+ * rays of the neighbouring pixels.
+ * @param rayId index of the ray in the rays passed to render_kernel
+ */
+bool cameraRayIntersection(uint rayId, Ray ray, __global BVHNode *tlas, __global RayTracingInstance *instances,
+                           __global BottomLevelNode *bvh, __global Triangle *primitives, __global Vertex *vertices,
+                           Intersection *output, TraversalState *traversal) {
+#ifdef __cplusplus
+    if (cg::activePrimaryRayHits) {
+        *output = cg::activePrimaryRayHits->intersections[rayId];
+        return cg::activePrimaryRayHits->hits[rayId];
+    }
+#endif
+    return firstIntersection(ray, tlas, instances, bvh, primitives, vertices, output, traversal);
+}
+
+/**
+ * Checks whether anything blocks a ray before maxT, for shadow rays. Stops at the first hit found.
+ * @param traversal counts short stack restarts
+ */
+bool occluded(Ray ray, float maxT, __global BVHNode *tlas, __global RayTracingInstance *instances,
+              __global BottomLevelNode *bvh, __global Triangle *primitives, __global Vertex *vertices,
+              TraversalState *traversal) {
+#ifdef __cplusplus
+    if (cg::activeWideBVHScene) {
+        return cg::activeWideBVHScene->occluded(ray, maxT, instances, primitives, vertices);
+    }
+#endif
+    Intersection unused;
+    return sceneIntersection(ray, maxT, true, tlas, instances, bvh, primitives, vertices, &unused, traversal);
+}
+
 void sample(float u, int width, int *x0, int *x1, float *p) {
     u = u - floor(u);
     float x = u * (float) width - 0.5f;
@@ -227,38 +1141,525 @@ __kernel void raygeneration_kernel(
 }
 
 __kernel void clear_kernel(
-    __global float4 *output, uint width, uint height
+    __global float4 *output, __global float *moments, __global float4 *albedo, __global float4 *normalDepth,
+    uint width, uint height
 ) {
     output[get_global_id(0)] = vec4(0.0f, 0.0f, 0.0f, 0.0f);
+    moments[get_global_id(0)] = 0.0f;
+    albedo[get_global_id(0)] = vec4(0.0f, 0.0f, 0.0f, 0.0f);
+    normalDepth[get_global_id(0)] = vec4(0.0f, 0.0f, 0.0f, 0.0f);
 }
 
+/**
+ * Averages the accumulated radiance of every pixel over its own sample count, which render_kernel keeps in w.
+ */
 __kernel void accumulate_kernel(
-    __global float4 *input, uint width, uint height, uint spp,
+    __global float4 *input, uint width, uint height,
     __global float4 *output
 ) {
     const uint pixel_id = get_global_id(0);
-    output[pixel_id] = input[pixel_id] / (float) spp;
+    float4 sum = input[pixel_id];
+    output[pixel_id] = sum.w > 0.0f ? sum / sum.w : vec4(0.0f, 0.0f, 0.0f, 0.0f);
+}
+
+/**
+ * Error of the accumulated image in a tile of ADAPTIVE_TILE_SIZE pixels, tiles are numbered row by row, that of its
+ * worst pixel. The error of a pixel is the standard error of its mean luminance over the square root of the
+ * luminance: relative errors would keep dark pixels with rare bright paths sampling forever, absolute ones would stop
+ * dark regions right away.
+ * @param moments per pixel sum of the squared luminance of the samples
+ * @param maxSamples tiles with this many samples report 0, 0 for no limit
+ * @param tileErrors INFINITY until every pixel of the tile has ADAPTIVE_MIN_SAMPLES samples
+ */
+__kernel void tile_error_kernel(
+    __global const float4 *accumulated, __global const float *moments, uint width, uint height, uint maxSamples,
+    __global float *tileErrors
+) {
+    const uint tile = get_global_id(0);
+    uint tilesX = (width + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE;
+    uint x0 = tile % tilesX * ADAPTIVE_TILE_SIZE, y0 = tile / tilesX * ADAPTIVE_TILE_SIZE;
+    // the pixels of a tile are sampled together, so they all have the same count
+    float n = accumulated[y0 * width + x0].w;
+    if (maxSamples && n >= (float) maxSamples) {
+        tileErrors[tile] = 0.0f;
+        return;
+    }
+    if (n < (float) ADAPTIVE_MIN_SAMPLES) {
+        tileErrors[tile] = INFINITY;
+        return;
+    }
+    float error = 0.0f;
+    for (uint y = y0; y < min(y0 + ADAPTIVE_TILE_SIZE, height); ++y) {
+        for (uint x = x0; x < min(x0 + ADAPTIVE_TILE_SIZE, width); ++x) {
+            float4 sum = accumulated[y * width + x];
+            float mean = luminance(vec3(sum.x, sum.y, sum.z)) / n;
+            float variance = max(0.0f, moments[y * width + x] / n - mean * mean) * n / (n - 1.0f);
+            error = max(error, sqrt(variance / n / max(mean, ADAPTIVE_LUMINANCE_FLOOR)));
+        }
+    }
+    tileErrors[tile] = error;
+}
+
+/**
+ * Variance of the mean luminance of every pixel, which denoise_kernel compares colors against. The first frames have
+ * too few samples per pixel for an estimate of their own, so the samples of the 3x3 pixels around are pooled.
+ * @param moments per pixel sum of the squared luminance of the samples
+ */
+__kernel void denoise_variance_kernel(
+    __global const float4 *accumulated, __global const float *moments, uint width, uint height,
+    __global float *variance
+) {
+    const uint pixelId = get_global_id(0);
+    int x = (int) (pixelId % width), y = (int) (pixelId / width);
+    float n = 0.0f, sum = 0.0f, squares = 0.0f;
+    for (int qy = max(y - 1, 0); qy <= min(y + 1, (int) height - 1); ++qy) {
+        for (int qx = max(x - 1, 0); qx <= min(x + 1, (int) width - 1); ++qx) {
+            float4 q = accumulated[qy * width + qx];
+            n += q.w;
+            sum += luminance(vec3(q.x, q.y, q.z));
+            squares += moments[qy * width + qx];
+        }
+    }
+    float samples = accumulated[pixelId].w;
+    float mean = sum / n;
+    variance[pixelId] = n > 1.0f && samples > 0.0f
+                        ? max(0.0f, squares / n - mean * mean) * n / (n - 1.0f) / samples : 0.0f;
+}
+
+/**
+ * One pass of the edge-avoiding a-trous wavelet filter of the denoiser. The 5x5 B3 spline kernel has its taps step
+ * pixels apart, and each tap is weighted down where the first hit differs from that of the pixel in normal, depth or
+ * albedo, or its color differs by more than the noise of the pixel. The passes are run with steps 1, 2, 4, ..., so
+ * that they blur a wide region with few taps.
+ * @param accumulated render_kernel output, the AOV sums are averaged over its sample counts
+ * @param albedo first hit albedo sums of render_kernel
+ * @param normalDepth first hit normal and distance sums of render_kernel
+ * @param input color of the previous pass, or the accumulated image
+ * @param variance variance of the luminance of input, see denoise_variance_kernel
+ * @param filteredVariance variance of the luminance of output, for the next pass
+ */
+__kernel void denoise_kernel(
+    __global const float4 *accumulated, __global const float4 *albedo, __global const float4 *normalDepth,
+    __global const float4 *input, __global const float *variance, uint width, uint height, uint step,
+    __global float4 *output, __global float *filteredVariance
+) {
+    const uint pixelId = get_global_id(0);
+    int x = (int) (pixelId % width), y = (int) (pixelId / width);
+    float n = accumulated[pixelId].w;
+    float4 guide = normalDepth[pixelId] / max(n, 1.0f);
+    // pixels whose camera rays missed have no surface to compare against
+    if (guide.w == 0.0f) {
+        output[pixelId] = input[pixelId];
+        filteredVariance[pixelId] = variance[pixelId];
+        return;
+    }
+    float3 normal = vec3(guide.x, guide.y, guide.z);
+    float depth = guide.w;
+    float4 a = albedo[pixelId] / n;
+    float3 color = vec3(a.x, a.y, a.z);
+    float4 c = input[pixelId];
+    float centerLuminance = luminance(vec3(c.x, c.y, c.z));
+    float luminanceSigma = DENOISE_SIGMA_LUMINANCE * sqrt(variance[pixelId]) + 1e-4f;
+    const float spline[3] = {3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+    float3 sum = vec3(0.0f);
+    float weightSum = 0.0f;
+    float varianceSum = 0.0f;
+    for (int dy = -2; dy <= 2; ++dy) {
+        for (int dx = -2; dx <= 2; ++dx) {
+            int qx = x + dx * (int) step, qy = y + dy * (int) step;
+            if (qx < 0 || qy < 0 || qx >= (int) width || qy >= (int) height) {
+                continue;
+            }
+            uint q = qy * width + qx;
+            float m = accumulated[q].w;
+            float4 qGuide = normalDepth[q] / max(m, 1.0f);
+            float4 qAlbedo = albedo[q] / max(m, 1.0f);
+            float4 qColor = input[q];
+            float weight = spline[abs(dx)] * spline[abs(dy)];
+            if (q != pixelId) {
+                float offset = (float) step * sqrt((float) (dx * dx + dy * dy));
+                // the product of the edge-stopping functions, with a single exp
+                weight *= exp(DENOISE_SIGMA_NORMAL * log(max(0.0f, dot(normal, vec3(qGuide.x, qGuide.y, qGuide.z))))
+                              - fabs(qGuide.w - depth) / (DENOISE_SIGMA_DEPTH * depth * offset)
+                              - length(vec3(qAlbedo.x, qAlbedo.y, qAlbedo.z) - color) / DENOISE_SIGMA_ALBEDO
+                              - fabs(luminance(vec3(qColor.x, qColor.y, qColor.z)) - centerLuminance)
+                                / luminanceSigma);
+            }
+            sum += weight * vec3(qColor.x, qColor.y, qColor.z);
+            weightSum += weight;
+            varianceSum += weight * weight * variance[q];
+        }
+    }
+    sum = sum / weightSum;
+    output[pixelId] = vec4(sum.x, sum.y, sum.z, 1.0f);
+    filteredVariance[pixelId] = varianceSum / (weightSum * weightSum);
+}
+
+#ifdef LOCAL_TRAVERSAL_KERNEL
+/**
+ * All rays enter the scene through the top of the top-level BVH, so the work-group reads it from global memory once.
+ * Every work item must call this before any of them leaves the kernel, because of the barrier.
+ */
+void initLocalTraversal(TraversalState *traversal, __local BVHNode *tlasCache, __local ShortStack *stacks,
+                        __global BVHNode *tlas, uint tlasSize) {
+    traversal->tlasCacheSize = min(tlasSize, (uint) LOCAL_TLAS_NODES);
+    for (uint i = get_local_id(0); i < traversal->tlasCacheSize; i += RENDER_WORK_GROUP_SIZE) {
+        tlasCache[i] = tlas[i];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    traversal->tlasCache = tlasCache;
+    traversal->stacks = stacks + 2 * get_local_id(0);
+}
+#endif
+
+/**
+ * Checks whether a point on a light is hidden from a shading point.
+ */
+bool lightPointOccluded(float3 pos, float3 lightPos, __global BVHNode *tlas, __global RayTracingInstance *instances,
+                        __global BottomLevelNode *bvh, __global Triangle *triangles, __global Vertex *vertices,
+                        TraversalState *traversal) {
+    Ray lightRay;
+    lightRay.origin = pos;
+    lightRay.direction = normalize(lightPos - pos);
+    // stop short of the light, so that its own triangle does not occlude the sample
+    return occluded(lightRay, length(lightPos - pos) * (1.0f - SHADOW_RAY_EPSILON), tlas, instances, bvh, triangles,
+                    vertices, traversal);
+}
+
+/**
+ * Light that a point on an emitter sends off a surface towards the camera, per unit area of the emitter and without
+ * visibility. Zero unless the surface and the emitting side of the light face each other.
+ */
+float3 restirIntegrand(ReservoirSurface surface, float3 lightPosition, float3 lightNormal, float3 emission) {
+    float3 toLight = lightPosition - surface.position;
+    float distance2 = dot(toLight, toLight);
+    if (!(distance2 > 0.0f)) return vec3(0.0f);
+    float3 wi = toLight / sqrt(distance2);
+    float cosSurface = dot(surface.normal, wi);
+    float cosLight = -dot(lightNormal, wi);
+    if (cosSurface <= 0.0f || cosLight <= 0.0f) return vec3(0.0f);
+    return emission * MixedBRDF(wi, surface.wo, surface.normal, surface.roughness, surface.diffuseColor,
+        surface.specularF0, surface.specTrans, surface.eta) * cosSurface * cosLight / distance2;
+}
+
+/**
+ * Target function that reservoirs resample towards, the luminance of restirIntegrand for their selected sample.
+ */
+float restirTargetPdf(ReservoirSurface surface, Reservoir sample) {
+    if (!(surface.distance > 0.0f)) return 0.0f;
+    return luminance(restirIntegrand(surface, sample.lightPosition, sample.lightNormal, sample.emission));
+}
+
+/**
+ * Whether the reservoir of a surface is reused at another, which only works for similar BSDFs and geometry.
+ */
+bool restirSimilar(ReservoirSurface a, ReservoirSurface b) {
+    return a.distance > 0.0f && b.distance > 0.0f && dot(a.normal, b.normal) > RESTIR_NORMAL_THRESHOLD
+           && fabs(a.distance - b.distance) < RESTIR_DEPTH_THRESHOLD * a.distance;
+}
+
+void clearReservoir(Reservoir *reservoir) {
+    reservoir->lightPosition = vec3(0.0f);
+    reservoir->lightNormal = vec3(0.0f);
+    reservoir->emission = vec3(0.0f);
+    reservoir->weightSum = 0.0f;
+    reservoir->M = 0.0f;
+    reservoir->W = 0.0f;
+    reservoir->padding = 0.0f;
+}
+
+/**
+ * Streams a candidate into a reservoir, it replaces the selected sample with probability weight / weightSum.
+ * @param sample the candidate in the sample fields, the rest is ignored
+ */
+void restirUpdate(Reservoir *reservoir, Reservoir sample, float weight, ulong *seed) {
+    reservoir->weightSum += weight;
+    if (weight > 0.0f && randomFloat(seed) * reservoir->weightSum < weight) {
+        reservoir->lightPosition = sample.lightPosition;
+        reservoir->lightNormal = sample.lightNormal;
+        reservoir->emission = sample.emission;
+    }
 }
 
-__kernel void render_kernel(
-    __global float4 *output, uint width, uint height,
-    __global BVHNode *bvh, __global Triangle *triangles,
+/**
+ * Resamples the selected sample of another reservoir into one for a surface, the merged reservoir has seen the
+ * candidates of both.
+ * @param M candidates the other reservoir counts for, at most its own M
+ */
+void restirMerge(Reservoir *reservoir, ReservoirSurface surface, Reservoir other, float M, ulong *seed) {
+    restirUpdate(reservoir, other, restirTargetPdf(surface, other) * other.W * M, seed);
+    reservoir->M += M;
+}
+
+/**
+ * Sets the contribution weight of a reservoir for its surface.
+ * @param Z candidates of the merged reservoirs whose surfaces could have produced the selected sample, see
+ * restirSeesSample. Dividing by these instead of M keeps reuse between surfaces unbiased
+ */
+void restirFinalize(Reservoir *reservoir, ReservoirSurface surface, float Z) {
+    float targetPdf = restirTargetPdf(surface, *reservoir);
+    reservoir->W = targetPdf > 0.0f && Z > 0.0f ? reservoir->weightSum / (Z * targetPdf) : 0.0f;
+}
+
+/**
+ * Checks whether the reservoir of a surface could have selected the sample of another one. Occluded samples are
+ * dropped, so this takes a nonzero target pdf and a shadow ray.
+ */
+bool restirSeesSample(ReservoirSurface surface, Reservoir reservoir, __global BVHNode *tlas,
+                      __global RayTracingInstance *instances, __global BottomLevelNode *bvh,
+                      __global Triangle *triangles, __global Vertex *vertices, TraversalState *traversal) {
+    return restirTargetPdf(surface, reservoir) > 0.0f
+           && !lightPointOccluded(surface.position, reservoir.lightPosition, tlas, instances, bvh, triangles, vertices,
+                                  traversal);
+}
+
+/**
+ * First pass of LIGHT_SAMPLING_RESTIR. Finds the first surface seen through a pixel, streams RESTIR_CANDIDATES
+ * points on lights picked from the light BVH into its reservoir and drops the selected one if it is occluded. Then
+ * resamples it together with the reservoir the pixel ended the previous frame with.
+ * @param history restir_spatial_kernel output of the previous frame
+ * @param temporalReuse 0 if the history is invalid, after the camera or the scene changed
+ */
+__kernel
+#ifdef LOCAL_TRAVERSAL_KERNEL
+__attribute__((reqd_work_group_size(RENDER_WORK_GROUP_SIZE, 1, 1)))
+#endif
+void restir_initial_kernel(
+    uint width, uint height,
+    __global BVHNode *tlas, uint tlasSize, __global RayTracingInstance *instances,
+    __global BottomLevelNode *bvh, __global Triangle *triangles,
+    __global Vertex *vertices, __global VertexShading *vertexShading,
     __global RayTracingMaterial *materials,
     __global RayTracingTextureRange *textures, __global float4 *textureImage,
-    __global const uint *lights, uint lightCount,
-    __global float3 *rays, float3 cameraPosition, uint bounces,
-    __global ulong *globalSeed, uint spp
+    __global const RayTracingLight *lights, __global const LightBVHNode *lightTree,
+    __global float3 *rays, float3 cameraPosition, uint spp,
+    __global ulong *globalSeed,
+    __global ReservoirSurface *surfaces, __global Reservoir *reservoirs, __global const Reservoir *history,
+    uint temporalReuse, __global uint *traversalRestarts
+) {
+    const uint pixelId = get_global_id(0);
+    TraversalState traversal;
+    traversal.restarts = 0;
+#ifdef LOCAL_TRAVERSAL_KERNEL
+    __local BVHNode tlasCache[LOCAL_TLAS_NODES];
+    __local ShortStack stacks[2 * RENDER_WORK_GROUP_SIZE];
+    initLocalTraversal(&traversal, tlasCache, stacks, tlas, tlasSize);
+    // the global size is rounded up to whole work-groups
+    if (pixelId >= width * height) {
+        return;
+    }
+#endif
+    ulong seed = globalSeed[pixelId];
+    ReservoirSurface previousSurface = surfaces[pixelId];
+    ReservoirSurface surface;
+    surface.distance = 0.0f;
+    Reservoir reservoir;
+    clearReservoir(&reservoir);
+
+    // all samples of the pixel start with its first camera ray in this mode, see render_kernel
+    Ray ray;
+    ray.origin = cameraPosition;
+    ray.direction = rays[pixelId * spp];
+    Intersection intersection;
+    if (cameraRayIntersection(pixelId * spp, ray, tlas, instances, bvh, triangles, vertices, &intersection,
+                              &traversal)) {
+        __global RayTracingInstance *instance = instances + intersection.instance;
+        float2 texcoord;
+        float3 normal = hitNormal(instance, triangles, vertexShading, &intersection, &texcoord);
+        RayTracingMaterial material = evaluateMaterial(materials + instance->mtlIndex, textures, textureImage,
+            texcoord);
+        float metallicChance = clamp(material.metallic, 0.0f, 1.0f);
+        float diffuseChance = 1.0f - metallicChance - (1.0f - metallicChance) * material.specTrans;
+        // delta lobes are left to the BSDF samples of render_kernel
+        if (diffuseChance + (material.roughness == 0.0f ? 0.0f : metallicChance) > 0.0f) {
+            surface.position = intersection.position;
+            surface.normal = normal;
+            surface.wo = -ray.direction;
+            surface.diffuseColor = material.albedo * (1.0f - material.metallic);
+            surface.specularF0 = mix(vec3(0.04f), material.albedo, material.metallic);
+            surface.roughness = material.roughness;
+            surface.specTrans = material.specTrans;
+            surface.eta = intersection.side ? material.ior : 1.0f / material.ior;
+            surface.distance = intersection.distance;
+
+            for (uint c = 0; c < RESTIR_CANDIDATES; ++c) {
+                uint light;
+                float lightPmf;
+                if (!sampleLightTree(lightTree, surface.position, normal, &seed, &light, &lightPmf)) {
+                    continue;
+                }
+                Reservoir candidate;
+                clearReservoir(&candidate);
+                float area;
+                candidate.lightPosition = sampleLightPoint(lights[light], instances + lights[light].instance,
+                    triangles, vertices, &seed, &candidate.lightNormal, &area);
+                candidate.emission = materials[instances[lights[light].instance].mtlIndex].emission;
+                // over the area density lightPmf / area the candidate was drawn with
+                restirUpdate(&reservoir, candidate, restirTargetPdf(surface, candidate) * area / lightPmf, &seed);
+            }
+            reservoir.M = RESTIR_CANDIDATES;
+            restirFinalize(&reservoir, surface, reservoir.M);
+            // occluded samples are dropped before they are reused, so that they do not spread as darkness
+            if (reservoir.W > 0.0f && lightPointOccluded(surface.position, reservoir.lightPosition, tlas, instances,
+                                                         bvh, triangles, vertices, &traversal)) {
+                reservoir.W = 0.0f;
+            }
+
+            if (temporalReuse && restirSimilar(surface, previousSurface)) {
+                Reservoir current = reservoir;
+                Reservoir previous = history[pixelId];
+                // bounded, so that the history follows moving lights and changing visibility
+                float previousM = min(previous.M, (float) (RESTIR_HISTORY_LIMIT * RESTIR_CANDIDATES));
+                clearReservoir(&reservoir);
+                restirMerge(&reservoir, surface, current, current.M, &seed);
+                restirMerge(&reservoir, surface, previous, previousM, &seed);
+                // a sample the surface does not see is dropped, as above
+                float Z = 0.0f;
+                if (restirSeesSample(surface, reservoir, tlas, instances, bvh, triangles, vertices, &traversal)) {
+                    Z = current.M;
+                    if (restirSeesSample(previousSurface, reservoir, tlas, instances, bvh, triangles, vertices,
+                                         &traversal)) {
+                        Z += previousM;
+                    }
+                }
+                restirFinalize(&reservoir, surface, Z);
+            }
+        }
+    }
+    surfaces[pixelId] = surface;
+    reservoirs[pixelId] = reservoir;
+    globalSeed[pixelId] = seed;
+    if (traversal.restarts) {
+        atomic_add(traversalRestarts, traversal.restarts);
+    }
+}
+
+/**
+ * Second pass of LIGHT_SAMPLING_RESTIR. Resamples the reservoir of a pixel together with those of
+ * RESTIR_SPATIAL_SAMPLES random pixels nearby whose surfaces are similar. render_kernel shades the result, and it is
+ * the history of the next frame. The pixel and its neighbors only count towards the normalization if they see the
+ * selected sample, which takes a shadow ray each.
+ */
+__kernel
+#ifdef LOCAL_TRAVERSAL_KERNEL
+__attribute__((reqd_work_group_size(RENDER_WORK_GROUP_SIZE, 1, 1)))
+#endif
+void restir_spatial_kernel(
+    uint width, uint height,
+    __global BVHNode *tlas, uint tlasSize, __global RayTracingInstance *instances,
+    __global BottomLevelNode *bvh, __global Triangle *triangles, __global Vertex *vertices,
+    __global ulong *globalSeed,
+    __global const ReservoirSurface *surfaces, __global const Reservoir *reservoirs, __global Reservoir *finalReservoirs,
+    __global uint *traversalRestarts
 ) {
     const uint pixelId = get_global_id(0);
+    TraversalState traversal;
+    traversal.restarts = 0;
+#ifdef LOCAL_TRAVERSAL_KERNEL
+    __local BVHNode tlasCache[LOCAL_TLAS_NODES];
+    __local ShortStack stacks[2 * RENDER_WORK_GROUP_SIZE];
+    initLocalTraversal(&traversal, tlasCache, stacks, tlas, tlasSize);
+    // the global size is rounded up to whole work-groups
+    if (pixelId >= width * height) {
+        return;
+    }
+#endif
+    ReservoirSurface surface = surfaces[pixelId];
+    if (!(surface.distance > 0.0f)) {
+        finalReservoirs[pixelId] = reservoirs[pixelId];
+        return;
+    }
+    ulong seed = globalSeed[pixelId];
+    Reservoir reservoir;
+    clearReservoir(&reservoir);
+    restirMerge(&reservoir, surface, reservoirs[pixelId], reservoirs[pixelId].M, &seed);
+    uint neighbors[RESTIR_SPATIAL_SAMPLES];
+    uint neighborCount = 0;
+    int x = (int) (pixelId % width), y = (int) (pixelId / width);
+    for (uint k = 0; k < RESTIR_SPATIAL_SAMPLES; ++k) {
+        // uniformly on a disk around the pixel
+        float radius = RESTIR_SPATIAL_RADIUS * sqrt(randomFloat(&seed));
+        float angle = 2.0f * RT_M_PI_F * randomFloat(&seed);
+        int nx = x + (int) floor(radius * cos(angle) + 0.5f);
+        int ny = y + (int) floor(radius * sin(angle) + 0.5f);
+        if (nx < 0 || ny < 0 || nx >= (int) width || ny >= (int) height || (nx == x && ny == y)) {
+            continue;
+        }
+        uint neighbor = (uint) ny * width + (uint) nx;
+        if (!restirSimilar(surface, surfaces[neighbor])) {
+            continue;
+        }
+        restirMerge(&reservoir, surface, reservoirs[neighbor], reservoirs[neighbor].M, &seed);
+        neighbors[neighborCount++] = neighbor;
+    }
+    // a sample the surface does not see is dropped, so that no reservoir holds one its surface could not produce
+    float Z = 0.0f;
+    if (restirSeesSample(surface, reservoir, tlas, instances, bvh, triangles, vertices, &traversal)) {
+        Z = reservoirs[pixelId].M;
+        for (uint k = 0; k < neighborCount; ++k) {
+            if (restirSeesSample(surfaces[neighbors[k]], reservoir, tlas, instances, bvh, triangles, vertices,
+                                 &traversal)) {
+                Z += reservoirs[neighbors[k]].M;
+            }
+        }
+    }
+    restirFinalize(&reservoir, surface, Z);
+    finalReservoirs[pixelId] = reservoir;
+    globalSeed[pixelId] = seed;
+    if (traversal.restarts) {
+        atomic_add(traversalRestarts, traversal.restarts);
+    }
+}
+
+__kernel
+#ifdef LOCAL_TRAVERSAL_KERNEL
+__attribute__((reqd_work_group_size(RENDER_WORK_GROUP_SIZE, 1, 1)))
+#endif
+void render_kernel(
+    __global float4 *output, __global float *moments, __global float4 *albedo, __global float4 *normalDepth,
+    uint writeAOVs, uint width, uint height,
+    __global const uint *pixels, uint pixelCount,
+    __global BVHNode *tlas, uint tlasSize, __global RayTracingInstance *instances,
+    __global BottomLevelNode *bvh, __global Triangle *triangles,
+    __global Vertex *vertices, __global VertexShading *vertexShading,
+    __global RayTracingMaterial *materials,
+    __global RayTracingTextureRange *textures, __global float4 *textureImage,
+    __global const RayTracingLight *lights, uint lightCount, __global const LightBVHNode *lightTree,
+    __global float3 *rays, float3 cameraPosition, uint bounces, uint lightSampling,
+    __global const Reservoir *reservoirs, __global ulong *globalSeed, uint spp,
+    __global uint *traversalRestarts
+) {
+    TraversalState traversal;
+    traversal.restarts = 0;
+#ifdef LOCAL_TRAVERSAL_KERNEL
+    __local BVHNode tlasCache[LOCAL_TLAS_NODES];
+    __local ShortStack stacks[2 * RENDER_WORK_GROUP_SIZE];
+    initLocalTraversal(&traversal, tlasCache, stacks, tlas, tlasSize);
+    // the global size is rounded up to whole work-groups
+    if (get_global_id(0) >= pixelCount) {
+        return;
+    }
+#endif
+    const uint pixelId = pixels[get_global_id(0)];
     ulong seed = globalSeed[pixelId];
     float3 sum = vec3(0.0f);
+    float momentSum = 0.0f;
+    float3 albedoSum = vec3(0.0f);
+    float4 normalDepthSum = vec4(0.0f, 0.0f, 0.0f, 0.0f);
+    bool mis = lightSampling != LIGHT_SAMPLING_NEXT_EVENT;
+    bool powerHeuristic = lightSampling == LIGHT_SAMPLING_MIS_POWER || lightSampling == LIGHT_SAMPLING_RESTIR;
+    bool restir = lightSampling == LIGHT_SAMPLING_RESTIR;
+    // direct light of the first surface from the reservoir of the pixel, the same for all of its samples
+    float3 restirDirect = vec3(0.0f);
     if (pixelId == width * (height / 2) + (width / 2)) {
         debugger;
     }
 
     for (uint sampleId = 0; sampleId < spp; ++sampleId) {
-        // init ray
-        float3 rayDir = rays[pixelId * spp + sampleId];
+        // init ray, with ReSTIR every sample starts at the surface the reservoir belongs to
+        uint cameraRayId = pixelId * spp + (restir ? 0 : sampleId);
+        float3 rayDir = rays[cameraRayId];
         Ray ray;
         ray.direction = rayDir;
         ray.origin = cameraPosition;
@@ -267,44 +1668,65 @@ __kernel void render_kernel(
         float3 radiance = vec3(0.0f);
         float previousIor = 1.0f;
         uint previousPrimitiveIndex = -1;
+        uint previousInstance = -1;
         float3 transmission = vec3(1.0f);
         // sample light or use emission - on full reflection, use emission
         bool sampleLight = false;
+        // with MIS, density of the BSDF sample that continued the path from sampleLight surfaces
+        float previousBsdfPdf = 0.0f;
+        // normal of the surface the ray left, light BVH importance depends on it
+        float3 previousNormal = vec3(0.0f);
         for (uint i = 0; i <= bounces; ++i) {
             Intersection intersection;
             float RR = bounces > 3 ? clamp(luminance(transmission), 0.05f, 1.0f) : 1.0f;
             if (randomFloat(&seed) > RR) {
                 break;
             }
-            if (firstIntersection(ray, bvh, triangles, &intersection)) {
-                if (i && previousPrimitiveIndex == intersection.index) {
+            if (mis) {
+                // the surviving paths stand in for the terminated ones, light samples included
+                transmission /= RR;
+            }
+            bool hit = i ? firstIntersection(ray, tlas, instances, bvh, triangles, vertices, &intersection, &traversal)
+                         : cameraRayIntersection(cameraRayId, ray, tlas, instances, bvh, triangles, vertices,
+                                                 &intersection, &traversal);
+            if (hit) {
+                __global RayTracingInstance *instance = instances + intersection.instance;
+                // rays refracted into a sphere leave it through the same shape
+                if (i && previousPrimitiveIndex == intersection.index && previousInstance == intersection.instance
+                    && instance->shape != SHAPE_SPHERE) {
                     // discard self-intersection
                     break;
                 }
                 float3 wo = -ray.direction;
                 float3 pos = intersection.position;
                 previousPrimitiveIndex = intersection.index;
+                previousInstance = intersection.instance;
+
+                float2 texcoord;
+                float3 normal = hitNormal(instance, triangles, vertexShading, &intersection, &texcoord);
 
-                Triangle triangle = triangles[intersection.index];
-                float3 te01 = triangle.v1.position - triangle.v0.position;
-                float3 te02 = triangle.v2.position - triangle.v0.position;
-                float3 triangleNormal = normalize(cross(te01, te02));
-                float3 normal = normalize(
-                    triangle.v0.normal * intersection.barycentric.x +
-                    triangle.v1.normal * intersection.barycentric.y +
-                    triangle.v2.normal * intersection.barycentric.z
-                );
-                if (intersection.side) normal = -normal;
-                float2 texcoord = (
-                    triangle.v0.texcoord * intersection.barycentric.x +
-                    triangle.v1.texcoord * intersection.barycentric.y +
-                    triangle.v2.texcoord * intersection.barycentric.z
-                );
-
-                RayTracingMaterial material = evaluateMaterial(materials + triangle.mtlIndex, textures,
+                RayTracingMaterial material = evaluateMaterial(materials + instance->mtlIndex, textures,
                     textureImage, texcoord);
+                if (i == 0 && writeAOVs) {
+                    albedoSum += material.albedo;
+                    normalDepthSum += vec4(normal.x, normal.y, normal.z, intersection.distance);
+                }
                 if (!sampleLight && !intersection.side) {
                     radiance += transmission * material.emission;
+                } else if (restir && i == 1) {
+                    // the reservoir alone lights the first surface
+                } else if (mis && !intersection.side && maxComponent(material.emission) > 0.0f) {
+                    // the light sample taken at the previous surface could have found this point as well
+                    float lightPdf = 0.0f;
+                    if (instance->lightCount) {
+                        float lightPmf = lightTreePmf(lightTree, ray.origin, previousNormal,
+                            lights[hitLight(lights, instance, intersection.index)].node);
+                        lightPdf = lightSamplePdf(instance, triangles, vertices,
+                            instance->shape == SHAPE_QUAD ? LIGHT_WHOLE_SHAPE : intersection.index, lightPmf,
+                            ray.direction, intersection.distance);
+                    }
+                    radiance += transmission * material.emission
+                                * MISWeight(previousBsdfPdf, lightPdf, powerHeuristic);
                 }
 //                radiance = vec3(texcoord, 0.0f);
 ////                radiance = normal * 0.5f + 0.5f;
@@ -322,6 +1744,8 @@ __kernel void render_kernel(
                 float metallicChance = clamp(material.metallic, 0.0f, 1.0f);
                 float refractionChance = (1.0f - metallicChance) * material.specTrans;
                 float diffuseChance = 1.0f - metallicChance - refractionChance;
+                // smooth metallic reflection and refraction are delta lobes
+                float continuousChance = diffuseChance + (material.roughness == 0.0f ? 0.0f : metallicChance);
 
                 float3 lightTransmission = transmission;
                 float ev = randomFloat(&seed);
@@ -383,43 +1807,89 @@ __kernel void render_kernel(
                 }
 
                 if (sampleLight) {
-                    // sample light
-                    if (lightCount) {
-                        uint i0 = randomInt(&seed, lightCount);
-                        uint triangleIdx = lights[i0];
-                        // select uniformly on the triangle
-                        Triangle lightTriangle = triangles[triangleIdx];
-                        float s, t;
-                        do {
-                            s = randomFloat(&seed);
-                            t = sqrt(randomFloat(&seed));
-                        } while (s + t > 1);
-                        float3 e01 = lightTriangle.v1.position - lightTriangle.v0.position;
-                        float3 e02 = lightTriangle.v2.position - lightTriangle.v0.position;
-                        float3 lightPos = lightTriangle.v0.position + s * e01 + t * e02;
-                        Intersection lightRayIntersection;
-                        Ray lightRay;
-                        lightRay.direction = normalize(lightPos - pos);
-                        lightRay.origin = pos; // + lightRay.direction;
-                        bool intersectLight = firstIntersection(lightRay, bvh, triangles, &lightRayIntersection);
-                        if (intersectLight
-                            && !lightRayIntersection.side
-                            && lightRayIntersection.index == triangleIdx) {
-                            float3 brdf = MixedBRDF(lightRay.direction, wo, normal, material.roughness,
+                    previousBsdfPdf = BSDFPdf(wi, normal, continuousChance);
+                    if (mis) {
+                        // the non-delta lobes all sample the cosine-weighted hemisphere, so the path carries the
+                        // whole BSDF over their combined density, the function light samples evaluate as well
+                        transmission = previousBsdfPdf > 0.0f
+                                       ? lightTransmission * MixedBRDF(wi, wo, normal, material.roughness, diffuseColor,
+                                           specularF0, material.specTrans, eta) * dot(wi, normal) / previousBsdfPdf
+                                       : vec3(0.0f);
+                    }
+                }
+                if (restir && i == 0) {
+                    if (continuousChance > 0.0f) {
+                        if (sampleId == 0) {
+                            Reservoir reservoir = reservoirs[pixelId];
+                            // restir_spatial_kernel already dropped the sample if this surface does not see it
+                            if (reservoir.W > 0.0f) {
+                                ReservoirSurface surface;
+                                surface.position = pos;
+                                surface.normal = normal;
+                                surface.wo = wo;
+                                surface.diffuseColor = diffuseColor;
+                                surface.specularF0 = specularF0;
+                                surface.roughness = material.roughness;
+                                surface.specTrans = material.specTrans;
+                                surface.eta = eta;
+                                surface.distance = intersection.distance;
+                                restirDirect = restirIntegrand(surface, reservoir.lightPosition, reservoir.lightNormal,
+                                    reservoir.emission) * reservoir.W;
+                            }
+                        }
+                        radiance += lightTransmission * restirDirect;
+                    }
+                } else if (mis ? continuousChance > 0.0f : sampleLight) {
+                    // sample light, with MIS on every surface with a non-delta lobe whichever lobe the path follows
+                    uint i0 = 0;
+                    float lightPmf = 0.0f;
+                    bool lightPicked = lightCount > 0;
+                    if (mis) {
+                        // in proportion to the estimated contribution of the lights
+                        lightPicked = sampleLightTree(lightTree, pos, normal, &seed, &i0, &lightPmf);
+                    } else if (lightPicked) {
+                        i0 = randomInt(&seed, lightCount);
+                    }
+                    if (lightPicked) {
+                        RayTracingLight lightSource = lights[i0];
+                        __global RayTracingInstance *lightInstance = instances + lightSource.instance;
+                        float3 lightNormal;
+                        float lightArea;
+                        float3 lightPos = sampleLightPoint(lightSource, lightInstance, triangles, vertices, &seed,
+                            &lightNormal, &lightArea);
+                        float3 lightDirection = normalize(lightPos - pos);
+                        // only the front side emits
+                        bool facesLight = dot(lightDirection, lightNormal) < 0;
+                        if (facesLight && !lightPointOccluded(pos, lightPos, tlas, instances, bvh, triangles, vertices,
+                                                              &traversal)) {
+                            float3 brdf = MixedBRDF(lightDirection, wo, normal, material.roughness,
                                 diffuseColor, specularF0, material.specTrans, eta);
-                            float3 light = materials[lightTriangle.mtlIndex].emission
-                                           * fabs(dot(lightTriangle.v0.normal, -lightRay.direction))
-                                           / length(lightPos - pos)
-                                           / (0.5f / length(cross(e01, e02))) // pdf_light
-                                           / (1.0f / lightCount) // this assumes that all lights are of the same size
-                                           * brdf
-                                           * dot(normal, lightRay.direction);
-                            radiance += lightTransmission * light / RR;
+                            if (mis) {
+                                float lightSolidAnglePdf = lightSamplePdf(lightInstance, triangles, vertices,
+                                    lightSource.triangle, lightPmf, lightDirection, length(lightPos - pos));
+                                // no BSDF sample continues the path from the last surface
+                                float bsdfPdf = i < bounces ? BSDFPdf(lightDirection, normal, continuousChance)
+                                                            : 0.0f;
+                                float weight = MISWeight(lightSolidAnglePdf, bsdfPdf, powerHeuristic);
+                                radiance += lightTransmission * materials[lightInstance->mtlIndex].emission * brdf
+                                            * dot(normal, lightDirection) / lightSolidAnglePdf * weight;
+                            } else {
+                                // this assumes that all lights are of the same size
+                                float3 light = materials[lightInstance->mtlIndex].emission
+                                               * fabs(dot(lightNormal, -lightDirection))
+                                               / length(lightPos - pos)
+                                               / (0.25f / lightArea) // pdf_light
+                                               / (1.0f / lightCount)
+                                               * brdf
+                                               * dot(normal, lightDirection);
+                                radiance += lightTransmission * light / RR;
+                            }
                         }
                     }
                 }
 
                 previousIor = next_ior;
+                previousNormal = normal;
                 ray.origin = pos;
                 ray.direction = wi;
             } else {
@@ -431,10 +1901,19 @@ __kernel void render_kernel(
 
         if (isfinite(radiance.x) && isfinite(radiance.y) && isfinite(radiance.z)) {
             sum += radiance;
+            momentSum += pow2(luminance(radiance));
         }
     }
     globalSeed[pixelId] = seed;
     output[pixelId] += vec4(sum, (float) spp);
+    moments[pixelId] += momentSum;
+    if (writeAOVs) {
+        albedo[pixelId] += vec4(albedoSum.x, albedoSum.y, albedoSum.z, 0.0f);
+        normalDepth[pixelId] += normalDepthSum;
+    }
+    if (traversal.restarts) {
+        atomic_add(traversalRestarts, traversal.restarts);
+    }
 }
 
 __kernel void test_kernel(__global float4 *output, uint width, uint height) {
@@ -445,3 +1924,77 @@ __kernel void test_kernel(__global float4 *output, uint width, uint height) {
     float fy = (float) y / (float) height;
     output[pixel_id] = vec4(fx, fy, 0.0f, 1.0f);
 }
+
+__kernel void morton_kernel(
+    __global const float3 *centroids, uint count, float3 boundsMin, float3 inverseExtent,
+    __global uint *codes, __global uint *indices
+) {
+    const uint i = get_global_id(0);
+    if (i >= count) {
+        return;
+    }
+    float3 p = (centroids[i] - boundsMin) * inverseExtent;
+    codes[i] = mortonCode(p.x, p.y, p.z);
+    indices[i] = i;
+}
+
+/*
+ * Radix sort of (key, value) pairs, RADIX_BITS per pass. Every work item owns a contiguous block of the input, so
+ * digit-major histograms turn into stable scatter offsets after a single exclusive scan.
+ */
+__kernel void radix_count_kernel(
+    __global const uint *keys, uint count, uint shift, uint blockSize, uint blockCount,
+    __global uint *histogram
+) {
+    const uint block = get_global_id(0);
+    if (block >= blockCount) {
+        return;
+    }
+    uint counts[RADIX_BUCKETS];
+    for (uint d = 0; d < RADIX_BUCKETS; ++d) {
+        counts[d] = 0;
+    }
+    uint begin = block * blockSize;
+    uint end = begin + blockSize < count ? begin + blockSize : count;
+    for (uint i = begin; i < end; ++i) {
+        counts[(keys[i] >> shift) & (RADIX_BUCKETS - 1)] += 1;
+    }
+    for (uint d = 0; d < RADIX_BUCKETS; ++d) {
+        histogram[d * blockCount + block] = counts[d];
+    }
+}
+
+__kernel void radix_scan_kernel(__global uint *histogram, uint size) {
+    // the histogram is small, a single work item does the exclusive scan
+    if (get_global_id(0) != 0) {
+        return;
+    }
+    uint sum = 0;
+    for (uint i = 0; i < size; ++i) {
+        uint value = histogram[i];
+        histogram[i] = sum;
+        sum += value;
+    }
+}
+
+__kernel void radix_scatter_kernel(
+    __global const uint *keys, __global const uint *values, uint count, uint shift, uint blockSize, uint blockCount,
+    __global const uint *histogram, __global uint *keysOut, __global uint *valuesOut
+) {
+    const uint block = get_global_id(0);
+    if (block >= blockCount) {
+        return;
+    }
+    uint offsets[RADIX_BUCKETS];
+    for (uint d = 0; d < RADIX_BUCKETS; ++d) {
+        offsets[d] = histogram[d * blockCount + block];
+    }
+    uint begin = block * blockSize;
+    uint end = begin + blockSize < count ? begin + blockSize : count;
+    for (uint i = begin; i < end; ++i) {
+        uint key = keys[i];
+        uint dst = offsets[(key >> shift) & (RADIX_BUCKETS - 1)]++;
+        keysOut[dst] = key;
+        valuesOut[dst] = values[i];
+    }
+}
@@ -10,6 +10,7 @@
 #else
 #define CPP_INLINE
 #define debugger
+#define vec2 (float2)
 #define vec3 (float3)
 #define vec4 (float4)
 #endif
@@ -51,6 +52,27 @@ CPP_INLINE float pow5(float v) {
     return t * t * v;
 }
 
+/**
+ * Spreads the lower 10 bits of v so that there are two zero bits between each of them.
+ */
+CPP_INLINE uint expandBits(uint v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/**
+ * 30-bit Morton code of a point inside the unit cube, x takes the most significant bit of each triple.
+ */
+CPP_INLINE uint mortonCode(float x, float y, float z) {
+    uint qx = (uint) min(max(x * 1024.0f, 0.0f), 1023.0f);
+    uint qy = (uint) min(max(y * 1024.0f, 0.0f), 1023.0f);
+    uint qz = (uint) min(max(z * 1024.0f, 0.0f), 1023.0f);
+    return expandBits(qx) * 4 + expandBits(qy) * 2 + expandBits(qz);
+}
+
 CPP_INLINE float maxComponent(float3 v) {
     return (v.x < v.y ? (v.y < v.z ? v.z : v.y) : (v.x < v.z ? v.z : v.x));
 }
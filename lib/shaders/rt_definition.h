@@ -3,11 +3,105 @@
 
 #include "lib/shaders/rt_structure.h"
 
-bool intersect(Ray, Triangle, Intersection *);
+float3 triangleVertex(__global Vertex *, Triangle, uint);
+
+bool intersect(Ray, __global Vertex *, Triangle, Intersection *);
+
+WatertightRay watertightRay(Ray);
+
+bool intersectLeaf(Ray, __global Triangle *, __global Vertex *, uint, uint, float, Intersection *);
+
+bool leafOccludes(Ray, __global Triangle *, __global Vertex *, uint, uint, float);
 
 bool boundsRayIntersects(Ray, Bounds3, float *, float *);
 
-bool firstIntersection(Ray, __global BVHNode *, __global Triangle *, Intersection *);
+float3 objectToWorldPoint(__global const RayTracingInstance *, float3);
+
+float3 objectToWorldVector(__global const RayTracingInstance *, float3);
+
+Ray worldToObjectRay(__global const RayTracingInstance *, Ray);
+
+bool intersectShape(Ray, __global const RayTracingInstance *, float, Intersection *);
+
+float3 shapeSurface(__global const RayTracingInstance *, float3, float2 *);
+
+float3 hitNormal(__global const RayTracingInstance *, __global Triangle *, __global VertexShading *,
+                 const Intersection *, float2 *);
+
+float lightSamplePdf(__global const RayTracingInstance *, __global Triangle *, __global Vertex *, uint, float, float3,
+                     float);
+
+float cosSubClamped(float, float, float, float);
+
+float sinSubClamped(float, float, float, float);
+
+float lightNodeImportance(__global const LightBVHNode *, float3, float3);
+
+bool sampleLightTree(__global const LightBVHNode *, float3, float3, ulong *, uint *, float *);
+
+float lightTreePmf(__global const LightBVHNode *, float3, float3, uint);
+
+uint hitLight(__global const RayTracingLight *, __global const RayTracingInstance *, uint);
+
+float3 sampleLightPoint(RayTracingLight, __global const RayTracingInstance *, __global Triangle *, __global Vertex *,
+                        ulong *, float3 *, float *);
+
+Bounds3 compressedChildBounds(__global const CompressedBVHNode *, uint);
+
+int farChildSlot(Ray, uint);
+
+void initShortStack(TRAVERSAL_STACK ShortStack *, uint);
+
+void shortStackPush(TRAVERSAL_STACK ShortStack *, uint, uint);
+
+bool shortStackPop(TRAVERSAL_STACK ShortStack *, uint *);
+
+bool restartTraversal(TRAVERSAL_STACK ShortStack *, __global BVHNode *, uint, Ray, float, uint *);
+
+bool restartCompressedTraversal(TRAVERSAL_STACK ShortStack *, __global CompressedBVHNode *, uint, Ray, float,
+                                uint *);
+
+bool bottomLevelIntersection(Ray, __global BottomLevelNode *, uint, __global Triangle *, __global Vertex *, float,
+                             bool, Intersection *, TraversalState *);
+
+bool sceneIntersection(Ray, float, bool, __global BVHNode *, __global RayTracingInstance *,
+                       __global BottomLevelNode *, __global Triangle *, __global Vertex *, Intersection *,
+                       TraversalState *);
+
+BVHNode topLevelNode(__global BVHNode *, TraversalState *, uint);
+
+bool firstIntersection(Ray, __global BVHNode *, __global RayTracingInstance *, __global BottomLevelNode *,
+                       __global Triangle *, __global Vertex *, Intersection *, TraversalState *);
+
+bool cameraRayIntersection(uint, Ray, __global BVHNode *, __global RayTracingInstance *, __global BottomLevelNode *,
+                           __global Triangle *, __global Vertex *, Intersection *, TraversalState *);
+
+bool occluded(Ray, float, __global BVHNode *, __global RayTracingInstance *, __global BottomLevelNode *,
+              __global Triangle *, __global Vertex *, TraversalState *);
+
+#ifdef LOCAL_TRAVERSAL_KERNEL
+void initLocalTraversal(TraversalState *, __local BVHNode *, __local ShortStack *, __global BVHNode *, uint);
+#endif
+
+bool lightPointOccluded(float3, float3, __global BVHNode *, __global RayTracingInstance *, __global BottomLevelNode *,
+                        __global Triangle *, __global Vertex *, TraversalState *);
+
+float3 restirIntegrand(ReservoirSurface, float3, float3, float3);
+
+float restirTargetPdf(ReservoirSurface, Reservoir);
+
+bool restirSimilar(ReservoirSurface, ReservoirSurface);
+
+void clearReservoir(Reservoir *);
+
+void restirUpdate(Reservoir *, Reservoir, float, ulong *);
+
+void restirMerge(Reservoir *, ReservoirSurface, Reservoir, float, ulong *);
+
+void restirFinalize(Reservoir *, ReservoirSurface, float);
+
+bool restirSeesSample(ReservoirSurface, Reservoir, __global BVHNode *, __global RayTracingInstance *,
+                      __global BottomLevelNode *, __global Triangle *, __global Vertex *, TraversalState *);
 
 __kernel void raygeneration_kernel(
     __global float3 *output,
@@ -19,35 +113,175 @@ __kernel void raygeneration_kernel(
 #ifdef __cplusplus
 struct RenderKernelArgs {
     constexpr static uint output = 0;
-    constexpr static uint width = 1;
-    constexpr static uint height = 2;
-    constexpr static uint bvh = 3;
-    constexpr static uint triangles = 4;
-    constexpr static uint materials = 5;
-    constexpr static uint textures = 6;
-    constexpr static uint textureImage = 7;
-    constexpr static uint lights = 8;
-    constexpr static uint lightCount = 9;
-    constexpr static uint rays = 10;
-    constexpr static uint cameraPosition = 11;
-    constexpr static uint bounces = 12;
-    constexpr static uint globalSeed = 13;
-    constexpr static uint spp = 14;
+    constexpr static uint moments = 1;
+    constexpr static uint albedo = 2;
+    constexpr static uint normalDepth = 3;
+    constexpr static uint writeAOVs = 4;
+    constexpr static uint width = 5;
+    constexpr static uint height = 6;
+    constexpr static uint pixels = 7;
+    constexpr static uint pixelCount = 8;
+    constexpr static uint tlas = 9;
+    constexpr static uint tlasSize = 10;
+    constexpr static uint instances = 11;
+    constexpr static uint bvh = 12;
+    constexpr static uint triangles = 13;
+    constexpr static uint vertices = 14;
+    constexpr static uint vertexShading = 15;
+    constexpr static uint materials = 16;
+    constexpr static uint textures = 17;
+    constexpr static uint textureImage = 18;
+    constexpr static uint lights = 19;
+    constexpr static uint lightCount = 20;
+    constexpr static uint lightTree = 21;
+    constexpr static uint rays = 22;
+    constexpr static uint cameraPosition = 23;
+    constexpr static uint bounces = 24;
+    constexpr static uint lightSampling = 25;
+    constexpr static uint reservoirs = 26;
+    constexpr static uint globalSeed = 27;
+    constexpr static uint spp = 28;
+    constexpr static uint traversalRestarts = 29;
 };
 #endif
 
 __kernel void render_kernel(
-    // output image
-    __global float4 *output, uint width, uint height,
-    // primitives and materials
-    __global BVHNode *bvh, __global Triangle *triangles, __global RayTracingMaterial *materials,
+    // output image, radiance and sample count, and the sum of the squared luminance of the samples
+    __global float4 *output, __global float *moments,
+    // sums of the albedo, and of the normal and distance in w, of the first hits, only written if writeAOVs is set
+    __global float4 *albedo, __global float4 *normalDepth, uint writeAOVs,
+    uint width, uint height,
+    // the pixels to sample, one per work item
+    __global const uint *pixels, uint pixelCount,
+    // instances, primitives and materials
+    __global BVHNode *tlas, uint tlasSize, __global RayTracingInstance *instances,
+    __global BottomLevelNode *bvh, __global Triangle *triangles,
+    __global Vertex *vertices, __global VertexShading *vertexShading,
+    __global RayTracingMaterial *materials,
     __global RayTracingTextureRange *textures, __global float4 *textureImage,
     // light tracing
-    __global const uint *lights, uint lightCount,
+    __global const RayTracingLight *lights, uint lightCount, __global const LightBVHNode *lightTree,
     // path tracing
     __global float3 *rays, float3 cameraPosition, uint bounces,
+    // one of LIGHT_SAMPLING_*
+    uint lightSampling,
+    // restir_spatial_kernel output, only read with LIGHT_SAMPLING_RESTIR
+    __global const Reservoir *reservoirs,
     // sampling
-    __global ulong *globalSeed, uint spp
+    __global ulong *globalSeed, uint spp,
+    // statistics, incremented by the number of short stack restarts
+    __global uint *traversalRestarts
+);
+
+#ifdef __cplusplus
+struct RestirInitialKernelArgs {
+    constexpr static uint width = 0;
+    constexpr static uint height = 1;
+    constexpr static uint tlas = 2;
+    constexpr static uint tlasSize = 3;
+    constexpr static uint instances = 4;
+    constexpr static uint bvh = 5;
+    constexpr static uint triangles = 6;
+    constexpr static uint vertices = 7;
+    constexpr static uint vertexShading = 8;
+    constexpr static uint materials = 9;
+    constexpr static uint textures = 10;
+    constexpr static uint textureImage = 11;
+    constexpr static uint lights = 12;
+    constexpr static uint lightTree = 13;
+    constexpr static uint rays = 14;
+    constexpr static uint cameraPosition = 15;
+    constexpr static uint spp = 16;
+    constexpr static uint globalSeed = 17;
+    constexpr static uint surfaces = 18;
+    constexpr static uint reservoirs = 19;
+    constexpr static uint history = 20;
+    constexpr static uint temporalReuse = 21;
+    constexpr static uint traversalRestarts = 22;
+};
+#endif
+
+__kernel void tile_error_kernel(
+    __global const float4 *accumulated, __global const float *moments, uint width, uint height, uint maxSamples,
+    __global float *tileErrors
+);
+
+__kernel void denoise_variance_kernel(
+    __global const float4 *accumulated, __global const float *moments, uint width, uint height,
+    __global float *variance
+);
+
+__kernel void denoise_kernel(
+    __global const float4 *accumulated, __global const float4 *albedo, __global const float4 *normalDepth,
+    __global const float4 *input, __global const float *variance, uint width, uint height, uint step,
+    __global float4 *output, __global float *filteredVariance
+);
+
+__kernel void restir_initial_kernel(
+    uint width, uint height,
+    // instances, primitives and materials, as for render_kernel
+    __global BVHNode *tlas, uint tlasSize, __global RayTracingInstance *instances,
+    __global BottomLevelNode *bvh, __global Triangle *triangles,
+    __global Vertex *vertices, __global VertexShading *vertexShading,
+    __global RayTracingMaterial *materials,
+    __global RayTracingTextureRange *textures, __global float4 *textureImage,
+    __global const RayTracingLight *lights, __global const LightBVHNode *lightTree,
+    // camera rays, the first one of each pixel is used
+    __global float3 *rays, float3 cameraPosition, uint spp,
+    __global ulong *globalSeed,
+    // per pixel outputs, and restir_spatial_kernel output of the previous frame
+    __global ReservoirSurface *surfaces, __global Reservoir *reservoirs, __global const Reservoir *history,
+    uint temporalReuse,
+    __global uint *traversalRestarts
+);
+
+#ifdef __cplusplus
+struct RestirSpatialKernelArgs {
+    constexpr static uint width = 0;
+    constexpr static uint height = 1;
+    constexpr static uint tlas = 2;
+    constexpr static uint tlasSize = 3;
+    constexpr static uint instances = 4;
+    constexpr static uint bvh = 5;
+    constexpr static uint triangles = 6;
+    constexpr static uint vertices = 7;
+    constexpr static uint globalSeed = 8;
+    constexpr static uint surfaces = 9;
+    constexpr static uint reservoirs = 10;
+    constexpr static uint finalReservoirs = 11;
+    constexpr static uint traversalRestarts = 12;
+};
+#endif
+
+__kernel void restir_spatial_kernel(
+    uint width, uint height,
+    // instances and primitives, as for render_kernel, to test the visibility of the selected samples
+    __global BVHNode *tlas, uint tlasSize, __global RayTracingInstance *instances,
+    __global BottomLevelNode *bvh, __global Triangle *triangles, __global Vertex *vertices,
+    __global ulong *globalSeed,
+    __global const ReservoirSurface *surfaces, __global const Reservoir *reservoirs, __global Reservoir *finalReservoirs,
+    __global uint *traversalRestarts
+);
+
+// LBVH construction
+#define RADIX_BITS 4
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+__kernel void morton_kernel(
+    __global const float3 *centroids, uint count, float3 boundsMin, float3 inverseExtent,
+    __global uint *codes, __global uint *indices
+);
+
+__kernel void radix_count_kernel(
+    __global const uint *keys, uint count, uint shift, uint blockSize, uint blockCount,
+    __global uint *histogram
+);
+
+__kernel void radix_scan_kernel(__global uint *histogram, uint size);
+
+__kernel void radix_scatter_kernel(
+    __global const uint *keys, __global const uint *values, uint count, uint shift, uint blockSize, uint blockCount,
+    __global const uint *histogram, __global uint *keysOut, __global uint *valuesOut
 );
 
 #endif //ASSIGNMENT_RT_DEFINITION_H
@@ -4,6 +4,10 @@
 #include "lib/shaders/rt_common.h"
 
 #define TEXTURE_NONE ((uint) 0x7fffffff)
+// maximum number of triangles referenced by a BVH leaf
+#define BVH_MAX_LEAF_SIZE 8
+// fraction of the distance to a sampled light point by which shadow rays stop short of it
+#define SHADOW_RAY_EPSILON 1e-4f
 
 typedef struct RayTracingMaterial {
     float3 albedo;
@@ -23,14 +27,6 @@ typedef struct RayTracingTextureRange {
     int width, height;
 } RayTracingTextureRange;
 
-typedef struct Vertex {
-    float3 position;
-    float3 normal;
-    float3 tangent;
-    float2 texcoord;
-    float2 padding;
-} Vertex;
-
 typedef struct Light {
     float3 position;
     float3 color;
@@ -43,7 +39,7 @@ typedef struct Bounds3 {
 
 #ifdef __cplusplus
 
-    static constexpr auto MIN_FLOAT = std::numeric_limits<float>::min();
+    static constexpr auto MIN_FLOAT = std::numeric_limits<float>::lowest();
     static constexpr auto MAX_FLOAT = std::numeric_limits<float>::max();
 
     Bounds3() : pMin{MAX_FLOAT, MAX_FLOAT, MAX_FLOAT}, pMax{MIN_FLOAT, MIN_FLOAT, MIN_FLOAT} {}
@@ -81,34 +77,327 @@ typedef struct Bounds3 {
         return (pMax + pMin) * 0.5f;
     }
 
+    float surfaceArea() const {
+        auto t = pMax - pMin;
+        return 2.0f * (t.x * t.y + t.y * t.z + t.z * t.x);
+    }
+
 #endif
 } Bounds3;
 
+#ifdef QUANTIZED_VERTICES
+// a vertex coordinate in steps of the 16 bit grid spanning the bounds of its geometry. the bottom-level BVH of the
+// geometry is built in this grid space, RayTracingInstance::objectToWorld includes the mapping back to object space
+typedef ushort VertexCoordinate;
+#else
+typedef float VertexCoordinate;
+#endif
+
+/**
+ * Object space position of a vertex in the vertex pool shared by the triangles of all geometries. Positions are kept
+ * apart from the shading attributes so that BVH leaves are tested without pulling normals and texcoords into the cache.
+ */
+typedef struct Vertex {
+    VertexCoordinate position[3];
+
+#ifdef __cplusplus
+
+    float3 point() const {
+        return vec3(position[0], position[1], position[2]);
+    }
+
+#endif
+} Vertex;
+
+/**
+ * Shading attributes of the vertex at the same index, only read for the closest hit of a ray.
+ */
+typedef struct VertexShading {
+#ifdef QUANTIZED_VERTICES
+    // octahedral encoding of the unit normal, 16 bit snorm
+    short normal[2];
+    // half floats
+    ushort texcoord[2];
+#else
+    float normal[3];
+    float texcoord[2];
+#endif
+} VertexShading;
+
 typedef struct Triangle {
-    Vertex v0, v1, v2;
-    uint mtlIndex;
-    float padding[3];
+    // indices of the vertices in the vertex pool
+    uint vertex[3];
+    // index of the first copy of this triangle, which is reported by hits. spatial BVH splits duplicate triangles
+    uint original;
 
 #ifdef __cplusplus
 
-    Bounds3 bounds() const {
-        Bounds3 ret(v0.position);
-        ret += v1.position;
-        ret += v2.position;
+    Bounds3 bounds(const Vertex *vertices) const {
+        Bounds3 ret(vertices[vertex[0]].point());
+        ret += vertices[vertex[1]].point();
+        ret += vertices[vertex[2]].point();
         return ret;
     }
 
 #endif
 } Triangle;
 
+/**
+ * Per ray constants of the watertight ray-triangle test: the axes permuted so that z is the dominant direction axis
+ * and the shear that aligns the ray with it. See Woop et al., "Watertight Ray/Triangle Intersection", JCGT 2013.
+ */
+typedef struct WatertightRay {
+    uint kx, ky, kz;
+    float sx, sy, sz;
+    float origin[3];
+} WatertightRay;
+
 typedef struct BVHNode {
     Bounds3 bounds;
+    // index of the right child, or of the first triangle of a leaf
     uint offset;
-    ushort isLeaf;
+    // number of triangles of a leaf, 0 for interior nodes
+    ushort primitiveCount;
+    // traversal order of the children of interior nodes, see BVH_DIM_AXIS_MASK
     ushort dim;
-    float padding[2];
+    // index of the parent node, the root is its own parent
+    uint parent;
+    float padding;
 } BVHNode;
 
+// the low bits of BVHNode::dim hold an axis, the child directly behind its parent lies on the low side of it unless
+// BVH_DIM_SWAPPED is set. children are visited in ray direction order along that axis
+#define BVH_DIM_AXIS_MASK 3
+#define BVH_DIM_SWAPPED 4
+
+// low bits of a compressed child reference hold the triangle count of a leaf, 0 for interior nodes
+#define BVH_CHILD_COUNT_BITS 4
+#define BVH_CHILD_COUNT_MASK ((1u << BVH_CHILD_COUNT_BITS) - 1)
+
+/**
+ * Interior BVH node with the bounds of both children quantized to 8 bits on a grid spanning the node's own bounds,
+ * so a traversal step reads 40 bytes instead of two 48 byte BVHNodes. Leaves have no node of their own, they are
+ * referenced by their parent.
+ */
+typedef struct CompressedBVHNode {
+    // grid origin, the minimum corner of the node
+    float origin[3];
+    // the grid step along an axis is 2^(exponent - 127), the bit pattern of a float with that exponent
+    uchar exponent[3];
+    // BVHNode::dim of the uncompressed node, child[0] is the child that directly followed it
+    uchar dim;
+    // conservatively rounded child bounds in grid steps, [child][min, max][axis]
+    uchar childBounds[2][2][3];
+    // (node index << BVH_CHILD_COUNT_BITS) of an interior child, (first triangle << BVH_CHILD_COUNT_BITS | count)
+    // of a leaf child
+    uint child[2];
+    // index of the parent node, the root is its own parent
+    uint parent;
+} CompressedBVHNode;
+
+// entries kept by a ShortStack, a power of two
+#define BVH_SHORT_STACK_SIZE 8
+
+/**
+ * BVH traversal stack that only keeps the BVH_SHORT_STACK_SIZE most recent entries, so that it takes little private
+ * memory. Once an entry has been dropped, the traversal restarts whenever the stack runs empty: it walks the parent
+ * links up from the last finished subtree to the next far child that was not visited yet. This keeps the traversal
+ * correct at any tree depth.
+ */
+typedef struct ShortStack {
+    // far children still to visit and their parents, a ring buffer
+    uint child[BVH_SHORT_STACK_SIZE];
+    uint parent[BVH_SHORT_STACK_SIZE];
+    uint top;
+    uint size;
+    // whether an entry has been dropped
+    uint overflowed;
+    // node whose subtree is finished once the stack runs empty
+    uint finished;
+} ShortStack;
+
+// work items per work-group of render_kernel
+#define RENDER_WORK_GROUP_SIZE 64
+// side of the square pixel tiles that adaptive sampling keeps sampling or stops as a whole, see tile_error_kernel
+#define ADAPTIVE_TILE_SIZE 16
+// samples a pixel takes before its variance estimate is trusted
+#define ADAPTIVE_MIN_SAMPLES 16
+// luminance below which the error of a pixel is no longer scaled up, see tile_error_kernel
+#define ADAPTIVE_LUMINANCE_FLOOR 0.01f
+// a-trous passes of the denoiser, the taps of pass i are 2^i pixels apart, see denoise_kernel
+#define DENOISE_PASSES 5
+// edge-stopping functions of the denoiser: the exponent of the cosine between normals, the relative depth difference
+// per pixel of distance, the albedo difference, and the luminance difference in standard deviations
+#define DENOISE_SIGMA_NORMAL 128.0f
+#define DENOISE_SIGMA_DEPTH 0.05f
+#define DENOISE_SIGMA_ALBEDO 0.1f
+#define DENOISE_SIGMA_LUMINANCE 4.0f
+// nodes at the start of the top-level BVH that a LOCAL_TRAVERSAL work-group copies to local memory, 12 KB
+#define LOCAL_TLAS_NODES 256
+
+#if defined(LOCAL_TRAVERSAL) && !defined(__cplusplus)
+// the OpenCL kernel keeps the traversal stacks of its work items in local memory
+#define LOCAL_TRAVERSAL_KERNEL
+#define TRAVERSAL_STACK __local
+#else
+#define TRAVERSAL_STACK
+#endif
+
+/**
+ * Per work item traversal state threaded through the scene queries of render_kernel. With LOCAL_TRAVERSAL the
+ * short stacks of the top and the bottom level live in local memory, along with a copy of the first tlasCacheSize
+ * nodes of the top-level BVH that every ray of the work-group starts from.
+ */
+typedef struct TraversalState {
+#ifdef LOCAL_TRAVERSAL_KERNEL
+    // the top-level stack followed by the bottom-level stack of this work item
+    __local ShortStack *stacks;
+    __local const BVHNode *tlasCache;
+    uint tlasCacheSize;
+#endif
+    // number of short stack restarts, for statistics
+    uint restarts;
+} TraversalState;
+
+#ifdef QUANTIZED_BVH
+// node type of the bottom-level BVHs traversed by the kernel
+typedef CompressedBVHNode BottomLevelNode;
+#else
+typedef BVHNode BottomLevelNode;
+#endif
+
+/**
+ * A placement of a bottom-level BVH in the scene. Ray tracing transforms rays into object space instead of
+ * transforming the triangles, so geometries shared between meshes are stored once.
+ */
+typedef struct RayTracingInstance {
+    // columns of the affine object to world transform, the last one is the translation
+    float3 objectToWorld[4];
+    // columns of the inverse transform
+    float3 worldToObject[4];
+    // root of the bottom-level BVH in the node array shared by all geometries
+    uint bvhRoot;
+    uint mtlIndex;
+    // reference to the root of the quantized bottom-level BVH, see CompressedBVHNode
+    uint compressedRoot;
+    // SHAPE_MESH, or an analytic shape that is intersected exactly in object space and has no bottom-level BVH
+    uint shape;
+    // applied to vertex normals before objectToWorld, which includes the grid step of QUANTIZED_VERTICES positions.
+    // the inverse of that step, or 1
+    float3 normalScale;
+    // radius of a SHAPE_SPHERE centered at the origin, or the sizes along x and z of a SHAPE_QUAD in the y = 0 plane
+    // that is centered at the origin and faces +y
+    float shapeSize[2];
+    // range of the lights of an emissive instance in the light list, see RayTracingLight
+    uint firstLight;
+    uint lightCount;
+} RayTracingInstance;
+
+// values of RayTracingInstance::shape
+#define SHAPE_MESH 0
+#define SHAPE_SPHERE 1
+#define SHAPE_QUAD 2
+// closest distance along the ray of an analytic shape hit, so that rays leaving a sphere do not hit it again
+#define SHAPE_EPSILON 1e-4f
+
+// RayTracingLight::triangle of an emissive SHAPE_QUAD, which is sampled as a whole
+#define LIGHT_WHOLE_SHAPE ((uint) 0xffffffff)
+
+// how render_kernel combines light samples with the emission found by BSDF samples. LIGHT_SAMPLING_NEXT_EVENT takes
+// light samples at non-specular surfaces and emission only after specular bounces, the MIS modes weight both
+#define LIGHT_SAMPLING_NEXT_EVENT 0
+#define LIGHT_SAMPLING_MIS_BALANCE 1
+#define LIGHT_SAMPLING_MIS_POWER 2
+// the first surface seen through a pixel takes its direct light from reservoirs that are resampled across pixels and
+// frames, the rest of the path is weighted like LIGHT_SAMPLING_MIS_POWER. see restir_initial_kernel
+#define LIGHT_SAMPLING_RESTIR 3
+
+/**
+ * An emissive triangle, or a whole SHAPE_QUAD. The lights of an instance are contiguous and ordered by triangle, so
+ * that the light hit by a ray is found by a binary search.
+ */
+typedef struct RayTracingLight {
+    uint instance;
+    uint triangle;
+    // leaf of the light in the light BVH
+    uint node;
+} RayTracingLight;
+
+// set in LightBVHNode::offset of leaves
+#define LIGHT_BVH_LEAF ((uint) 0x80000000)
+
+/**
+ * Node of the light BVH, which the MIS modes of render_kernel descend stochastically to pick lights in proportion to
+ * their estimated contribution to a shading point. Every leaf holds a single light. See Conty Estevez and Kulla,
+ * "Importance Sampling of Many Lights with Adaptive Tree Splitting", HPG 2018.
+ */
+typedef struct LightBVHNode {
+    // world space bounds of the lights below
+    Bounds3 bounds;
+    // unit axis of a cone that contains the front normals of the lights below
+    float3 axis;
+    // cosine of the half angle of that cone
+    float cosTheta;
+    // summed luminance of the emission times the area of the lights below
+    float power;
+    // index of the right child of an interior node, the left child directly follows it. index of the light of a leaf
+    // with LIGHT_BVH_LEAF set
+    uint offset;
+    // index of the parent node, the root is its own parent
+    uint parent;
+} LightBVHNode;
+
+// light samples streamed into the reservoir of a pixel every frame
+#define RESTIR_CANDIDATES 32
+// the temporal history of a reservoir counts at most this many times the candidates of a frame
+#define RESTIR_HISTORY_LIMIT 20
+// neighbors resampled by restir_spatial_kernel, and the radius in pixels they are picked from
+#define RESTIR_SPATIAL_SAMPLES 5
+#define RESTIR_SPATIAL_RADIUS 16.0f
+// reservoirs are only reused between surfaces whose normals are this close and whose camera distances differ by less
+// than this fraction
+#define RESTIR_NORMAL_THRESHOLD 0.9f
+#define RESTIR_DEPTH_THRESHOLD 0.1f
+
+/**
+ * The first surface seen through a pixel in the current frame, with what LIGHT_SAMPLING_RESTIR needs to evaluate its
+ * BSDF for a light sample of another pixel.
+ */
+typedef struct ReservoirSurface {
+    float3 position;
+    // shading normal on the side of the camera
+    float3 normal;
+    // unit direction to the camera
+    float3 wo;
+    float3 diffuseColor;
+    float3 specularF0;
+    float roughness;
+    float specTrans;
+    // ratio of the indices of refraction on the camera side and the other side
+    float eta;
+    // distance from the camera, 0 if there is no surface with a non-delta lobe
+    float distance;
+} ReservoirSurface;
+
+/**
+ * Weighted reservoir of light samples, see Bitterli et al., "Spatiotemporal reservoir resampling for real-time ray
+ * tracing with dynamic direct lighting", SIGGRAPH 2020. The selected sample is a point on an emitter, kept in world
+ * space so that it is evaluated at other surfaces without looking up the light again.
+ */
+typedef struct Reservoir {
+    float3 lightPosition;
+    // unit normal of the emitting side of the light
+    float3 lightNormal;
+    float3 emission;
+    // sum of the resampling weights of all candidates seen
+    float weightSum;
+    // number of candidates seen, fractional once the temporal history is clamped
+    float M;
+    // unbiased contribution weight of the selected sample, 0 if there is none or it is occluded
+    float W;
+    float padding;
+} Reservoir;
+
 typedef struct Ray {
     float3 origin;
     float3 direction;
@@ -116,12 +405,14 @@ typedef struct Ray {
 
 typedef struct Intersection {
     float3 position;
+    // barycentric coordinates of a triangle hit, or the object space position of an analytic shape hit
     float3 barycentric;
+    // triangle index (of its first copy) and the instance it was hit in
     uint index;
+    uint instance;
     float distance;
     // false if the ray is from outside or true if the ray is from inside
     uint side;
-    float padding;
 } Intersection;
 
 #endif //RT_STRUCTURE_H
@@ -82,6 +82,15 @@ class AppMain : public cg::Application {
     static constexpr int bulletMaxLife = 60 * 60;
 public:
     bool cpuRendering = false;
+    // side of the pixel tiles traced as ray packets by the cpu renderer, 0 for single rays
+    uint rtPacketSize = 0;
+    // LIGHT_SAMPLING_* of the ray tracing renderer
+    int rtLightSampling = LIGHT_SAMPLING_MIS_POWER;
+    // error at which tiles of the ray traced image stop sampling, see tile_error_kernel. 0 samples all pixels forever
+    float rtAdaptiveError = 0.02f;
+    // filter the ray traced image with the denoiser guided by the first hit AOVs
+    bool rtDenoise = false;
+    BVHBuildOptions bvhOptions;
     int rtWidth = 1024;
     int rtHeight = 576;
 
@@ -163,6 +172,19 @@ public:
         ImGui_ImplOpenGL3_Init("#version 330 core");
     }
 
+    void buildRayTracingScene() {
+        rtRendererScene.bvhOptions = bvhOptions;
+        if (!cpuRendering) {
+            // sort the Morton codes of the LBVH builder on the device
+            rtRendererScene.bvhOptions.mortonSorter = rtRenderer->mortonSorter();
+#ifndef NO_CL
+            // the kernel traverses the binary BVHs, which must be complete
+            rtRendererScene.bvhOptions.deferredLeafSize = 0;
+#endif
+        }
+        rtRendererScene.setFromScene(currentScene());
+    }
+
     void draw() override {
         static bool use_invert = false;
         static bool use_gray = false;
@@ -183,6 +205,10 @@ public:
 
         shaderPasses->renderBegin();
         if (use_ray_tracing) {
+            // moved objects (e.g. the bullet) are refitted, added or removed ones need a full rebuild
+            if (!rtRendererScene.updateFromScene(currentScene())) {
+                buildRayTracingScene();
+            }
             if (cpuRendering) {
                 rtRenderer->renderCPU(rtRendererScene, camera);
             } else {
@@ -229,11 +255,15 @@ public:
                 } else {
                     if (!rtRenderer.has_value()) {
                         rtRenderer.emplace();
+                        rtRenderer->setPacketSize(rtPacketSize);
+                        rtRenderer->setLightSampling(rtLightSampling);
+                        rtRenderer->setAdaptiveSampling(rtAdaptiveError);
+                        rtRenderer->setDenoise(rtDenoise);
                     }
                     bool rendererInited = cpuRendering ? rtRenderer->initCPU(rtWidth, rtHeight)
                                                        : rtRenderer->initCL(rtWidth, rtHeight);
                     if (rendererInited) {
-                        rtRendererScene.setFromScene(currentScene());
+                        buildRayTracingScene();
                         use_ray_tracing = true;
                     }
                 }
@@ -246,6 +276,36 @@ public:
                 }
             }
 
+            static constexpr const char *bvhMethods[] = {"median", "SAH", "LBVH", "SBVH"};
+            int bvhMethod = static_cast<int>(bvhOptions.method);
+            if (ImGui::Combo("BVH builder", &bvhMethod, bvhMethods, IM_ARRAYSIZE(bvhMethods))) {
+                bvhOptions.method = static_cast<BVHBuildMethod>(bvhMethod);
+                if (use_ray_tracing) {
+                    buildRayTracingScene();
+                }
+            }
+
+            static constexpr const char *lightSamplingModes[] = {"next event", "MIS balance", "MIS power",
+                                                                          "ReSTIR"};
+            if (ImGui::Combo("light sampling", &rtLightSampling, lightSamplingModes,
+                IM_ARRAYSIZE(lightSamplingModes))) {
+                if (rtRenderer.has_value()) {
+                    rtRenderer->setLightSampling(rtLightSampling);
+                }
+            }
+
+            if (ImGui::SliderFloat("adaptive error", &rtAdaptiveError, 0.0f, 0.1f, "%.3f")) {
+                if (rtRenderer.has_value()) {
+                    rtRenderer->setAdaptiveSampling(rtAdaptiveError);
+                }
+            }
+
+            if (ImGui::Checkbox("denoise", &rtDenoise)) {
+                if (rtRenderer.has_value()) {
+                    rtRenderer->setDenoise(rtDenoise);
+                }
+            }
+
             if (ImGui::Button("export (E)") | (glfwGetKey(window(), GLFW_KEY_E) == GLFW_PRESS)) {
                 if (use_ray_tracing && rtRenderer.has_value()) {
                     int rtWidth = rtRenderer->width();
@@ -280,6 +340,12 @@ public:
             ImGui::Checkbox("skybox", &use_skybox);
 
             ImGui::Text("spp: %d", rtRenderer.has_value() ? rtRenderer.value().sampleCount() : 0);
+            if (rtRenderer.has_value() && rtRenderer->converged()) {
+                ImGui::Text("converged");
+            } else {
+                ImGui::Text("active pixels: %u", rtRenderer.has_value() ? rtRenderer->activePixelCount() : 0u);
+            }
+            ImGui::Text("BVH restarts: %u", rtRenderer.has_value() ? rtRenderer.value().traversalRestarts() : 0u);
             ImGui::Text("mouse: (%.2f, %.2f)", lastMouseX, lastMouseY);
             ImGui::Text("average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
                 ImGui::GetIO().Framerate);
@@ -484,6 +550,35 @@ int main(int argc, const char **argv) {
         if (strcmp(argv[i], "cpu") == 0) {
             app.cpuRendering = true;
         }
+        // camera ray packets of the cpu renderer
+        if (strcmp(argv[i], "packet4") == 0) {
+            app.rtPacketSize = 4;
+        } else if (strcmp(argv[i], "packet8") == 0) {
+            app.rtPacketSize = 8;
+        }
+        // edge-avoiding denoiser on the ray traced image
+        if (strcmp(argv[i], "denoise") == 0) {
+            app.rtDenoise = true;
+        }
+        // bvh builder
+        if (strcmp(argv[i], "median") == 0) {
+            app.bvhOptions.method = BVHBuildMethod::MEDIAN;
+        } else if (strcmp(argv[i], "sah") == 0) {
+            app.bvhOptions.method = BVHBuildMethod::SAH;
+        } else if (strcmp(argv[i], "lbvh") == 0) {
+            app.bvhOptions = BVHBuildOptions::fastRebuild();
+        } else if (strcmp(argv[i], "sbvh") == 0) {
+            app.bvhOptions.method = BVHBuildMethod::SBVH;
+        }
+        // post-build treelet restructuring and node layout, for any builder
+        if (strcmp(argv[i], "treelet") == 0) {
+            app.bvhOptions.treeletSize = 7;
+            app.bvhOptions.reorderNodes = true;
+        }
+        // build only the top of the bottom-level BVHs, the cpu renderer builds the rest where rays reach it
+        if (strcmp(argv[i], "lazy") == 0) {
+            app.bvhOptions.deferredLeafSize = 4096;
+        }
         if (strlen(argv[i]) > 1) {
             if (argv[i][0] == 'w') {
                 width = strtol(argv[i] + 1, nullptr, 10);